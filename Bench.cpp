@@ -0,0 +1,520 @@
+#include "FxScript.hpp"
+#include "FxScriptBytecode.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <span>
+#include <string>
+#include <thread>
+
+using BenchClock = std::chrono::steady_clock;
+
+static double GetElapsedSeconds(BenchClock::time_point start)
+{
+    return std::chrono::duration<double>(BenchClock::now() - start).count();
+}
+
+static void BenchWrite16(FxMPPagedArray<uint8>& bytecode, uint16 value)
+{
+    bytecode.Insert(static_cast<uint8>(value >> 8));
+    bytecode.Insert(static_cast<uint8>(value));
+}
+
+static void BenchWrite32(FxMPPagedArray<uint8>& bytecode, uint32 value)
+{
+    BenchWrite16(bytecode, static_cast<uint16>(value >> 16));
+    BenchWrite16(bytecode, static_cast<uint16>(value));
+}
+
+/**
+ * @brief Builds a straight-line block of `move32`/`move32`/`add32` instructions that fills `page_count` pages of
+ * bytecode, the same page size that `FxScriptBCEmitter` uses.
+ * @return The number of instructions that were written.
+ */
+static uint32 BuildArithBytecode(FxMPPagedArray<uint8>& bytecode, uint32 page_count)
+{
+    constexpr uint32 page_size = 4096;
+
+    bytecode.Create(page_size);
+
+    uint32 instruction_count = 0;
+
+    while (bytecode.Size() < page_count * page_size) {
+        // move32 X0, [i]
+        bytecode.Insert(OpBase_Move);
+        bytecode.Insert((OpSpecMove_Int32 << 4) | FX_REG_X0);
+        BenchWrite32(bytecode, instruction_count);
+
+        // move32 X1, 3
+        bytecode.Insert(OpBase_Move);
+        bytecode.Insert((OpSpecMove_Int32 << 4) | FX_REG_X1);
+        BenchWrite32(bytecode, 3);
+
+        // add32 X0, X1
+        bytecode.Insert(OpBase_Arith);
+        bytecode.Insert(OpSpecArith_Add);
+        bytecode.Insert(FX_REG_X0);
+        bytecode.Insert(FX_REG_X1);
+
+        instruction_count += 3;
+    }
+
+    return instruction_count;
+}
+
+/**
+ * @brief Measures the dispatch rate of the VM on bytecode that spans many pages. The bytecode is linked into a
+ * flat program before execution, so the rate should not drop as the number of pages grows.
+ */
+static void BenchVMDispatch()
+{
+    const uint32 page_counts[] = { 1, 16, 64, 256 };
+
+    double link_results[std::size(page_counts)];
+    double results[std::size(page_counts)];
+    uint32 instruction_counts[std::size(page_counts)];
+
+    for (size_t i = 0; i < std::size(page_counts); i++) {
+        FxMPPagedArray<uint8> bytecode;
+        instruction_counts[i] = BuildArithBytecode(bytecode, page_counts[i]);
+
+        FxScriptProgram program;
+        FxScriptVM vm;
+
+        BenchClock::time_point start = BenchClock::now();
+        program.Link(bytecode, {});
+        link_results[i] = GetElapsedSeconds(start);
+
+        start = BenchClock::now();
+        vm.Start(program);
+        results[i] = GetElapsedSeconds(start);
+    }
+
+    puts("\n=== VM Dispatch ===\n");
+
+    for (size_t i = 0; i < std::size(page_counts); i++) {
+        const double mips = (instruction_counts[i] / results[i]) / 1'000'000.0;
+        printf("%4u pages, %8u instructions: %8.3f ms (%.1f M instructions/sec, link %.3f ms)\n", page_counts[i], instruction_counts[i],
+            results[i] * 1000.0, mips, link_results[i] * 1000.0);
+    }
+}
+
+static volatile int32 sBenchSink = 0;
+
+/**
+ * @brief Formats the arguments in the same way as the `log` function, but into a buffer so the benchmark is not
+ * measuring the terminal.
+ */
+static void BenchLogFunc(FxScriptVM* vm, std::span<const FxScriptValue> args, FxScriptValue* return_value)
+{
+    char buffer[256];
+    int length = 0;
+
+    for (const FxScriptValue& arg : args) {
+        if (arg.Type == FxScriptValue::INT) {
+            length += snprintf(buffer + length, sizeof(buffer) - length, "%d ", arg.ValueInt);
+        }
+        else if (arg.Type == FxScriptValue::STRING) {
+            length += snprintf(buffer + length, sizeof(buffer) - length, "%s ", arg.ValueString);
+        }
+    }
+
+    sBenchSink = sBenchSink + length;
+}
+
+static void BenchAddFunc(FxScriptVM* vm, std::span<const FxScriptValue> args, FxScriptValue* return_value)
+{
+    return_value->Type = FxScriptValue::INT;
+    return_value->ValueInt = args[0].ValueInt + args[1].ValueInt;
+
+    sBenchSink = return_value->ValueInt;
+}
+
+static int32 BenchNativeAddFunc(int32 a, int32 b)
+{
+    sBenchSink = a + b;
+    return a + b;
+}
+
+/**
+ * @brief Builds a block of external calls that fills `page_count` pages of bytecode. When `with_string` is set the
+ * first argument is a string from the data section, otherwise both arguments are integers.
+ * @return The number of calls that were written.
+ */
+static uint32 BuildCallBytecode(FxMPPagedArray<uint8>& bytecode, std::vector<char>& data, uint32 page_count, FxHash hashed_name, bool with_string)
+{
+    constexpr uint32 page_size = 4096;
+
+    bytecode.Create(page_size);
+
+    // The string is referenced by its offset in the data section
+    const char str[] = "value";
+
+    const uint32 str_location = static_cast<uint32>(data.size());
+    data.insert(data.end(), std::begin(str), std::end(str));
+
+    uint32 call_count = 0;
+
+    while (bytecode.Size() < page_count * page_size) {
+        bytecode.Insert(OpBase_Data);
+        bytecode.Insert(OpSpecData_ParamsStart);
+
+        if (with_string) {
+            bytecode.Insert(OpBase_Type);
+            bytecode.Insert(OpSpecType_String);
+        }
+
+        bytecode.Insert(OpBase_Push);
+        bytecode.Insert(OpSpecPush_Int32);
+        BenchWrite32(bytecode, with_string ? str_location : call_count);
+
+        bytecode.Insert(OpBase_Push);
+        bytecode.Insert(OpSpecPush_Int32);
+        BenchWrite32(bytecode, 3);
+
+        bytecode.Insert(OpBase_Jump);
+        bytecode.Insert(OpSpecJump_CallExternal);
+        BenchWrite32(bytecode, hashed_name);
+
+        ++call_count;
+    }
+
+    return call_count;
+}
+
+/**
+ * @brief Measures the number of external function calls per second for a `log` style function that formats its
+ * arguments, and for an arithmetic function that adds two integers. The arithmetic function is measured both as a
+ * `FxScriptValue` callback and as a native function bound with a generated thunk.
+ */
+static void BenchExternalCalls()
+{
+    struct BenchCall
+    {
+        const char* Name;
+        FxScriptExternalFunc::FuncType Function;
+        FxScriptExternalFunc::ThunkType Thunk;
+        bool WithString;
+    };
+
+    using NativeAddSignature = FxScriptBindSignature<decltype(&BenchNativeAddFunc)>;
+
+    const BenchCall calls[] = {
+        { "log", BenchLogFunc, nullptr, true },
+        { "add", BenchAddFunc, nullptr, false },
+        { "bind", nullptr, &NativeAddSignature::Thunk<&BenchNativeAddFunc>, false },
+    };
+
+    puts("\n=== External Calls ===\n");
+
+    for (const BenchCall& call : calls) {
+        FxScriptExternalFunc func;
+        func.HashedName = FxHashStr(call.Name);
+        func.Function = call.Function;
+        func.Thunk = call.Thunk;
+
+        if (call.Thunk != nullptr) {
+            func.ParameterTypes = NativeAddSignature::GetParameterTypes();
+        }
+        else {
+            func.IsVariadic = true;
+        }
+
+        FxMPPagedArray<uint8> bytecode;
+        std::vector<char> data;
+        const uint32 call_count = BuildCallBytecode(bytecode, data, 64, func.HashedName, call.WithString);
+
+        FxScriptProgram program;
+        program.Link(bytecode, data, { func });
+
+        FxScriptVM vm;
+
+        BenchClock::time_point start = BenchClock::now();
+        vm.Start(program);
+        const double elapsed = GetElapsedSeconds(start);
+
+        printf("%-4s %8u calls: %8.3f ms (%.2f M calls/sec)\n", call.Name, call_count, elapsed * 1000.0,
+            (call_count / elapsed) / 1'000'000.0);
+    }
+}
+
+/**
+ * @brief Builds a script with `action_count` actions that each declare and call into the previous action, so that
+ * most of the tokens are identifiers that the parser looks up.
+ */
+static std::string BuildParseScript(uint32 action_count)
+{
+    std::string script;
+
+    script += "fn action_0(int value) int\n{\n    return value;\n}\n\n";
+
+    char buffer[256];
+
+    for (uint32 i = 1; i < action_count; i++) {
+        snprintf(buffer, sizeof(buffer),
+            "fn action_%u(int value) int\n{\n    local int result_%u = action_%u(value) + value;\n    return result_%u;\n}\n\n",
+            i, i, i - 1, i);
+
+        script += buffer;
+    }
+
+    return script;
+}
+
+struct BenchStringReader
+{
+    const std::string* Data;
+    size_t Offset;
+};
+
+static size_t BenchReadString(void* user_data, char* buffer, size_t size)
+{
+    BenchStringReader* reader = static_cast<BenchStringReader*>(user_data);
+
+    const size_t read_size = std::min(size, reader->Data->size() - reader->Offset);
+    memcpy(buffer, reader->Data->data() + reader->Offset, read_size);
+
+    reader->Offset += read_size;
+
+    return read_size;
+}
+
+/**
+ * @brief Measures parsing a generated script, with the AST dump disabled, and the share of that time that is spent
+ * hashing identifiers.
+ *
+ * Each identifier token is hashed a few times, which is how often the parser calls `GetHash` on a token in
+ * `TryParseKeyword`, `FindVar` and `FindAction`. The hashing is timed on its own with the hashes from the tokenizer
+ * (hashed while lexing) and with the hashes cleared (hashed on demand), so the difference between the two is the
+ * time that hashing while lexing saves the parser. The parser creates a new `Token` from the token buffer for every
+ * lookup, so the token is fetched again for each lookup rather than reusing the hash cached on one `Token`.
+ */
+static void BenchParseHashing()
+{
+    constexpr uint32 lookups_per_token = 3;
+
+    std::string script = BuildParseScript(20000);
+
+    puts("\n=== Parse Hashing ===\n");
+
+    {
+        BenchStringReader reader { .Data = &script, .Offset = 0 };
+
+        FxConfigScript config_script;
+        config_script.SetPrintAst(false);
+
+        BenchClock::time_point start = BenchClock::now();
+
+        // Tokens are read from the stream as the parser needs them, so this includes tokenizing
+        config_script.LoadStream(BenchReadString, &reader);
+        FxAstBlock* root_block = config_script.Parse();
+
+        const double parse_elapsed = GetElapsedSeconds(start);
+
+        printf("%zu bytes, tokenized and parsed in %.3f ms%s\n", script.size(), parse_elapsed * 1000.0,
+            (root_block == nullptr) ? " (with errors)" : "");
+    }
+
+    BenchClock::time_point start = BenchClock::now();
+
+    FxTokenizer tokenizer(script.data(), static_cast<uint32>(script.size()));
+    tokenizer.Tokenize();
+
+    const double tokenize_elapsed = GetElapsedSeconds(start);
+
+    FxTokenizer::TokenBuffer& tokens = tokenizer.GetTokens();
+
+    printf("%zu bytes, %u tokens, tokenized in %.3f ms\n", script.size(), tokens.Size(), tokenize_elapsed * 1000.0);
+
+    const char* modes[] = { "lexed", "lazy" };
+
+    for (const char* mode : modes) {
+        const bool clear_hashes = (mode == modes[1]);
+
+        uint32 identifier_count = 0;
+        FxHash hash_sum = 0;
+
+        start = BenchClock::now();
+
+        for (uint32 index = 0; index < tokens.Size(); index++) {
+            if (tokens.GetType(index) != FxTokenizer::TokenType::Identifier) {
+                continue;
+            }
+
+            for (uint32 i = 0; i < lookups_per_token; i++) {
+                FxTokenizer::Token token = tokens.Get(index);
+
+                if (clear_hashes) {
+                    token.IsHashed = false;
+                }
+
+                hash_sum += token.GetHash();
+            }
+
+            ++identifier_count;
+        }
+
+        const double elapsed = GetElapsedSeconds(start);
+
+        sBenchSink = sBenchSink + static_cast<int32>(hash_sum);
+
+        printf("%-5s %8u identifiers hashed: %8.3f ms\n", mode, identifier_count, elapsed * 1000.0);
+    }
+}
+
+/**
+ * @brief Converts a token with a 32 byte stack buffer and strtoll/strtof, the way literals were converted before the
+ * tokenizer stored their values.
+ */
+static FxScriptValue BenchReparseNumber(const FxTokenizer::Token& token)
+{
+    char buffer[32];
+
+    std::strncpy(buffer, token.Start, token.Length);
+    buffer[token.Length] = 0;
+
+    FxScriptValue value;
+
+    if (token.Type == FxTokenizer::TokenType::Integer) {
+        value.Type = FxScriptValue::INT;
+        value.ValueInt = static_cast<int32>(strtoll(buffer, nullptr, 10));
+    }
+    else {
+        value.Type = FxScriptValue::FLOAT;
+        value.ValueFloat = strtof(buffer, nullptr);
+    }
+
+    return value;
+}
+
+/**
+ * @brief Measures tokenizing a data file made of large tables of integers and floats, and then reading the values of
+ * the literals. The values are read both from the tokens, where the tokenizer stored them, and by converting the
+ * text of each token again.
+ */
+static void BenchNumericLiterals()
+{
+    constexpr uint32 row_count = 100000;
+
+    std::string script;
+    char buffer[128];
+
+    for (uint32 i = 0; i < row_count; i++) {
+        snprintf(buffer, sizeof(buffer), "row(%u, %u, %u.%03u, %u.%u, %u);\n", i, i * 7919, i % 1000, i % 997,
+            i * 31, i % 10, 1000000 - i);
+
+        script += buffer;
+    }
+
+    BenchClock::time_point start = BenchClock::now();
+
+    FxTokenizer tokenizer(script.data(), static_cast<uint32>(script.size()));
+    tokenizer.Tokenize();
+
+    const double tokenize_elapsed = GetElapsedSeconds(start);
+
+    FxTokenizer::TokenBuffer& tokens = tokenizer.GetTokens();
+
+    puts("\n=== Numeric Literals ===\n");
+    printf("%zu bytes, %u tokens, tokenized in %.3f ms\n", script.size(), tokens.Size(), tokenize_elapsed * 1000.0);
+
+    const char* modes[] = { "stored", "reparse" };
+
+    for (const char* mode : modes) {
+        const bool reparse = (mode == modes[1]);
+
+        uint32 literal_count = 0;
+        float64 value_sum = 0.0;
+
+        start = BenchClock::now();
+
+        for (uint32 index = 0; index < tokens.Size(); index++) {
+            const FxTokenizer::TokenType type = tokens.GetType(index);
+
+            if (type != FxTokenizer::TokenType::Integer && type != FxTokenizer::TokenType::Float) {
+                continue;
+            }
+
+            const FxTokenizer::Token token = tokens.Get(index);
+
+            if (reparse) {
+                const FxScriptValue value = BenchReparseNumber(token);
+                value_sum += (value.Type == FxScriptValue::INT) ? value.ValueInt : value.ValueFloat;
+            }
+            else {
+                value_sum += (type == FxTokenizer::TokenType::Integer) ? token.ValueInt : token.ValueFloat;
+            }
+
+            ++literal_count;
+        }
+
+        const double elapsed = GetElapsedSeconds(start);
+
+        sBenchSink = sBenchSink + static_cast<int32>(value_sum);
+
+        printf("%-7s %8u literals: %8.3f ms\n", mode, literal_count, elapsed * 1000.0);
+    }
+}
+
+/**
+ * @brief Measures loading a script that includes many independent modules with a cold include cache, once with
+ * the modules tokenized on a single thread and once with them tokenized in parallel.
+ */
+static void BenchIncludeLoading()
+{
+    constexpr uint32 module_count = 64;
+
+    const std::filesystem::path module_dir = std::filesystem::temp_directory_path() / "fxscript-bench-modules";
+    std::filesystem::create_directories(module_dir);
+
+    std::vector<std::string> module_paths;
+
+    for (uint32 i = 0; i < module_count; i++) {
+        std::string module_path = (module_dir / ("module_" + std::to_string(i) + ".fxS")).string();
+
+        FILE* fp = fopen(module_path.c_str(), "wb");
+
+        if (fp == nullptr) {
+            printf("Could not create benchmark module '%s'\n", module_path.c_str());
+            return;
+        }
+
+        const std::string module = BuildParseScript(2000);
+        fwrite(module.data(), 1, module.size(), fp);
+        fclose(fp);
+
+        module_paths.push_back(std::move(module_path));
+    }
+
+    puts("\n=== Include Loading ===\n");
+
+    const uint32 thread_counts[] = { 1, 0 };
+
+    for (uint32 thread_count : thread_counts) {
+        FxIncludeCache::GetGlobal().Clear();
+
+        BenchClock::time_point start = BenchClock::now();
+        FxIncludeCache::GetGlobal().LoadAll(module_paths, thread_count);
+        const double elapsed = GetElapsedSeconds(start);
+
+        const uint32 used_threads = (thread_count == 0) ? std::max(1u, std::thread::hardware_concurrency()) : thread_count;
+
+        printf("%2u thread(s), %u modules: %8.3f ms\n", used_threads, module_count, elapsed * 1000.0);
+    }
+
+    FxIncludeCache::GetGlobal().Clear();
+    std::filesystem::remove_all(module_dir);
+}
+
+int main()
+{
+    BenchVMDispatch();
+    BenchExternalCalls();
+    BenchParseHashing();
+    BenchNumericLiterals();
+    BenchIncludeLoading();
+
+    return 0;
+}
@@ -0,0 +1,286 @@
+#pragma once
+
+#include "FxScriptUtil.hpp"
+
+#include <bit>
+#include <cstdlib>
+#include <vector>
+
+/**
+ * @brief Open addressing index that maps an `FxHash` to the position of an element in another container, such as
+ * a `FxMPPagedArray`. Only the first position inserted for a hash is kept, which matches a linear search from the
+ * start of the container.
+ */
+class FxHashIndex
+{
+public:
+    static constexpr uint32 NotFound = UINT32_MAX;
+
+public:
+    FxHashIndex() = default;
+
+    FxHashIndex(const FxHashIndex& other) = delete;
+    FxHashIndex& operator = (const FxHashIndex& other) = delete;
+
+    ~FxHashIndex()
+    {
+        Destroy();
+    }
+
+    /**
+     * @brief Adds a position for `hash` if the hash is not already in the index.
+     * @return true if the position was added
+     */
+    bool Insert(FxHash hash, uint32 position)
+    {
+        // Keep the load factor under 3/4 so probe sequences stay short
+        if ((mSize + 1) * 4 > mCapacity * 3) {
+            Grow();
+        }
+
+        Slot* slot = FindSlot(hash);
+
+        if (slot->Position != NotFound) {
+            return false;
+        }
+
+        slot->Hash = hash;
+        slot->Position = position;
+
+        ++mSize;
+
+        return true;
+    }
+
+    /**
+     * @brief Sets the position for `hash`, replacing the previous position if there is one.
+     */
+    void Set(FxHash hash, uint32 position)
+    {
+        if ((mSize + 1) * 4 > mCapacity * 3) {
+            Grow();
+        }
+
+        Slot* slot = FindSlot(hash);
+
+        if (slot->Position == NotFound) {
+            ++mSize;
+        }
+
+        slot->Hash = hash;
+        slot->Position = position;
+    }
+
+    /**
+     * @brief Removes `hash` from the index.
+     * @return true if the hash was in the index
+     */
+    bool Remove(FxHash hash)
+    {
+        if (mSize == 0) {
+            return false;
+        }
+
+        Slot* slot = FindSlot(hash);
+
+        if (slot->Position == NotFound) {
+            return false;
+        }
+
+        const uint32 mask = mCapacity - 1;
+
+        uint32 hole = static_cast<uint32>(slot - mSlots);
+        uint32 index = hole;
+
+        // Shift back any slots in the probe sequence after the removed slot so that there are no gaps between a
+        // hash and its home slot.
+        while (true) {
+            index = (index + 1) & mask;
+
+            const Slot& next_slot = mSlots[index];
+
+            if (next_slot.Position == NotFound) {
+                break;
+            }
+
+            const uint32 home = GetHomeIndex(next_slot.Hash);
+
+            // The slot can be moved if the hole is between its home slot and where it currently is
+            if (((index - home) & mask) >= ((index - hole) & mask)) {
+                mSlots[hole] = next_slot;
+                hole = index;
+            }
+        }
+
+        mSlots[hole].Position = NotFound;
+        --mSize;
+
+        return true;
+    }
+
+    /**
+     * @brief Finds the position stored for `hash`.
+     * @return The position, or `NotFound` if the hash is not in the index
+     */
+    uint32 Find(FxHash hash) const
+    {
+        if (mSize == 0) {
+            return NotFound;
+        }
+
+        return FindSlot(hash)->Position;
+    }
+
+    inline uint32 Size() const
+    {
+        return mSize;
+    }
+
+    void Clear()
+    {
+        for (uint32 i = 0; i < mCapacity; i++) {
+            mSlots[i].Position = NotFound;
+        }
+
+        mSize = 0;
+    }
+
+    void Destroy()
+    {
+        if (mSlots != nullptr) {
+            std::free(mSlots);
+        }
+
+        mSlots = nullptr;
+        mCapacity = 0;
+        mShift = 0;
+        mSize = 0;
+    }
+
+private:
+    struct Slot
+    {
+        FxHash Hash;
+        uint32 Position;
+    };
+
+    uint32 GetHomeIndex(FxHash hash) const
+    {
+        // Fibonacci hashing spreads out hashes that only differ in their low bits
+        return (hash * 0x9E3779B1u) >> mShift;
+    }
+
+    Slot* FindSlot(FxHash hash) const
+    {
+        uint32 index = GetHomeIndex(hash);
+
+        while (true) {
+            Slot* slot = &mSlots[index];
+
+            if (slot->Position == NotFound || slot->Hash == hash) {
+                return slot;
+            }
+
+            index = (index + 1) & (mCapacity - 1);
+        }
+    }
+
+    void Grow()
+    {
+        Slot* old_slots = mSlots;
+        const uint32 old_capacity = mCapacity;
+
+        mCapacity = (old_capacity == 0) ? 16 : old_capacity * 2;
+        mShift = 32 - std::countr_zero(mCapacity);
+
+        mSlots = static_cast<Slot*>(std::malloc(sizeof(Slot) * mCapacity));
+
+        if (mSlots == nullptr) {
+            FxPanic("FxHashIndex", "Memory error allocating slots", 0);
+            return; // for msvc
+        }
+
+        for (uint32 i = 0; i < mCapacity; i++) {
+            mSlots[i].Position = NotFound;
+        }
+
+        // Reinsert the previous slots into the new table
+        for (uint32 i = 0; i < old_capacity; i++) {
+            const Slot& old_slot = old_slots[i];
+
+            if (old_slot.Position == NotFound) {
+                continue;
+            }
+
+            (*FindSlot(old_slot.Hash)) = old_slot;
+        }
+
+        std::free(old_slots);
+    }
+
+private:
+    Slot* mSlots = nullptr;
+
+    uint32 mCapacity = 0;
+    uint32 mShift = 0;
+
+    uint32 mSize = 0;
+};
+
+/**
+ * @brief Hash index for names that are declared in nested scopes. A name declared in an inner scope shadows the
+ * outer declaration until the index is rolled back to a checkpoint taken before the inner scope.
+ */
+class FxScopedHashIndex
+{
+public:
+    using Checkpoint = uint32;
+
+public:
+    FxScopedHashIndex() = default;
+
+    void Insert(FxHash hash, uint32 position)
+    {
+        mUndoLog.push_back(UndoEntry { .Hash = hash, .PrevPosition = mIndex.Find(hash) });
+        mIndex.Set(hash, position);
+    }
+
+    uint32 Find(FxHash hash) const
+    {
+        return mIndex.Find(hash);
+    }
+
+    Checkpoint GetCheckpoint() const
+    {
+        return static_cast<Checkpoint>(mUndoLog.size());
+    }
+
+    /**
+     * @brief Removes every name inserted since `checkpoint`, restoring any names that they shadowed.
+     */
+    void Rollback(Checkpoint checkpoint)
+    {
+        while (mUndoLog.size() > checkpoint) {
+            const UndoEntry& entry = mUndoLog.back();
+
+            if (entry.PrevPosition == FxHashIndex::NotFound) {
+                mIndex.Remove(entry.Hash);
+            }
+            else {
+                mIndex.Set(entry.Hash, entry.PrevPosition);
+            }
+
+            mUndoLog.pop_back();
+        }
+    }
+
+private:
+    struct UndoEntry
+    {
+        FxHash Hash;
+        uint32 PrevPosition;
+    };
+
+    FxHashIndex mIndex;
+    std::vector<UndoEntry> mUndoLog;
+};
@@ -2,8 +2,9 @@
 
 #include "FxScriptUtil.hpp"
 
-#include <cstdlib>
+#include <bit>
 #include <cassert>
+#include <cstdlib>
 
 template <typename ElementType>
 class FxMPPagedArray
@@ -93,7 +94,11 @@ public:
         FirstPage = other.FirstPage;
         CurrentPage = other.CurrentPage;
 
+        PageDirectory = other.PageDirectory;
+        PageDirectoryCapacity = other.PageDirectoryCapacity;
+
         PageNodeCapacity = other.PageNodeCapacity;
+        PageNodeShift = other.PageNodeShift;
         CurrentPageIndex = other.CurrentPageIndex;
 
         TrackedSize = other.TrackedSize;
@@ -106,7 +111,11 @@ public:
         FirstPage = other.FirstPage;
         CurrentPage = other.CurrentPage;
 
+        PageDirectory = other.PageDirectory;
+        PageDirectoryCapacity = other.PageDirectoryCapacity;
+
         PageNodeCapacity = other.PageNodeCapacity;
+        PageNodeShift = other.PageNodeShift;
         CurrentPageIndex = other.CurrentPageIndex;
 
         TrackedSize = other.TrackedSize;
@@ -114,7 +123,11 @@ public:
         other.FirstPage = nullptr;
         other.CurrentPage = nullptr;
 
+        other.PageDirectory = nullptr;
+        other.PageDirectoryCapacity = 0;
+
         other.PageNodeCapacity = 0;
+        other.PageNodeShift = 0;
         other.CurrentPageIndex = 0;
 
         other.TrackedSize = 0;
@@ -161,7 +174,12 @@ public:
             Destroy();
         }
 
-        PageNodeCapacity = page_node_capacity;
+        // Round the capacity up to a power of two so that `Get` can find the page and the index into the
+        // page with a shift and a mask.
+        PageNodeCapacity = std::bit_ceil(page_node_capacity);
+        PageNodeShift = std::countr_zero(PageNodeCapacity);
+
+        CurrentPageIndex = 0;
 
         FirstPage = AllocateNewPage(nullptr, nullptr);
         CurrentPage = FirstPage;
@@ -188,6 +206,8 @@ public:
             // Since the size will be N + 1, decrement by one
             --CurrentPage->Size;
 
+            ++CurrentPageIndex;
+
             Page* new_page = AllocateNewPage(CurrentPage, nullptr);
 
             CurrentPage->Next = new_page;
@@ -213,6 +233,8 @@ public:
             // Since the size will be N + 1, decrement by one
             --CurrentPage->Size;
 
+            ++CurrentPageIndex;
+
             Page* new_page = AllocateNewPage(CurrentPage, nullptr);
 
             CurrentPage->Next = new_page;
@@ -267,6 +289,7 @@ public:
             std::free(page_to_remove->Data);
             std::free(page_to_remove);
 
+            PageDirectory[CurrentPageIndex] = nullptr;
             --CurrentPageIndex;
 
             return element;
@@ -295,6 +318,7 @@ public:
 
             CurrentPage->Next = nullptr;
 
+            PageDirectory[CurrentPageIndex] = nullptr;
             --CurrentPageIndex;
         }
 
@@ -325,33 +349,11 @@ public:
 
     ElementType& Get(size_t index)
     {
-        Page* page = nullptr;
-        const uint32 dest_page_index = (index / PageNodeCapacity);
-        uint32 start_index = 0;
-
-        // If the page index is closer to the end, start from the last page
-        if ((CurrentPageIndex - dest_page_index) < dest_page_index) {
-            page = CurrentPage;
-            start_index = CurrentPageIndex;
-
-            while (start_index != dest_page_index) {
-                page = page->Prev;
-                --start_index;
-            }
-        }
-        // Start from the first page
-        else {
-            page = FirstPage;
-
-            while (start_index != dest_page_index) {
-                page = page->Next;
-                ++start_index;
-            }
-        }
-
-        const uint32 item_index = index - (dest_page_index * PageNodeCapacity);
+        // Every page is tracked in the page directory, so the page can be found directly instead of walking
+        // the linked list from either end.
+        Page* page = PageDirectory[index >> PageNodeShift];
 
-        return page->Data[item_index];
+        return page->Data[index & (PageNodeCapacity - 1)];
     }
 
 
@@ -375,7 +377,13 @@ public:
             current_page = next_page;
         }
 
+        std::free(PageDirectory);
+
+        PageDirectory = nullptr;
+        PageDirectoryCapacity = 0;
+
         TrackedSize = 0;
+        CurrentPageIndex = 0;
 
         FirstPage = nullptr;
         CurrentPage = nullptr;
@@ -407,7 +415,8 @@ private:
         page->Prev = prev;
 
         // Allocate the buffer of nodes in the page
-        void* allocated_nodes = FX_SCRIPT_ALLOC_MEMORY(ElementType, (sizeof(ElementType) * PageNodeCapacity));
+        // Pages are freed with the array, so they are allocated directly instead of from the memory pool
+        void* allocated_nodes = std::malloc(sizeof(ElementType) * PageNodeCapacity);
 
         if (allocated_nodes == nullptr) {
             FxPanic("FxPagedArray", "Memory error allocating page data", 0);
@@ -416,11 +425,35 @@ private:
 
         page->Data = static_cast<ElementType*>(allocated_nodes);
 
-        ++CurrentPageIndex;
+        SetDirectoryPage(CurrentPageIndex, page);
 
         return page;
     }
 
+    void SetDirectoryPage(uint32 page_index, Page* page)
+    {
+        // Grow the page directory if the page does not fit
+        if (page_index >= PageDirectoryCapacity) {
+            uint32 new_capacity = (PageDirectoryCapacity) ? PageDirectoryCapacity * 2 : 8;
+
+            while (page_index >= new_capacity) {
+                new_capacity *= 2;
+            }
+
+            void* allocated_directory = std::realloc(PageDirectory, sizeof(Page*) * new_capacity);
+
+            if (allocated_directory == nullptr) {
+                FxPanic("FxPagedArray", "Memory error allocating page directory", 0);
+                return; // for msvc
+            }
+
+            PageDirectory = static_cast<Page**>(allocated_directory);
+            PageDirectoryCapacity = new_capacity;
+        }
+
+        PageDirectory[page_index] = page;
+    }
+
     inline void SizeCheck(uint32 size) const
     {
         if (size > PageNodeCapacity) {
@@ -430,11 +463,16 @@ private:
 
 public:
     uint32 PageNodeCapacity = 0;
+    uint32 PageNodeShift = 0;
 
     Page* FirstPage = nullptr;
     Page* CurrentPage = nullptr;
     int32 CurrentPageIndex = 0;
 
+    /** Table of every page in the array, indexed by `index >> PageNodeShift` */
+    Page** PageDirectory = nullptr;
+    uint32 PageDirectoryCapacity = 0;
+
     bool DoNotDestroy = false;
 
     uint32 TrackedSize = 0;
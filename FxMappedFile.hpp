@@ -0,0 +1,169 @@
+#pragma once
+
+#include "FxScriptUtil.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <utility>
+
+#ifdef _WIN32
+#define FX_MAPPED_FILE_USE_MMAP 0
+#else
+#define FX_MAPPED_FILE_USE_MMAP 1
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/**
+ * @brief A read only view of a file's contents. On POSIX systems the file is memory mapped, so the contents are
+ * shared through the page cache and are not copied. Other platforms fall back to reading the file into memory.
+ *
+ * The data must not be written to, and stays valid until the file is closed.
+ */
+class FxMappedFile
+{
+public:
+    FxMappedFile() = default;
+
+    FxMappedFile(const FxMappedFile& other) = delete;
+    FxMappedFile& operator = (const FxMappedFile& other) = delete;
+
+    FxMappedFile(FxMappedFile&& other) noexcept
+    {
+        (*this) = std::move(other);
+    }
+
+    FxMappedFile& operator = (FxMappedFile&& other) noexcept
+    {
+        Close();
+
+        mData = other.mData;
+        mSize = other.mSize;
+
+        other.mData = nullptr;
+        other.mSize = 0;
+
+        return *this;
+    }
+
+    ~FxMappedFile()
+    {
+        Close();
+    }
+
+    /**
+     * @brief Opens and maps the file at `path`, closing any file that is already open.
+     * @return false if the file could not be opened
+     */
+    bool Open(const char* path)
+    {
+        Close();
+
+#if FX_MAPPED_FILE_USE_MMAP
+        const int fd = open(path, O_RDONLY);
+
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat file_stat;
+
+        if (fstat(fd, &file_stat) != 0) {
+            close(fd);
+            return false;
+        }
+
+        const size_t file_size = static_cast<size_t>(file_stat.st_size);
+
+        // Empty files cannot be mapped, leave the data as null
+        if (file_size == 0) {
+            close(fd);
+            return true;
+        }
+
+        void* mapping = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        // The mapping holds its own reference to the file
+        close(fd);
+
+        if (mapping == MAP_FAILED) {
+            return false;
+        }
+
+        // Scripts are tokenized from start to end
+        madvise(mapping, file_size, MADV_SEQUENTIAL);
+
+        mData = static_cast<char*>(mapping);
+        mSize = file_size;
+#else
+        FILE* fp = FxUtil::FileOpen(path, "rb");
+
+        if (fp == nullptr) {
+            return false;
+        }
+
+        std::fseek(fp, 0, SEEK_END);
+        const size_t file_size = std::ftell(fp);
+        std::rewind(fp);
+
+        if (file_size == 0) {
+            std::fclose(fp);
+            return true;
+        }
+
+        mData = static_cast<char*>(std::malloc(file_size));
+
+        if (mData == nullptr) {
+            FxPanic("FxMappedFile", "Memory error allocating file data", 0);
+            return false; // for msvc
+        }
+
+        mSize = std::fread(mData, 1, file_size, fp);
+
+        if (mSize != file_size) {
+            printf("[WARNING] Error reading all data from file at '%s' (read=%zu, size=%zu)\n", path, mSize, file_size);
+        }
+
+        std::fclose(fp);
+#endif
+
+        return true;
+    }
+
+    void Close()
+    {
+        if (mData == nullptr) {
+            return;
+        }
+
+#if FX_MAPPED_FILE_USE_MMAP
+        munmap(mData, mSize);
+#else
+        std::free(mData);
+#endif
+
+        mData = nullptr;
+        mSize = 0;
+    }
+
+    /**
+     * @brief Gets the contents of the file. Tokens point directly into this, so it is not const, but it is mapped
+     * read only and must not be written to.
+     */
+    char* GetData() const
+    {
+        return mData;
+    }
+
+    size_t GetSize() const
+    {
+        return mSize;
+    }
+
+private:
+    char* mData = nullptr;
+    size_t mSize = 0;
+};
@@ -0,0 +1,246 @@
+#pragma once
+
+#include "FxScriptUtil.hpp"
+
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+
+/**
+ * @brief Arena allocator that backs `FX_SCRIPT_ALLOC_MEMORY` and `FX_SCRIPT_ALLOC_NODE` when
+ * `FX_SCRIPT_USE_MEMPOOL` is defined.
+ *
+ * Allocations are bumped from large chunks and are all released at once when the pool is destroyed. Objects that
+ * are not trivially destructible have their destructors run at that point, in the reverse order that they were
+ * allocated.
+ *
+ * The allocation macros do not take a pool, so a pool is bound to the current thread with `ScopedBind` for the
+ * duration of the work that should allocate from it. Allocations made while no pool is bound fall back to malloc.
+ */
+class FxMemPool
+{
+public:
+    static constexpr size_t DefaultChunkSize = 64 * 1024;
+
+    /**
+     * @brief Binds a pool to the current thread until the end of the scope, restoring the previously bound pool.
+     */
+    class ScopedBind
+    {
+    public:
+        explicit ScopedBind(FxMemPool& pool)
+            : mPrevPool(sBoundPool)
+        {
+            sBoundPool = &pool;
+        }
+
+        ScopedBind(const ScopedBind& other) = delete;
+        ScopedBind& operator = (const ScopedBind& other) = delete;
+
+        ~ScopedBind()
+        {
+            sBoundPool = mPrevPool;
+        }
+
+    private:
+        FxMemPool* mPrevPool;
+    };
+
+public:
+    FxMemPool() = default;
+
+    FxMemPool(const FxMemPool& other) = delete;
+    FxMemPool& operator = (const FxMemPool& other) = delete;
+
+    ~FxMemPool()
+    {
+        Destroy();
+    }
+
+    /**
+     * @brief Allocates `size` bytes from the bound pool and default constructs a `T` at the start of it.
+     */
+    template <typename T>
+    static T* Alloc(size_t size)
+    {
+        FxMemPool* pool = sBoundPool;
+
+        if (pool == nullptr) {
+            return FxScriptAllocMemory<T>(size);
+        }
+
+        T* ptr = static_cast<T*>(pool->Allocate(size, alignof(T)));
+
+        if constexpr (std::is_constructible_v<T>) {
+            new (ptr) T;
+
+            if constexpr (!std::is_trivially_destructible_v<T>) {
+                pool->AddFinalizer(ptr, [](void* object) { static_cast<T*>(object)->~T(); });
+            }
+        }
+
+        return ptr;
+    }
+
+    /**
+     * @brief Frees memory that was allocated with `Alloc`. Memory owned by the bound pool is released when the
+     * pool is destroyed, so this only frees memory that came from the malloc fallback.
+     */
+    template <typename T>
+    static void Free(T* ptr)
+    {
+        FxMemPool* pool = sBoundPool;
+
+        if (pool != nullptr && pool->Owns(ptr)) {
+            return;
+        }
+
+        FxScriptFreeMemory<T>(ptr);
+    }
+
+    static FxMemPool* GetBoundPool()
+    {
+        return sBoundPool;
+    }
+
+    void* Allocate(size_t size, size_t alignment)
+    {
+        if (mCurrentChunk != nullptr) {
+            void* ptr = mCurrentChunk->TryAllocate(size, alignment);
+
+            if (ptr != nullptr) {
+                return ptr;
+            }
+        }
+
+        // Large allocations get a chunk of their own
+        size_t chunk_size = DefaultChunkSize;
+
+        if (size + alignment > chunk_size) {
+            chunk_size = size + alignment;
+        }
+
+        AllocateChunk(chunk_size);
+
+        return mCurrentChunk->TryAllocate(size, alignment);
+    }
+
+    bool Owns(const void* ptr) const
+    {
+        for (const Chunk* chunk = mCurrentChunk; chunk != nullptr; chunk = chunk->Prev) {
+            if (chunk->Contains(ptr)) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * @brief Runs the destructors for all objects in the pool and frees every chunk.
+     */
+    void Destroy()
+    {
+        // Finalizers are stored newest first, so objects are destroyed in the reverse order they were created
+        for (Finalizer* finalizer = mFinalizers; finalizer != nullptr; finalizer = finalizer->Next) {
+            finalizer->Func(finalizer->Object);
+        }
+
+        mFinalizers = nullptr;
+
+        Chunk* chunk = mCurrentChunk;
+
+        while (chunk != nullptr) {
+            Chunk* prev_chunk = chunk->Prev;
+            std::free(chunk);
+            chunk = prev_chunk;
+        }
+
+        mCurrentChunk = nullptr;
+    }
+
+private:
+    struct Chunk
+    {
+        Chunk* Prev;
+
+        /** The number of bytes of data after the chunk header */
+        size_t Capacity;
+        size_t Used;
+
+        uint8* GetData()
+        {
+            return reinterpret_cast<uint8*>(this + 1);
+        }
+
+        const uint8* GetData() const
+        {
+            return reinterpret_cast<const uint8*>(this + 1);
+        }
+
+        bool Contains(const void* ptr) const
+        {
+            const uint8* ptr_u8 = static_cast<const uint8*>(ptr);
+            return (ptr_u8 >= GetData() && ptr_u8 < GetData() + Capacity);
+        }
+
+        void* TryAllocate(size_t size, size_t alignment)
+        {
+            const uintptr_t data_start = reinterpret_cast<uintptr_t>(GetData());
+            const uintptr_t aligned = (data_start + Used + alignment - 1) & ~(uintptr_t(alignment) - 1);
+
+            const size_t new_used = (aligned - data_start) + size;
+
+            if (new_used > Capacity) {
+                return nullptr;
+            }
+
+            Used = new_used;
+
+            return reinterpret_cast<void*>(aligned);
+        }
+    };
+
+    struct Finalizer
+    {
+        void (*Func)(void* object);
+        void* Object;
+
+        Finalizer* Next;
+    };
+
+    void AllocateChunk(size_t capacity)
+    {
+        void* allocated_chunk = std::malloc(sizeof(Chunk) + capacity);
+
+        if (allocated_chunk == nullptr) {
+            FxPanic("FxMemPool", "Memory error allocating chunk", 0);
+            return; // for msvc
+        }
+
+        Chunk* chunk = static_cast<Chunk*>(allocated_chunk);
+
+        chunk->Prev = mCurrentChunk;
+        chunk->Capacity = capacity;
+        chunk->Used = 0;
+
+        mCurrentChunk = chunk;
+    }
+
+    void AddFinalizer(void* object, void (*func)(void* object))
+    {
+        Finalizer* finalizer = static_cast<Finalizer*>(Allocate(sizeof(Finalizer), alignof(Finalizer)));
+
+        finalizer->Func = func;
+        finalizer->Object = object;
+        finalizer->Next = mFinalizers;
+
+        mFinalizers = finalizer;
+    }
+
+private:
+    static inline thread_local FxMemPool* sBoundPool = nullptr;
+
+    Chunk* mCurrentChunk = nullptr;
+    Finalizer* mFinalizers = nullptr;
+};
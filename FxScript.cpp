@@ -1,8 +1,12 @@
 #include "FxScript.hpp"
 
 #include <stdio.h>
+
+#include <algorithm>
+#include <array>
 #include <vector>
 
+#include "FxScriptBytecode.hpp"
 #include "FxScriptUtil.hpp"
 
 #define FX_SCRIPT_SCOPE_GLOBAL_VARS_START_SIZE 32
@@ -11,35 +15,42 @@
 #define FX_SCRIPT_SCOPE_GLOBAL_ACTIONS_START_SIZE 32
 #define FX_SCRIPT_SCOPE_LOCAL_ACTIONS_START_SIZE 32
 
+#define FX_SCRIPT_PROGRAM_CODE_ALIGNMENT 64
+
+// Zeroed bytes after the end of the code so an operand read at the end of the code can never run off the buffer
+#define FX_SCRIPT_PROGRAM_CODE_PADDING 8
+
 using Token = FxTokenizer::Token;
 using TT = FxTokenizer::TokenType;
 
 FxScriptValue FxScriptValue::None{};
 
-void FxConfigScript::LoadFile(const char* path)
+FxConfigScript::~FxConfigScript()
 {
-    FILE* fp = FxUtil::FileOpen(path, "rb");
-    if (fp == nullptr) {
-        printf("[ERROR] Could not open config file at '%s'\n", path);
-        return;
+    // The scope buffer does not destroy its elements, destroy any scopes that are still active so that their
+    // vars and indices are freed.
+    for (uint32 i = 0; i < mScopes.Size(); i++) {
+        mScopes[i].~FxScriptScope();
     }
+}
 
-    std::fseek(fp, 0, SEEK_END);
-    size_t file_size = std::ftell(fp);
-    std::rewind(fp);
+void FxConfigScript::LoadFile(const char* path)
+{
+    FxMemPool::ScopedBind bind_pool(mMemPool);
 
-    mFileData = FX_SCRIPT_ALLOC_MEMORY(char, file_size);
+    FxMappedFile file;
 
-    size_t read_size = std::fread(mFileData, 1, file_size, fp);
-    if (read_size != file_size) {
-        printf("[WARNING] Error reading all data from config file at '%s' (read=%zu, size=%zu)\n", path, read_size, file_size);
+    if (!file.Open(path)) {
+        printf("[ERROR] Could not open config file at '%s'\n", path);
+        return;
     }
 
-    FxTokenizer tokenizer(mFileData, read_size);
+    // Tokens point straight into the mapped file
+    FxTokenizer tokenizer(file.GetData(), file.GetSize());
     tokenizer.Tokenize();
 
-
-    fclose(fp);
+    mFiles.push_back(std::move(file));
+    KeepIncludedFiles(tokenizer);
 
     mTokens = std::move(tokenizer.GetTokens());
 
@@ -47,6 +58,30 @@ void FxConfigScript::LoadFile(const char* path)
         token.Print();
     }*/
 
+    CreateGlobalScope();
+}
+
+void FxConfigScript::LoadStream(FILE* fp)
+{
+    FxMemPool::ScopedBind bind_pool(mMemPool);
+
+    // Tokens are read from the stream as the parser needs them
+    mTokenStream = std::make_unique<FxTokenStream>(fp);
+
+    CreateGlobalScope();
+}
+
+void FxConfigScript::LoadStream(FxTokenStream::ReadFunc read_func, void* user_data)
+{
+    FxMemPool::ScopedBind bind_pool(mMemPool);
+
+    mTokenStream = std::make_unique<FxTokenStream>(read_func, user_data);
+
+    CreateGlobalScope();
+}
+
+void FxConfigScript::CreateGlobalScope()
+{
     mScopes.Create(8);
     mCurrentScope = mScopes.Insert();
     mCurrentScope->Vars.Create(FX_SCRIPT_SCOPE_GLOBAL_VARS_START_SIZE);
@@ -55,24 +90,68 @@ void FxConfigScript::LoadFile(const char* path)
     CreateInternalVariableTokens();
 }
 
-Token& FxConfigScript::GetToken(int offset)
+bool FxConfigScript::HasToken(int offset)
+{
+    const uint32 idx = mTokenIndex + offset;
+
+    while (idx >= mTokens.Size()) {
+        if (mTokenStream == nullptr || !mTokenStream->ReadChunk(mTokens)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void FxConfigScript::KeepIncludedFiles(FxTokenizer& tokenizer)
+{
+    for (std::shared_ptr<const FxIncludedFile>& included_file : tokenizer.GetIncludedFiles()) {
+        mIncludedFiles.push_back(std::move(included_file));
+    }
+
+    tokenizer.GetIncludedFiles().clear();
+}
+
+TT FxConfigScript::GetTokenType(int offset)
+{
+    const uint32 idx = mTokenIndex + offset;
+    if (!HasToken(offset)) {
+        printf("SOMETHING IS MISSING\n");
+    }
+    assert(idx < mTokens.Size());
+    return mTokens.GetType(idx);
+}
+
+Token FxConfigScript::GetToken(int offset)
 {
     const uint32 idx = mTokenIndex + offset;
-    if (idx < 0 || idx >= mTokens.Size()) {
+    if (!HasToken(offset)) {
         printf("SOMETHING IS MISSING\n");
     }
-    assert(idx >= 0 && idx <= mTokens.Size());
-    return mTokens[idx];
+    assert(idx < mTokens.Size());
+    return mTokens.Get(idx);
 }
 
-Token& FxConfigScript::EatToken(TT token_type)
+void FxConfigScript::EatToken(TT token_type)
 {
-    Token& token = GetToken();
-    if (token.Type != token_type) {
-        printf("[ERROR] %u:%u: Unexpected token type %s when expecting %s!\n", token.FileLine, token.FileColumn, FxTokenizer::GetTypeName(token.Type), FxTokenizer::GetTypeName(token_type));
+    const TT type = GetTokenType();
+    if (type != token_type) {
+        uint32 line, column;
+        mTokens.GetLocation(mTokenIndex, &line, &column);
+
+        printf("[ERROR] %u:%u: Unexpected token type %s when expecting %s!\n", line, column, FxTokenizer::GetTypeName(type), FxTokenizer::GetTypeName(token_type));
         mHasErrors = true;
     }
     ++mTokenIndex;
+}
+
+Token* FxConfigScript::TakeToken(TT token_type)
+{
+    Token* token = FX_SCRIPT_ALLOC_NODE(Token);
+    (*token) = GetToken();
+
+    EatToken(token_type);
+
     return token;
 }
 
@@ -83,7 +162,6 @@ Token* FxConfigScript::CreateTokenFromString(FxTokenizer::TokenType type, const
     // Create (fabricate..) the name token
     Token* token = FX_SCRIPT_ALLOC_NODE(Token);
     token->Start = FX_SCRIPT_ALLOC_MEMORY(char, name_len);
-    token->End = token->Start + name_len;
     token->Length = name_len;
     token->Type = type;
 
@@ -148,45 +226,33 @@ void PrintDocComment(FxTokenizer::Token* comment, bool is_command_mode)
 
 FxAstNode* FxConfigScript::TryParseKeyword(FxAstBlock* parent_block)
 {
-    if (mTokenIndex >= mTokens.Size()) {
+    if (!HasToken()) {
         return nullptr;
     }
 
-    Token& tk = GetToken();
-    FxHash hash = tk.GetHash();
-
+    // Keywords are given their own token types by the tokenizer
+    switch (GetTokenType()) {
     // action [name] ( < [arg type] [arg name] ...> ) { <statements...> }
-    constexpr FxHash kw_action = FxHashStr("fn");
+    case TT::KeywordFn:
+        EatToken(TT::KeywordFn);
+        return ParseActionDeclare();
 
     // local [type] [name] <?assignment> ;
-    constexpr FxHash kw_local = FxHashStr("local");
+    case TT::KeywordLocal:
+        EatToken(TT::KeywordLocal);
+        return ParseVarDeclare();
 
     // global [type] [name] <?assignment> ;
-    constexpr FxHash kw_global = FxHashStr("global");
+    case TT::KeywordGlobal:
+        EatToken(TT::KeywordGlobal);
+        return ParseVarDeclare(&mScopes[0]);
 
     // return ;
-    constexpr FxHash kw_return = FxHashStr("return");
-
-    // help [name of action] ;
-    constexpr FxHash kw_help = FxHashStr("help");
-
-    if (hash == kw_action) {
-        EatToken(TT::Identifier);
-        //ParseActionDeclare();
-        return ParseActionDeclare();
-    }
-    if (hash == kw_local) {
-        EatToken(TT::Identifier);
-        return ParseVarDeclare();
-    }
-    if (hash == kw_global) {
-        EatToken(TT::Identifier);
-        return ParseVarDeclare(&mScopes[0]);
-    }
-    if (hash == kw_return) {
-        EatToken(TT::Identifier);
+    case TT::KeywordReturn:
+    {
+        EatToken(TT::KeywordReturn);
 
-        if (GetToken().Type != TT::Semicolon) {
+        if (GetTokenType() != TT::Semicolon) {
             // There is a value that follows, get the value
             FxAstNode* rhs = ParseRhs();
 
@@ -205,10 +271,14 @@ FxAstNode* FxConfigScript::TryParseKeyword(FxAstBlock* parent_block)
         FxAstReturn* ret = FX_SCRIPT_ALLOC_NODE(FxAstReturn);
         return ret;
     }
-    if (hash == kw_help) {
-        EatToken(TT::Identifier);
 
-        FxTokenizer::Token& func_ref = EatToken(TT::Identifier);
+    // help [name of action] ;
+    case TT::KeywordHelp:
+    {
+        EatToken(TT::KeywordHelp);
+
+        FxTokenizer::Token func_ref = GetToken();
+        EatToken(TT::Identifier);
 
         FxScriptAction* action = FindAction(func_ref.GetHash());
 
@@ -222,6 +292,10 @@ FxAstNode* FxConfigScript::TryParseKeyword(FxAstBlock* parent_block)
         return nullptr;
     }
 
+    default:
+        break;
+    }
+
     return nullptr;
 }
 
@@ -240,6 +314,9 @@ void FxConfigScript::PushScope()
 void FxConfigScript::PopScope()
 {
     FxScriptScope* new_scope = mCurrentScope->Parent;
+
+    // The scope buffer does not destroy its elements, free the vars and indices before removing it
+    mScopes.GetLast().~FxScriptScope();
     mScopes.RemoveLast();
 
     assert(new_scope == &mScopes.GetLast());
@@ -262,7 +339,7 @@ FxAstVarDecl* FxConfigScript::InternalVarDeclare(FxTokenizer::Token* name_token,
 
     // Push the variable to the scope
     FxScriptVar var { name_token, type_token, scope };
-    scope->Vars.Insert(var);
+    scope->AddVar(var);
 
     return node;
 }
@@ -273,22 +350,22 @@ FxAstVarDecl* FxConfigScript::ParseVarDeclare(FxScriptScope* scope)
         scope = mCurrentScope;
     }
 
-    Token& type = EatToken(TT::Identifier);
-    Token& name = EatToken(TT::Identifier);
+    Token* type = TakeToken(TT::Identifier);
+    Token* name = TakeToken(TT::Identifier);
 
     FxAstVarDecl* node = FX_SCRIPT_ALLOC_NODE(FxAstVarDecl);
 
-    node->Name = &name;
-    node->Type = &type;
+    node->Name = name;
+    node->Type = type;
     node->DefineAsGlobal = (scope == &mScopes[0]);
 
-    FxScriptVar var { &type, &name, scope };
+    FxScriptVar var { type, name, scope };
 
     node->Assignment = TryParseAssignment(node->Name);
     /*if (node->Assignment) {
         var.Value = node->Assignment->Value;
     }*/
-    scope->Vars.Insert(var);
+    scope->AddVar(var);
 
     return node;
 }
@@ -360,14 +437,22 @@ void FxConfigScript::Execute(FxScriptVM& vm)
     if (mHasErrors || mRootBlock == nullptr) {
         return;
     }
+
+    FxAstOptimizer optimizer;
+    optimizer.Optimize(mRootBlock);
+
     printf("\n=====\n");
     FxScriptBCEmitter emitter;
     emitter.BeginEmitting(mRootBlock);
 
+    FxScriptBCOptimizer peephole(emitter);
+    peephole.Optimize();
+
     printf("\n=====\n");
 
     FxScriptBCPrinter printer(emitter.mBytecode);
     printer.Print();
+    printer.PrintData(emitter.mData);
 
     printf("\n=====\n");
 
@@ -382,8 +467,14 @@ void FxConfigScript::Execute(FxScriptVM& vm)
 
     //return;
 
-    vm.mExternalFuncs = mExternalFuncs;
-    vm.Start(std::move(emitter.mBytecode));
+    FxScriptProgram program;
+
+    if (!program.Link(emitter.mBytecode, emitter.mData, mExternalFuncs, emitter.mExternalCallNames)) {
+        printf("!!! Could not link program, not executing\n");
+        return;
+    }
+
+    vm.Start(program);
 
     for (FxScriptBytecodeVarHandle& handle : emitter.VarHandles) {
         printf("Var(%u) AT %lld -> %u\n", handle.HashedName, handle.Offset, vm.Stack[handle.Offset]);
@@ -399,7 +490,7 @@ void FxConfigScript::Execute(FxScriptVM& vm)
 
     for (FxScriptVar& var : global_scope.Vars) {
         if (var.IsExternal) {
-            interpreter_global_scope.Vars.Insert(var);
+            interpreter_global_scope.AddVar(var);
         }
     }
 
@@ -410,6 +501,8 @@ void FxConfigScript::Execute(FxScriptVM& vm)
 
 bool FxConfigScript::ExecuteUserCommand(const char* command, FxScriptInterpreter& interpreter)
 {
+    FxMemPool::ScopedBind bind_pool(mMemPool);
+
     mHasErrors = false;
 
     // If there are errors, exit early
@@ -430,10 +523,9 @@ bool FxConfigScript::ExecuteUserCommand(const char* command, FxScriptInterpreter
         FxTokenizer tokenizer(data_buffer, length_of_command);
         tokenizer.Tokenize();
 
-        for (FxTokenizer::Token& token : tokenizer.GetTokens()) {
-            //token.Print();
-            mTokens.Insert(token);
-        }
+        KeepIncludedFiles(tokenizer);
+
+        mTokens.Append(tokenizer.GetTokens());
 
         /*for (FxTokenizer::Token& token : mTokens) {
             token.Print();
@@ -487,7 +579,7 @@ bool FxConfigScript::ExecuteUserCommand(const char* command, FxScriptInterpreter
 
 FxScriptValue FxConfigScript::ParseValue()
 {
-    Token& token = GetToken();
+    Token token = GetToken();
     TT token_type = token.Type;
     FxScriptValue value;
 
@@ -524,12 +616,12 @@ FxScriptValue FxConfigScript::ParseValue()
     case TT::Integer:
         EatToken(TT::Integer);
         value.Type = FxScriptValue::INT;
-        value.ValueInt = token.ToInt();
+        value.ValueInt = token.ValueInt;
         break;
     case TT::Float:
         EatToken(TT::Float);
         value.Type = FxScriptValue::FLOAT;
-        value.ValueFloat = token.ToFloat();
+        value.ValueFloat = token.ValueFloat;
         break;
     case TT::String:
         EatToken(TT::String);
@@ -544,7 +636,7 @@ FxScriptValue FxConfigScript::ParseValue()
 
 #define RETURN_IF_NO_TOKENS(rval_) \
     { \
-        if (mTokenIndex >= mTokens.Size()) \
+        if (!HasToken()) \
             return (rval_); \
     }
 
@@ -553,134 +645,226 @@ static bool IsTokenTypeLiteral(FxTokenizer::TokenType type)
     return (type == TT::Integer || type == TT::Float || type == TT::String);
 }
 
-FxAstNode* FxConfigScript::ParseRhs()
-{
+/**
+ * @brief Gets the binding power of a binary operator. Operators with a higher precedence bind tighter, and 0 is
+ * returned for tokens that are not binary operators.
+ */
+static int GetBinopPrecedence(FxTokenizer::TokenType type)
+{
+    switch (type) {
+    case TT::Asterisk:
+    case TT::Slash:
+    case TT::Percent:
+        return 10;
+    case TT::Plus:
+    case TT::Minus:
+        return 9;
+    case TT::ShiftLeft:
+    case TT::ShiftRight:
+        return 8;
+    case TT::Less:
+    case TT::LessEquals:
+    case TT::Greater:
+    case TT::GreaterEquals:
+        return 7;
+    case TT::EqualsEquals:
+    case TT::BangEquals:
+        return 6;
+    case TT::Ampersand:
+        return 5;
+    case TT::Caret:
+        return 4;
+    case TT::Pipe:
+        return 3;
+    default:;
+    }
 
+    return 0;
+}
+
+/**
+ * @brief Gets the arithmetic op for a binary operator token, or 0 if the token is not a binary operator.
+ */
+static uint8 GetArithOpSpec(FxTokenizer::TokenType type)
+{
+    switch (type) {
+    case TT::Plus:
+        return OpSpecArith_Add;
+    case TT::Minus:
+        return OpSpecArith_Sub;
+    case TT::Asterisk:
+        return OpSpecArith_Mul;
+    case TT::Slash:
+        return OpSpecArith_Div;
+    case TT::Percent:
+        return OpSpecArith_Mod;
+    case TT::Ampersand:
+        return OpSpecArith_And;
+    case TT::Pipe:
+        return OpSpecArith_Or;
+    case TT::Caret:
+        return OpSpecArith_Xor;
+    case TT::ShiftLeft:
+        return OpSpecArith_Shl;
+    case TT::ShiftRight:
+        return OpSpecArith_Shr;
+    case TT::EqualsEquals:
+        return OpSpecArith_CmpEq;
+    case TT::BangEquals:
+        return OpSpecArith_CmpNe;
+    case TT::Less:
+        return OpSpecArith_CmpLt;
+    case TT::LessEquals:
+        return OpSpecArith_CmpLe;
+    case TT::Greater:
+        return OpSpecArith_CmpGt;
+    case TT::GreaterEquals:
+        return OpSpecArith_CmpGe;
+    default:;
+    }
+
+    return 0;
+}
+
+FxAstNode* FxConfigScript::ParseOperand()
+{
     RETURN_IF_NO_TOKENS(nullptr);
 
-    bool has_parameters = false;
+    // Unary minus. Only the last minus is kept, as every pair of minuses cancels out.
+    Token* negate_token = nullptr;
+    bool is_negated = false;
 
-    if (mTokenIndex + 1 < mTokens.Size()) {
-        TT next_token_type = GetToken(1).Type;
-        has_parameters = next_token_type == TT::LParen;
+    while (GetTokenType() == TT::Minus) {
+        negate_token = TakeToken(TT::Minus);
+        is_negated = !is_negated;
 
-        if (mInCommandMode) {
-            has_parameters = next_token_type == TT::Identifier || next_token_type == TT::Integer || next_token_type == TT::Float || next_token_type == TT::String;
-        }
+        RETURN_IF_NO_TOKENS(nullptr);
     }
 
-    FxTokenizer::Token& token = GetToken();
+    FxAstNode* operand = nullptr;
 
-    FxAstNode* lhs = nullptr;
+    if (GetTokenType() == TT::LParen) {
+        EatToken(TT::LParen);
+        operand = ParseRhs();
+        EatToken(TT::RParen);
+    }
+    else {
+        bool has_parameters = false;
 
-    if (token.Type == TT::Identifier) {
-        if (has_parameters) {
-            lhs = ParseActionCall();
-        }
-        else {
-            FxScriptExternalFunc* external_action = FindExternalAction(token.GetHash());
-            if (external_action != nullptr) {
-                lhs = ParseActionCall();
-            }
+        if (HasToken(1)) {
+            TT next_token_type = GetTokenType(1);
+            has_parameters = next_token_type == TT::LParen;
 
-            FxScriptAction* action = FindAction(token.GetHash());
-            if (action != nullptr) {
-                lhs = ParseActionCall();
+            if (mInCommandMode) {
+                has_parameters = next_token_type == TT::Identifier || next_token_type == TT::Integer || next_token_type == TT::Float || next_token_type == TT::String;
             }
-
         }
-    }
-    if (!lhs) {
-        if (IsTokenTypeLiteral(token.Type) || token.Type == TT::Identifier) {
-            FxAstLiteral* literal = FX_SCRIPT_ALLOC_NODE(FxAstLiteral);
 
-            FxScriptValue value = ParseValue();
-            literal->Value = value;
+        FxTokenizer::Token token = GetToken();
 
-            lhs = literal;
-        }
-        else {
-            lhs = ParseRhs();
+        if (token.Type == TT::Identifier) {
+            if (has_parameters) {
+                operand = ParseActionCall();
+            }
+            else if (FindExternalAction(token.GetHash()) != nullptr || FindAction(token.GetHash()) != nullptr) {
+                operand = ParseActionCall();
+            }
         }
-    }
 
+        if (!operand) {
+            if (IsTokenTypeLiteral(token.Type) || token.Type == TT::Identifier) {
+                FxAstLiteral* literal = FX_SCRIPT_ALLOC_NODE(FxAstLiteral);
+                literal->Value = ParseValue();
 
-    // FxAstLiteral* literal = FX_SCRIPT_ALLOC_NODE(FxAstLiteral);
-    // literal->Value = value;
+                operand = literal;
+            }
+            else {
+                uint32 line, column;
+                mTokens.GetLocation(mTokenIndex, &line, &column);
 
-    TT op_type = GetToken(0).Type;
-    if (op_type == TT::Plus || op_type == TT::Minus) {
-        FxAstBinop* binop = FX_SCRIPT_ALLOC_NODE(FxAstBinop);
+                printf("[ERROR] %u:%u: Unexpected token type %s in expression!\n", line, column, FxTokenizer::GetTypeName(token.Type));
+                mHasErrors = true;
 
-        binop->Left = lhs;
-        binop->OpToken = &EatToken(op_type);
-        binop->Right = ParseRhs();
+                return nullptr;
+            }
+        }
+    }
 
-        return binop;
+    if (!is_negated || operand == nullptr) {
+        return operand;
     }
 
-    return lhs;
+    // Negate numeric literals in place
+    if (operand->NodeType == FX_AST_LITERAL) {
+        FxAstLiteral* literal = reinterpret_cast<FxAstLiteral*>(operand);
 
-    /*
-    RETURN_IF_NO_TOKENS(nullptr);
+        if (literal->Value.Type == FxScriptValue::INT) {
+            literal->Value.ValueInt = static_cast<int32>(0u - static_cast<uint32>(literal->Value.ValueInt));
+            return literal;
+        }
+        if (literal->Value.Type == FxScriptValue::FLOAT) {
+            literal->Value.ValueFloat = -literal->Value.ValueFloat;
+            return literal;
+        }
+    }
 
-    bool has_parameters = false;
+    // Anything else is subtracted from zero
+    FxAstLiteral* zero = FX_SCRIPT_ALLOC_NODE(FxAstLiteral);
+    zero->Value.Type = FxScriptValue::INT;
+    zero->Value.ValueInt = 0;
 
-    if (mTokenIndex + 1 < mTokens.Size()) {
-        TT next_token_type = GetToken(1).Type;
-        has_parameters = next_token_type == TT::LParen;
+    FxAstBinop* binop = FX_SCRIPT_ALLOC_NODE(FxAstBinop);
+    binop->Left = zero;
+    binop->OpToken = negate_token;
+    binop->Right = operand;
 
-        if (mInCommandMode) {
-            has_parameters = next_token_type == TT::Identifier || next_token_type == TT::Integer || next_token_type == TT::Float || next_token_type == TT::String;
-        }
-    }
+    return binop;
+}
 
-    FxTokenizer::Token& token = GetToken();
+FxAstNode* FxConfigScript::ParseRhs()
+{
+    // Operators that are waiting for their right hand side are kept on `mPendingBinops` instead of the call stack,
+    // so long expressions do not recurse. Expressions in parentheses or parameters start above `stack_base`.
+    const size_t stack_base = mPendingBinops.size();
 
-    FxAstNode* lhs = nullptr;
+    FxAstNode* rhs = ParseOperand();
 
-    if (token.Type == TT::Identifier) {
-        if (has_parameters) {
-            lhs = ParseActionCall();
-        }
-        else {
-            FxScriptExternalFunc* external_action = FindExternalAction(token.GetHash());
-            if (external_action != nullptr) {
-                return ParseActionCall();
-            }
+    while (rhs != nullptr) {
+        const TT op_type = HasToken() ? GetTokenType() : TT::Unknown;
+        const int precedence = GetBinopPrecedence(op_type);
 
-            FxScriptAction* action = FindAction(token.GetHash());
-            if (action != nullptr) {
-                return ParseActionCall();
-            }
+        // Everything on the stack that binds at least as tight as the next operator is complete. Reducing on equal
+        // precedence makes the operators left associative.
+        while (mPendingBinops.size() > stack_base && mPendingBinops.back().Precedence >= precedence) {
+            FxAstBinop* binop = mPendingBinops.back().Binop;
+            mPendingBinops.pop_back();
 
+            binop->Right = rhs;
+            rhs = binop;
         }
-    }
 
-    else if (IsTokenTypeLiteral(token.Type) || token.Type == TT::Identifier) {
-        FxAstLiteral* literal = FX_SCRIPT_ALLOC_NODE(FxAstLiteral);
-        literal->Value = ParseValue();
-        lhs = literal;
-    }
+        if (precedence == 0) {
+            return rhs;
+        }
 
-    TT op_type = GetToken(0).Type;
-    if (op_type == TT::Plus || op_type == TT::Minus) {
         FxAstBinop* binop = FX_SCRIPT_ALLOC_NODE(FxAstBinop);
+        binop->Left = rhs;
+        binop->OpToken = TakeToken(op_type);
 
-        binop->Left = lhs;
-        binop->OpToken = &EatToken(op_type);
-        binop->Right = ParseRhs();
+        mPendingBinops.push_back(PendingBinop { .Binop = binop, .Precedence = precedence });
 
-        return binop;
+        rhs = ParseOperand();
     }
 
-    return lhs;
-    */
+    // An operand is missing, drop the rest of the expression
+    mPendingBinops.resize(stack_base);
+
+    return nullptr;
 }
 
 FxAstAssign* FxConfigScript::TryParseAssignment(FxTokenizer::Token* var_name)
 {
-    if (GetToken().Type != TT::Equals) {
+    if (GetTokenType() != TT::Equals) {
         return nullptr;
     }
 
@@ -701,6 +885,8 @@ FxAstAssign* FxConfigScript::TryParseAssignment(FxTokenizer::Token* var_name)
 
 void FxConfigScript::DefineExternalVar(const char* type, const char* name, const FxScriptValue& value)
 {
+    FxMemPool::ScopedBind bind_pool(mMemPool);
+
     Token* name_token = FX_SCRIPT_ALLOC_MEMORY(Token, sizeof(Token));
     Token* type_token = FX_SCRIPT_ALLOC_MEMORY(Token, sizeof(Token));
 
@@ -733,7 +919,7 @@ void FxConfigScript::DefineExternalVar(const char* type, const char* name, const
     FxScriptVar var(type_token, name_token, definition_scope, true);
     var.Value = value;
 
-    definition_scope->Vars.Insert(var);
+    definition_scope->AddVar(var);
 
     // To prevent the variable data from being deleted here.
     var.Name = nullptr;
@@ -749,9 +935,9 @@ FxAstNode* FxConfigScript::ParseStatementAsCommand(FxAstBlock* parent_block)
     RETURN_IF_NO_TOKENS(nullptr);
 
     // Eat any extraneous semicolons
-    while (GetToken().Type == TT::Semicolon) {
+    while (GetTokenType() == TT::Semicolon) {
         EatToken(TT::Semicolon);
-        if (mTokenIndex >= mTokens.Size()) {
+        if (!HasToken()) {
             return nullptr;
         }
     }
@@ -767,16 +953,16 @@ FxAstNode* FxConfigScript::ParseStatementAsCommand(FxAstBlock* parent_block)
     }
 
     // Check identifier
-    if (mTokenIndex < mTokens.Size() && GetToken().Type == TT::Identifier) {
+    if (HasToken() && GetTokenType() == TT::Identifier) {
         TT next_token_type = TT::Unknown;
 
-        if (mTokenIndex + 1 < mTokens.Size()) {
-            next_token_type = GetToken(1).Type;
+        if (HasToken(1)) {
+            next_token_type = GetTokenType(1);
         }
 
-        if (mTokenIndex + 1 < mTokens.Size() && GetToken(1).Type == TT::Equals) {
-            Token& assign_name = EatToken(TT::Identifier);
-            node = TryParseAssignment(&assign_name);
+        if (HasToken(1) && GetTokenType(1) == TT::Equals) {
+            Token* assign_name = TakeToken(TT::Identifier);
+            node = TryParseAssignment(assign_name);
         }
         // If there is what looks to be a function call, try it
         else {
@@ -812,7 +998,7 @@ FxAstNode* FxConfigScript::ParseStatement(FxAstBlock* parent_block)
 
     RETURN_IF_NO_TOKENS(nullptr);
 
-    if (GetToken().Type == TT::Dollar) {
+    if (GetTokenType() == TT::Dollar) {
         EatToken(TT::Dollar);
 
         mInCommandMode = true;
@@ -825,34 +1011,34 @@ FxAstNode* FxConfigScript::ParseStatement(FxAstBlock* parent_block)
         return cmd_mode;
     }
 
-    while (GetToken().Type == TT::DocComment) {
+    while (GetTokenType() == TT::DocComment) {
         FxAstDocComment* comment = FX_SCRIPT_ALLOC_NODE(FxAstDocComment);
-        comment->Comment = &EatToken(TT::DocComment);
+        comment->Comment = TakeToken(TT::DocComment);
         CurrentDocComments.push_back(comment);
 
-        if (mTokenIndex >= mTokens.Size()) {
+        if (!HasToken()) {
             return nullptr;
         }
     }
 
     // Eat any extraneous semicolons
-    while (GetToken().Type == TT::Semicolon) {
+    while (GetTokenType() == TT::Semicolon) {
         EatToken(TT::Semicolon);
 
-        if (mTokenIndex >= mTokens.Size()) {
+        if (!HasToken()) {
             return nullptr;
         }
     }
 
     FxAstNode* node = TryParseKeyword(parent_block);
 
-    if (!node && (mTokenIndex < mTokens.Size() && GetToken().Type == TT::Identifier)) {
-        if (mTokenIndex + 1 < mTokens.Size() && GetToken(1).Type == TT::LParen) {
+    if (!node && (HasToken() && GetTokenType() == TT::Identifier)) {
+        if (HasToken(1) && GetTokenType(1) == TT::LParen) {
             node = ParseActionCall();
         }
-        else if (mTokenIndex + 1 < mTokens.Size() && GetToken(1).Type == TT::Equals) {
-            Token& assign_name = EatToken(TT::Identifier);
-            node = TryParseAssignment(&assign_name);
+        else if (HasToken(1) && GetTokenType(1) == TT::Equals) {
+            Token* assign_name = TakeToken(TT::Identifier);
+            node = TryParseAssignment(assign_name);
         }
         else {
             GetToken().Print();
@@ -883,7 +1069,7 @@ FxAstBlock* FxConfigScript::ParseBlock()
 
     EatToken(TT::LBrace);
 
-    while (GetToken().Type != TT::RBrace) {
+    while (GetTokenType() != TT::RBrace) {
         FxAstNode* command = ParseStatement(block);
         if (command == nullptr) {
             break;
@@ -907,9 +1093,9 @@ FxAstActionDecl* FxConfigScript::ParseActionDeclare()
     }
 
     // Name of the action
-    Token& name = EatToken(TT::Identifier);
+    Token* name = TakeToken(TT::Identifier);
 
-    node->Name = &name;
+    node->Name = name;
 
     PushScope();
     EatToken(TT::LParen);
@@ -917,10 +1103,10 @@ FxAstActionDecl* FxConfigScript::ParseActionDeclare()
     FxAstBlock* params = FX_SCRIPT_ALLOC_NODE(FxAstBlock);
 
     // Parse the parameter list
-    while (GetToken().Type != TT::RParen) {
+    while (GetTokenType() != TT::RParen) {
         params->Statements.push_back(ParseVarDeclare());
 
-        if (GetToken().Type == TT::Comma) {
+        if (GetTokenType() == TT::Comma) {
             EatToken(TT::Comma);
             continue;
         }
@@ -931,19 +1117,19 @@ FxAstActionDecl* FxConfigScript::ParseActionDeclare()
     EatToken(TT::RParen);
 
     // Parse the return type
-    /*if (GetToken().Type != TT::LBrace) {
+    /*if (GetTokenType() != TT::LBrace) {
         FxAstVarDecl* return_decl = ParseVarDeclare();
         node->ReturnVar = return_decl;
     }*/
 
     // Check to see if there is a return type provided
-    if (GetToken().Type != TT::LBrace) {
+    if (GetTokenType() != TT::LBrace) {
         // There is a return type, declare the __ReturnVal__ variable
 
         // Get the token for the type
-        Token& type_token = EatToken(TT::Identifier);
+        Token* type_token = TakeToken(TT::Identifier);
 
-        FxAstVarDecl* return_decl = InternalVarDeclare(mTokenReturnVar, &type_token);
+        FxAstVarDecl* return_decl = InternalVarDeclare(mTokenReturnVar, type_token);
         node->ReturnVar = return_decl;
     }
 
@@ -953,8 +1139,8 @@ FxAstActionDecl* FxConfigScript::ParseActionDeclare()
 
     node->Params = params;
 
-    FxScriptAction action(&name, mCurrentScope, node->Block, node);
-    mCurrentScope->Actions.Insert(action);
+    FxScriptAction action(name, mCurrentScope, node->Block, node);
+    mCurrentScope->AddAction(action);
 
     return node;
 }
@@ -977,9 +1163,9 @@ FxAstActionCall* FxConfigScript::ParseActionCall()
 {
     FxAstActionCall* node = FX_SCRIPT_ALLOC_NODE(FxAstActionCall);
 
-    Token& name = EatToken(TT::Identifier);
+    node->Name = TakeToken(TT::Identifier);
+    node->HashedName = node->Name->GetHash();
 
-    node->HashedName = name.GetHash();
     node->Action = FindAction(node->HashedName);
 
     TT end_token_type = TT::Semicolon;
@@ -988,11 +1174,11 @@ FxAstActionCall* FxConfigScript::ParseActionCall()
         end_token_type = TT::RParen;
     }
 
-    if (!mInCommandMode || GetToken().Type == TT::LParen) {
+    if (!mInCommandMode || GetTokenType() == TT::LParen) {
         EatToken(TT::LParen);
     }
 
-    while (GetToken().Type != end_token_type) {
+    while (GetTokenType() != end_token_type) {
         FxAstNode* param = ParseRhs();
 
         if (param == nullptr) {
@@ -1001,9 +1187,9 @@ FxAstActionCall* FxConfigScript::ParseActionCall()
 
         node->Params.push_back(param);
 
-        TT next_tt = GetToken().Type;
+        TT next_tt = GetTokenType();
 
-        if (GetToken().Type == TT::Comma) {
+        if (GetTokenType() == TT::Comma) {
             EatToken(TT::Comma);
             continue;
         }
@@ -1016,7 +1202,7 @@ FxAstActionCall* FxConfigScript::ParseActionCall()
         break;
     }
 
-    if (!mInCommandMode || GetToken().Type == TT::RParen) {
+    if (!mInCommandMode || GetTokenType() == TT::RParen) {
         EatToken(TT::RParen);
     }
 
@@ -1060,6 +1246,8 @@ FxAstActionCall* FxConfigScript::ParseActionCall()
 
 FxAstBlock* FxConfigScript::Parse()
 {
+    FxMemPool::ScopedBind bind_pool(mMemPool);
+
     FxAstBlock* root_block = FX_SCRIPT_ALLOC_NODE(FxAstBlock);
 
     FxAstNode* keyword;
@@ -1075,8 +1263,10 @@ FxAstBlock* FxConfigScript::Parse()
         return nullptr;
     }
 
-    FxAstPrinter printer(root_block);
-    printer.Print(root_block);
+    if (mPrintAst) {
+        FxAstPrinter printer(root_block);
+        printer.Print(root_block);
+    }
 
     return root_block;
 }
@@ -1122,6 +1312,9 @@ void FxScriptInterpreter::PushScope()
 void FxScriptInterpreter::PopScope()
 {
     FxScriptScope* new_scope = mCurrentScope->Parent;
+
+    // The scope buffer does not destroy its elements, free the vars and indices before removing it
+    mScopes.GetLast().~FxScriptScope();
     mScopes.RemoveLast();
 
     assert(new_scope == &mScopes.GetLast());
@@ -1256,7 +1449,7 @@ FxScriptValue FxScriptInterpreter::VisitActionCall(FxAstActionCall* call)
         FxScriptVar param(decl->Type, decl->Name, mCurrentScope);
         param.Value = GetImmediateValue(VisitRhs(call->Params[i]));
 
-        mCurrentScope->Vars.Insert(param);
+        mCurrentScope->AddVar(param);
     }
 
 
@@ -1264,9 +1457,7 @@ FxScriptValue FxScriptInterpreter::VisitActionCall(FxAstActionCall* call)
         FxAstVarDecl* decl = call->Action->Declaration->ReturnVar;
 
         FxScriptVar return_var(decl->Type, decl->Name, mCurrentScope);
-        mCurrentScope->Vars.Insert(return_var);
-
-        mCurrentScope->ReturnVar = &mCurrentScope->Vars.GetLast();
+        mCurrentScope->ReturnVar = mCurrentScope->AddVar(return_var);
 
     }
 
@@ -1303,33 +1494,72 @@ FxScriptValue FxScriptInterpreter::VisitRhs(FxAstNode* node)
         FxScriptValue lhs = GetImmediateValue(lhs_pre_val);
         FxScriptValue rhs = GetImmediateValue(rhs_pre_val);
 
-        float sign = (binop->OpToken->Type == TT::Plus) ? 1.0f : -1.0f;
-
         FxScriptValue result;
 
-        if (lhs.Type == FxScriptValue::INT) {
-            result.ValueInt = lhs.ValueInt;
-            result.Type = FxScriptValue::INT;
+        const bool is_lhs_numeric = (lhs.Type == FxScriptValue::INT || lhs.Type == FxScriptValue::FLOAT);
+        const bool is_rhs_numeric = (rhs.Type == FxScriptValue::INT || rhs.Type == FxScriptValue::FLOAT);
 
-            if (rhs.Type == FxScriptValue::INT) {
-                result.ValueInt += rhs.ValueInt * sign;
-            }
-            else if (rhs.Type == FxScriptValue::FLOAT) {
-                result.ValueInt += rhs.ValueFloat * sign;
-            }
+        if (!is_lhs_numeric || !is_rhs_numeric) {
+            return result;
         }
-        else if (lhs.Type == FxScriptValue::FLOAT) {
-            result.ValueFloat = lhs.ValueFloat;
+
+        const uint8 op_spec = GetArithOpSpec(binop->OpToken->Type);
+        const bool is_comparison = (op_spec >= OpSpecArith_CmpEq);
+
+        // The result has the type of the lhs, comparisons are done as floats if either side is a float
+        const bool use_float = (lhs.Type == FxScriptValue::FLOAT || (is_comparison && rhs.Type == FxScriptValue::FLOAT));
+        const bool is_float_op = (is_comparison || op_spec == OpSpecArith_Add || op_spec == OpSpecArith_Sub || op_spec == OpSpecArith_Mul || op_spec == OpSpecArith_Div);
+
+        if (use_float && is_float_op) {
+            const float a = (lhs.Type == FxScriptValue::FLOAT) ? lhs.ValueFloat : static_cast<float>(lhs.ValueInt);
+            const float b = (rhs.Type == FxScriptValue::FLOAT) ? rhs.ValueFloat : static_cast<float>(rhs.ValueInt);
+
             result.Type = FxScriptValue::FLOAT;
 
-            if (rhs.Type == FxScriptValue::INT) {
-                result.ValueFloat += rhs.ValueInt * sign;
-            }
-            else if (rhs.Type == FxScriptValue::FLOAT) {
-                result.ValueFloat += rhs.ValueFloat * sign;
+            switch (op_spec) {
+            case OpSpecArith_Add:
+                result.ValueFloat = a + b;
+                break;
+            case OpSpecArith_Sub:
+                result.ValueFloat = a - b;
+                break;
+            case OpSpecArith_Mul:
+                result.ValueFloat = a * b;
+                break;
+            case OpSpecArith_Div:
+                result.ValueFloat = a / b;
+                break;
+            // Comparisons produce an int
+            case OpSpecArith_CmpEq:
+                result = FxScriptValue(FxScriptValue::INT, (a == b));
+                break;
+            case OpSpecArith_CmpNe:
+                result = FxScriptValue(FxScriptValue::INT, (a != b));
+                break;
+            case OpSpecArith_CmpLt:
+                result = FxScriptValue(FxScriptValue::INT, (a < b));
+                break;
+            case OpSpecArith_CmpLe:
+                result = FxScriptValue(FxScriptValue::INT, (a <= b));
+                break;
+            case OpSpecArith_CmpGt:
+                result = FxScriptValue(FxScriptValue::INT, (a > b));
+                break;
+            case OpSpecArith_CmpGe:
+                result = FxScriptValue(FxScriptValue::INT, (a >= b));
+                break;
             }
+
+            return result;
         }
 
+        // Integer ops, floats are truncated
+        const int32 a = (lhs.Type == FxScriptValue::FLOAT) ? static_cast<int32>(lhs.ValueFloat) : lhs.ValueInt;
+        const int32 b = (rhs.Type == FxScriptValue::FLOAT) ? static_cast<int32>(rhs.ValueFloat) : rhs.ValueInt;
+
+        result.Type = FxScriptValue::INT;
+        result.ValueInt = FxScriptEvalArith32(op_spec, a, b);
+
         return result;
     }
 
@@ -1343,14 +1573,11 @@ void FxConfigScript::DefineDefaultExternalFunctions()
     RegisterExternalFunc(
         FxHashStr("log"),
         {},        // Do not check argument types as we handle it here
-        [](FxScriptVM* vm, std::vector<FxScriptValue>& args, FxScriptValue* return_value)
+        [](FxScriptVM* vm, std::span<const FxScriptValue> args, FxScriptValue* return_value)
         {
             printf("[SCRIPT]: ");
 
-            for (int i = args.size() - 1; i >= 0; i--) {
-
-                FxScriptValue& arg = args[i];
-
+            for (const FxScriptValue& arg : args) {
                 //const FxScriptValue& value = interpreter.GetImmediateValue(arg);
                 const FxScriptValue& value = arg;
 
@@ -1384,7 +1611,7 @@ void FxConfigScript::DefineDefaultExternalFunctions()
     //RegisterExternalFunc(
     //    FxHashStr("__listvars__"),
     //    {},
-    //    [](FxScriptVM* vm, std::vector<FxScriptValue>& args, FxScriptValue* return_value)
+    //    [](FxScriptVM* vm, std::span<const FxScriptValue> args, FxScriptValue* return_value)
     //    {
     //        FxScriptScope* scope = interpreter.mCurrentScope;
     //        // Since there is a new scope created on function call, we need to start from the parent scope
@@ -1404,7 +1631,7 @@ void FxConfigScript::DefineDefaultExternalFunctions()
     //RegisterExternalFunc(
     //    FxHashStr("__listactions__"),
     //    {},
-    //    [](FxScriptVM* vm, std::vector<FxScriptValue>& args, FxScriptValue* return_value)
+    //    [](FxScriptVM* vm, std::span<const FxScriptValue> args, FxScriptValue* return_value)
     //    {
     //        FxScriptScope* scope = interpreter.mCurrentScope;
     //        // Since there is a new scope created on function call, we need to start from the parent scope
@@ -1534,7 +1761,7 @@ void FxScriptInterpreter::Visit(FxAstNode* node)
         //puts("Visit ActionDecl");
 
         FxScriptAction action(actiondecl->Name, mCurrentScope, actiondecl->Block, actiondecl);
-        mCurrentScope->Actions.Insert(action);
+        mCurrentScope->AddAction(action);
 
         //Visit(actiondecl->Block);
     }
@@ -1548,7 +1775,7 @@ void FxScriptInterpreter::Visit(FxAstNode* node)
         }
 
         FxScriptVar var(vardecl->Type, vardecl->Name, scope);
-        scope->Vars.Insert(var);
+        scope->AddVar(var);
 
         Visit(vardecl->Assignment);
     }
@@ -1625,7 +1852,7 @@ void FxScriptInterpreter::DefineExternalVar(const char* type, const char* name,
     FxScriptVar var(type_token, name_token, definition_scope, true);
     var.Value = value;
 
-    definition_scope->Vars.Insert(var);
+    definition_scope->AddVar(var);
 }
 
 const FxScriptValue& FxScriptInterpreter::GetImmediateValue(const FxScriptValue& value)
@@ -1664,124 +1891,318 @@ void FxConfigScript::RegisterExternalFunc(FxHash func_name, std::vector<FxScript
 
 
 /////////////////////////////////////////
-// Script Bytecode Emitter
+// Script AST Optimizer
 /////////////////////////////////////////
 
-#include "FxScriptBytecode.hpp"
-
-void FxScriptBCEmitter::BeginEmitting(FxAstNode* node)
+void FxAstOptimizer::Optimize(FxAstBlock* root_block)
 {
-    mStackSize = 1024;
-
-    /*mStack = new uint8[1024];
-    mStackStart = mStack;*/
-
-    mBytecode.Create(4096);
-    VarHandles.Create(64);
+    // A variable can be used before a later assignment to it runs, such as in an action that is called after the
+    // assignment. Find every assigned variable first so that none of them are propagated.
+    mIsFindingAssignments = true;
+    Visit(root_block);
 
-    Emit(node);
-
-    printf("\n");
+    mVars.clear();
+    mVarIndex.Rollback(0);
 
-    PrintBytecode();
+    mIsFindingAssignments = false;
+    Visit(root_block);
 }
 
-#define RETURN_IF_NO_NODE(node_) \
-    if ((node_) == nullptr) { return; }
-
-#define RETURN_VALUE_IF_NO_NODE(node_, value_) \
-    if ((node_) == nullptr) { return (value_); }
-
-void FxScriptBCEmitter::Emit(FxAstNode* node)
+void FxAstOptimizer::Visit(FxAstNode* node)
 {
-    RETURN_IF_NO_NODE(node);
+    if (node == nullptr) {
+        return;
+    }
 
     if (node->NodeType == FX_AST_BLOCK) {
-        return EmitBlock(reinterpret_cast<FxAstBlock*>(node));
+        for (FxAstNode* statement : reinterpret_cast<FxAstBlock*>(node)->Statements) {
+            Visit(statement);
+        }
     }
     else if (node->NodeType == FX_AST_ACTIONDECL) {
-        return EmitAction(reinterpret_cast<FxAstActionDecl*>(node));
-    }
-    else if (node->NodeType == FX_AST_ACTIONCALL) {
-        return DoActionCall(reinterpret_cast<FxAstActionCall*>(node));
-    }
-    else if (node->NodeType == FX_AST_ASSIGN) {
-        return EmitAssign(reinterpret_cast<FxAstAssign*>(node));
+        VisitAction(reinterpret_cast<FxAstActionDecl*>(node));
     }
     else if (node->NodeType == FX_AST_VARDECL) {
-        DoVarDeclare(reinterpret_cast<FxAstVarDecl*>(node));
-        return;
+        VisitVarDecl(reinterpret_cast<FxAstVarDecl*>(node));
     }
-    else if (node->NodeType == FX_AST_RETURN) {
-        constexpr FxHash return_val_hash = FxHashStr(FX_SCRIPT_VAR_RETURN_VAL);
+    else if (node->NodeType == FX_AST_ASSIGN) {
+        FxAstAssign* assign = reinterpret_cast<FxAstAssign*>(node);
 
-        FxScriptBytecodeVarHandle* return_var = FindVarHandle(return_val_hash);
+        if (mIsFindingAssignments) {
+            VarInfo* var = FindVar(assign->Var->Name->GetHash());
 
-        if (return_var) {
-            DoLoad(return_var->Offset, FX_REG_XR);
+            if (var != nullptr) {
+                mAssignedVars.insert(var->Decl);
+            }
         }
 
-        EmitJumpReturnToCaller();
-
-        return;
+        assign->Rhs = VisitRhs(assign->Rhs);
+    }
+    else if (node->NodeType == FX_AST_ACTIONCALL) {
+        VisitRhs(node);
+    }
+    else if (node->NodeType == FX_AST_COMMANDMODE) {
+        Visit(reinterpret_cast<FxAstCommandMode*>(node)->Node);
     }
 }
 
-FxScriptBytecodeVarHandle* FxScriptBCEmitter::FindVarHandle(FxHash hashed_name)
+void FxAstOptimizer::VisitAction(FxAstActionDecl* action)
 {
-    for (FxScriptBytecodeVarHandle& handle : VarHandles) {
-        if (handle.HashedName == hashed_name) {
-            return &handle;
+    // Parameters and variables declared in the action are removed from lookups at the end of the action
+    const FxScopedHashIndex::Checkpoint checkpoint = mVarIndex.GetCheckpoint();
+
+    // Parameters are set by the caller, so they are never constant
+    for (FxAstNode* param : action->Params->Statements) {
+        if (param->NodeType == FX_AST_VARDECL) {
+            DeclareVar(reinterpret_cast<FxAstVarDecl*>(param));
         }
     }
-    return nullptr;
-}
 
-FxScriptBytecodeActionHandle* FxScriptBCEmitter::FindActionHandle(FxHash hashed_name)
-{
-    for (FxScriptBytecodeActionHandle& handle : ActionHandles) {
-        if (handle.HashedName == hashed_name) {
-            return &handle;
-        }
+    if (action->ReturnVar != nullptr) {
+        DeclareVar(action->ReturnVar);
     }
-    return nullptr;
-}
 
+    Visit(action->Block);
 
+    mVarIndex.Rollback(checkpoint);
+}
 
-FxScriptRegister FxScriptBCEmitter::FindFreeRegister()
+void FxAstOptimizer::VisitVarDecl(FxAstVarDecl* decl)
 {
-    uint16 gp_r = 0x01;
+    // The variable is declared before its initializer, matching the emitter
+    const uint32 var_position = DeclareVar(decl);
 
-    const uint16 num_gp_regs = FX_REG_X3;
+    if (decl->Assignment == nullptr) {
+        return;
+    }
 
-    for (int i = 0; i < num_gp_regs; i++) {
-        if (!(mRegsInUse & gp_r)) {
-            // We are starting on 0x01, so register index should be N + 1
-            const int register_index = i + 1;
+    FxAstNode* rhs = VisitRhs(decl->Assignment->Rhs);
+    decl->Assignment->Rhs = rhs;
 
-            return static_cast<FxScriptRegister>(register_index);
-        }
+    if (mIsFindingAssignments || mAssignedVars.contains(decl)) {
+        return;
+    }
 
-        gp_r <<= 1;
+    constexpr FxHash type_int = FxHashStr("int");
+
+    if (decl->Type->GetHash() != type_int || rhs == nullptr || rhs->NodeType != FX_AST_LITERAL) {
+        return;
     }
 
-    return FxScriptRegister::FX_REG_NONE;
+    const FxAstLiteral* literal = reinterpret_cast<FxAstLiteral*>(rhs);
+
+    if (literal->Value.Type != FxScriptValue::INT) {
+        return;
+    }
+
+    VarInfo& var = mVars[var_position];
+
+    var.IsConstant = true;
+    var.Value = literal->Value.ValueInt;
 }
 
-const char* FxScriptBCEmitter::GetRegisterName(FxScriptRegister reg)
+FxAstNode* FxAstOptimizer::VisitRhs(FxAstNode* node)
 {
-    switch (reg) {
-    case FX_REG_NONE:
-        return "NONE";
-    case FX_REG_X0:
-        return "X0";
+    if (node == nullptr) {
+        return nullptr;
+    }
+
+    if (node->NodeType == FX_AST_LITERAL) {
+        FxAstLiteral* literal = reinterpret_cast<FxAstLiteral*>(node);
+
+        if (mIsFindingAssignments || literal->Value.Type != FxScriptValue::REF) {
+            return node;
+        }
+
+        VarInfo* var = FindVar(literal->Value.ValueRef->Name->GetHash());
+
+        if (var != nullptr && var->IsConstant) {
+            literal->Value.Type = FxScriptValue::INT;
+            literal->Value.ValueInt = var->Value;
+        }
+
+        return node;
+    }
+    else if (node->NodeType == FX_AST_BINOP) {
+        FxAstBinop* binop = reinterpret_cast<FxAstBinop*>(node);
+
+        binop->Left = VisitRhs(binop->Left);
+        binop->Right = VisitRhs(binop->Right);
+
+        if (binop->Left == nullptr || binop->Left->NodeType != FX_AST_LITERAL || binop->Right == nullptr ||
+            binop->Right->NodeType != FX_AST_LITERAL) {
+            return node;
+        }
+
+        FxAstLiteral* lhs = reinterpret_cast<FxAstLiteral*>(binop->Left);
+        const FxAstLiteral* rhs = reinterpret_cast<FxAstLiteral*>(binop->Right);
+
+        const uint8 op_spec = GetArithOpSpec(binop->OpToken->Type);
+
+        if (op_spec == 0 || lhs->Value.Type != FxScriptValue::INT || rhs->Value.Type != FxScriptValue::INT) {
+            return node;
+        }
+
+        // Evaluated with the same semantics as the VM so the folded result matches the emitted code
+        lhs->Value.ValueInt = FxScriptEvalArith32(op_spec, lhs->Value.ValueInt, rhs->Value.ValueInt);
+
+        return lhs;
+    }
+    else if (node->NodeType == FX_AST_ACTIONCALL) {
+        FxAstActionCall* call = reinterpret_cast<FxAstActionCall*>(node);
+
+        for (FxAstNode*& param : call->Params) {
+            param = VisitRhs(param);
+        }
+    }
+
+    return node;
+}
+
+uint32 FxAstOptimizer::DeclareVar(FxAstVarDecl* decl)
+{
+    const uint32 position = static_cast<uint32>(mVars.size());
+
+    mVars.push_back(VarInfo { .Decl = decl });
+    mVarIndex.Insert(decl->Name->GetHash(), position);
+
+    return position;
+}
+
+FxAstOptimizer::VarInfo* FxAstOptimizer::FindVar(FxHash hashed_name)
+{
+    const uint32 position = mVarIndex.Find(hashed_name);
+
+    if (position == FxHashIndex::NotFound) {
+        return nullptr;
+    }
+
+    return &mVars[position];
+}
+
+
+/////////////////////////////////////////
+// Script Bytecode Emitter
+/////////////////////////////////////////
+
+void FxScriptBCEmitter::BeginEmitting(FxAstNode* node)
+{
+    mStackSize = 1024;
+
+    /*mStack = new uint8[1024];
+    mStackStart = mStack;*/
+
+    mBytecode.Create(4096);
+    VarHandles.Create(64);
+
+    Emit(node);
+
+    printf("\n");
+
+    PrintBytecode();
+}
+
+#define RETURN_IF_NO_NODE(node_) \
+    if ((node_) == nullptr) { return; }
+
+#define RETURN_VALUE_IF_NO_NODE(node_, value_) \
+    if ((node_) == nullptr) { return (value_); }
+
+void FxScriptBCEmitter::Emit(FxAstNode* node)
+{
+    RETURN_IF_NO_NODE(node);
+
+    if (node->NodeType == FX_AST_BLOCK) {
+        return EmitBlock(reinterpret_cast<FxAstBlock*>(node));
+    }
+    else if (node->NodeType == FX_AST_ACTIONDECL) {
+        return EmitAction(reinterpret_cast<FxAstActionDecl*>(node));
+    }
+    else if (node->NodeType == FX_AST_ACTIONCALL) {
+        return DoActionCall(reinterpret_cast<FxAstActionCall*>(node));
+    }
+    else if (node->NodeType == FX_AST_ASSIGN) {
+        return EmitAssign(reinterpret_cast<FxAstAssign*>(node));
+    }
+    else if (node->NodeType == FX_AST_VARDECL) {
+        DoVarDeclare(reinterpret_cast<FxAstVarDecl*>(node));
+        return;
+    }
+    else if (node->NodeType == FX_AST_RETURN) {
+        constexpr FxHash return_val_hash = FxHashStr(FX_SCRIPT_VAR_RETURN_VAL);
+
+        FxScriptBytecodeVarHandle* return_var = FindVarHandle(return_val_hash);
+
+        if (return_var) {
+            DoLoad(return_var->Offset, FX_REG_XR);
+        }
+
+        EmitJumpReturnToCaller();
+
+        return;
+    }
+}
+
+FxScriptBytecodeVarHandle* FxScriptBCEmitter::FindVarHandle(FxHash hashed_name)
+{
+    const uint32 position = mVarHandleIndex.Find(hashed_name);
+
+    if (position == FxHashIndex::NotFound) {
+        return nullptr;
+    }
+
+    return &VarHandles[position];
+}
+
+FxScriptBytecodeActionHandle* FxScriptBCEmitter::FindActionHandle(FxHash hashed_name)
+{
+    const uint32 position = mActionHandleIndex.Find(hashed_name);
+
+    if (position == FxHashIndex::NotFound) {
+        return nullptr;
+    }
+
+    return &ActionHandles[position];
+}
+
+
+
+FxScriptRegister FxScriptBCEmitter::FindFreeRegister()
+{
+    // Only search the registers that the expression allocator hands out, the reload registers are reserved for
+    // spilled operands.
+    for (uint32 reg = FxScriptRegisterAllocator::FirstRegister; reg <= FxScriptRegisterAllocator::LastRegister; reg++) {
+        const FxScriptRegister gp_reg = static_cast<FxScriptRegister>(reg);
+
+        if (!(mRegsInUse & RegToRegFlag(gp_reg))) {
+            return gp_reg;
+        }
+    }
+
+    return FxScriptRegister::FX_REG_NONE;
+}
+
+const char* FxScriptBCEmitter::GetRegisterName(FxScriptRegister reg)
+{
+    switch (reg) {
+    case FX_REG_NONE:
+        return "NONE";
+    case FX_REG_X0:
+        return "X0";
     case FX_REG_X1:
         return "X1";
     case FX_REG_X2:
         return "X2";
     case FX_REG_X3:
         return "X3";
+    case FX_REG_X4:
+        return "X4";
+    case FX_REG_X5:
+        return "X5";
+    case FX_REG_X6:
+        return "X6";
+    case FX_REG_X7:
+        return "X7";
     case FX_REG_RA:
         return "RA";
     case FX_REG_XR:
@@ -1807,6 +2228,14 @@ FxScriptRegister FxScriptBCEmitter::RegFlagToReg(FxScriptRegisterFlag reg_flag)
         return FX_REG_X2;
     case FX_REGFLAG_X3:
         return FX_REG_X3;
+    case FX_REGFLAG_X4:
+        return FX_REG_X4;
+    case FX_REGFLAG_X5:
+        return FX_REG_X5;
+    case FX_REGFLAG_X6:
+        return FX_REG_X6;
+    case FX_REGFLAG_X7:
+        return FX_REG_X7;
     case FX_REGFLAG_RA:
         return FX_REG_RA;
     case FX_REGFLAG_XR:
@@ -1829,6 +2258,14 @@ FxScriptRegisterFlag FxScriptBCEmitter::RegToRegFlag(FxScriptRegister reg)
         return FX_REGFLAG_X2;
     case FX_REG_X3:
         return FX_REGFLAG_X3;
+    case FX_REG_X4:
+        return FX_REGFLAG_X4;
+    case FX_REG_X5:
+        return FX_REGFLAG_X5;
+    case FX_REG_X6:
+        return FX_REGFLAG_X6;
+    case FX_REG_X7:
+        return FX_REGFLAG_X7;
     case FX_REG_RA:
         return FX_REGFLAG_RA;
     case FX_REG_XR:
@@ -1860,6 +2297,7 @@ void FxScriptBCEmitter::WriteOp(uint8 op_base, uint8 op_spec)
     mBytecode.Insert(op_spec);
 }
 
+
 using RhsMode = FxScriptBCEmitter::RhsMode;
 
 #define MARK_REGISTER_USED(regn_) { MarkRegisterUsed(regn_); }
@@ -1999,6 +2437,12 @@ void FxScriptBCEmitter::EmitMoveInt32(FxScriptRegister reg, uint32 value)
     Write32(value);
 }
 
+void FxScriptBCEmitter::EmitMoveReg32(FxScriptRegister dest_reg, FxScriptRegister src_reg)
+{
+    WriteOp(OpBase_Move, (OpSpecMove_Reg32 << 4) | (dest_reg & 0x0F));
+    Write16(src_reg);
+}
+
 void FxScriptBCEmitter::EmitParamsStart()
 {
     WriteOp(OpBase_Data, OpSpecData_ParamsStart);
@@ -2015,69 +2459,246 @@ void FxScriptBCEmitter::EmitType(FxScriptValue::ValueType type)
     WriteOp(OpBase_Type, op_type);
 }
 
-uint32 FxScriptBCEmitter::EmitDataString(char* str, uint16 length)
+uint32 FxScriptBCEmitter::InternDataString(const char* str, uint16 length)
 {
+    const FxHash hash = FxHashStr(str, length);
+    const uint32 existing_offset = mDataIndex.Find(hash);
 
-    WriteOp(OpBase_Data, OpSpecData_String);
+    // Check the contents in case two different strings have the same hash
+    if (existing_offset != FxHashIndex::NotFound && strncmp(&mData[existing_offset], str, length) == 0 &&
+        mData[existing_offset + length] == 0) {
+        return existing_offset;
+    }
 
-    uint32 start_index = mBytecode.Size();
+    const uint32 offset = static_cast<uint32>(mData.size());
 
-    uint16 final_length = length + 1;
+    mData.insert(mData.end(), str, str + length);
+    mData.push_back(0);
 
-    // If the length is not a factor of 2 (sizeof uint16) then add a byte of padding
-    if ((final_length & 0x01)) {
-        ++final_length;
-    }
+    // Only the first string with a hash is indexed, strings that collide with it are stored again
+    mDataIndex.Insert(hash, offset);
 
-    Write16(final_length);
+    return offset;
+}
 
-    for (int i = 0; i < final_length; i += 2) {
-        mBytecode.Insert(str[i]);
 
-        if (i >= length) {
-            mBytecode.Insert(0);
-            break;
+void FxScriptRegisterAllocator::Allocate(const std::vector<FxScriptIRInstr>& instrs)
+{
+    const uint32 value_count = static_cast<uint32>(instrs.size());
+
+    mLastUse.assign(value_count, 0);
+    mRegisters.assign(value_count, Spilled);
+
+    // The number of instructions before each position that call an action, and that write to XR. These are used
+    // to check if anything in a value's live range would clobber it.
+    std::vector<uint32> calls_before(value_count + 1, 0);
+    std::vector<uint32> xr_writes_before(value_count + 1, 0);
+
+    for (uint32 i = 0; i < value_count; i++) {
+        const FxScriptIRInstr& instr = instrs[i];
+
+        mLastUse[i] = i;
+
+        if (instr.Op == FxScriptIRInstr::IR_ARITH) {
+            mLastUse[instr.A] = i;
+            mLastUse[instr.B] = i;
         }
 
-        mBytecode.Insert(str[i + 1]);
+        const bool is_call = (instr.Op == FxScriptIRInstr::IR_CALL);
+        const bool writes_xr = (is_call || instr.Op == FxScriptIRInstr::IR_ARITH);
+
+        calls_before[i + 1] = calls_before[i] + is_call;
+        xr_writes_before[i + 1] = xr_writes_before[i] + writes_xr;
     }
 
-    return start_index;
-}
+    if (value_count == 0) {
+        return;
+    }
 
+    // The result of the expression is read after the last instruction
+    mLastUse[value_count - 1] = value_count;
 
-FxScriptRegister FxScriptBCEmitter::EmitBinop(FxAstBinop* binop, FxScriptBytecodeVarHandle* handle)
-{
-    bool will_preserve_lhs = false;
-    // Load the A and B values into the registers
-    FxScriptRegister a_reg = EmitRhs(binop->Left, RhsMode::RHS_FETCH_TO_REGISTER, handle);
+    // Values that are currently in a general register
+    std::vector<uint32> active;
+
+    for (uint32 value = 0; value < value_count; value++) {
+        const uint32 start = value;
+        const uint32 end = mLastUse[value];
+
+        // Values that are last read by this instruction are read before it writes its result, so their registers
+        // can be reused
+        std::erase_if(active, [this, start](uint32 other) { return mLastUse[other] <= start; });
+
+        // Actions use the registers freely, so values that are live across a call are kept on the stack
+        if (end > start + 1 && calls_before[end] - calls_before[start + 1] > 0) {
+            mRegisters[value] = Spilled;
+            continue;
+        }
+
+        const FxScriptIRInstr::OpType op = instrs[value].Op;
+
+        // Results are written to XR, so they can stay there if nothing else writes to it before they are read. XR
+        // is always free here, as any value still in it would have been clobbered by this instruction.
+        if (op == FxScriptIRInstr::IR_ARITH || op == FxScriptIRInstr::IR_CALL) {
+            if (end <= start + 1 || xr_writes_before[end] - xr_writes_before[start + 1] == 0) {
+                mRegisters[value] = FX_REG_XR;
+                continue;
+            }
+        }
+
+        uint32 used_registers = 0;
+
+        for (uint32 other : active) {
+            used_registers |= (1u << mRegisters[other]);
+        }
 
-    // Since there is a chance that this register will be clobbered (by binop, action call, etc), we will
-    // push the value of the register here and return it after processing the RHS
-    if (binop->Right->NodeType != FX_AST_LITERAL) {
-        will_preserve_lhs = true;
-        EmitPush32r(a_reg);
+        FxScriptRegister free_register = Spilled;
+
+        for (uint32 reg = FirstRegister; reg <= LastRegister; reg++) {
+            if (!(used_registers & (1u << reg))) {
+                free_register = static_cast<FxScriptRegister>(reg);
+                break;
+            }
+        }
+
+        if (free_register != Spilled) {
+            mRegisters[value] = free_register;
+            active.push_back(value);
+            continue;
+        }
+
+        // There are no free registers, spill whichever value is read furthest in the future
+        auto furthest = std::max_element(active.begin(), active.end(),
+            [this](uint32 a, uint32 b) { return mLastUse[a] < mLastUse[b]; });
+
+        if (mLastUse[*furthest] > end) {
+            mRegisters[value] = mRegisters[*furthest];
+            mRegisters[*furthest] = Spilled;
+
+            (*furthest) = value;
+        }
+        else {
+            mRegisters[value] = Spilled;
+        }
     }
+}
+
+uint32 FxScriptBCEmitter::LowerExpression(FxAstNode* node, std::vector<FxScriptIRInstr>& instrs)
+{
+    FxScriptIRInstr instr;
 
-    FxScriptRegister b_reg = EmitRhs(binop->Right, RhsMode::RHS_FETCH_TO_REGISTER, handle);
+    if (node->NodeType == FX_AST_BINOP) {
+        FxAstBinop* binop = reinterpret_cast<FxAstBinop*>(node);
 
-    // Retrieve the previous LHS
-    if (will_preserve_lhs) {
-        EmitPop32(a_reg);
+        instr.Op = FxScriptIRInstr::IR_ARITH;
+        instr.OpSpec = GetArithOpSpec(binop->OpToken->Type);
+        instr.A = LowerExpression(binop->Left, instrs);
+        instr.B = LowerExpression(binop->Right, instrs);
+    }
+    else if (node->NodeType == FX_AST_ACTIONCALL) {
+        instr.Op = FxScriptIRInstr::IR_CALL;
+        instr.Call = reinterpret_cast<FxAstActionCall*>(node);
     }
+    else if (node->NodeType == FX_AST_LITERAL) {
+        FxAstLiteral* literal = reinterpret_cast<FxAstLiteral*>(node);
+
+        if (literal->Value.Type == FxScriptValue::INT) {
+            instr.Imm = literal->Value.ValueInt;
+        }
+        else if (literal->Value.Type == FxScriptValue::STRING) {
+            char* str = literal->Value.ValueString;
 
-    if (binop->OpToken->Type == TT::Plus) {
-        WriteOp(OpBase_Arith, OpSpecArith_Add);
+            instr.Imm = InternDataString(str, strlen(str));
+        }
+        else if (literal->Value.Type == FxScriptValue::REF) {
+            FxAstVarRef* ref = literal->Value.ValueRef;
+            FxScriptBytecodeVarHandle* var_handle = FindVarHandle(ref->Name->GetHash());
 
-        mBytecode.Insert(a_reg);
-        mBytecode.Insert(b_reg);
+            if (var_handle != nullptr) {
+                instr.Op = FxScriptIRInstr::IR_LOAD;
+                instr.Var = var_handle;
+            }
+            else {
+                printf("!!! Var '%.*s' does not exist!\n", ref->Name->Length, ref->Name->Start);
+            }
+        }
     }
 
-    // We no longer need the lhs or rhs registers, free em
-    MARK_REGISTER_FREE(a_reg);
-    MARK_REGISTER_FREE(b_reg);
+    instrs.push_back(instr);
+
+    return static_cast<uint32>(instrs.size() - 1);
+}
+
+FxScriptRegister FxScriptBCEmitter::EmitExpression(FxAstNode* rhs)
+{
+    std::vector<FxScriptIRInstr> instrs;
+    LowerExpression(rhs, instrs);
+
+    FxScriptRegisterAllocator allocator;
+    allocator.Allocate(instrs);
+
+    constexpr FxScriptRegister spilled = FxScriptRegisterAllocator::Spilled;
+
+    for (uint32 value = 0; value < instrs.size(); value++) {
+        const FxScriptIRInstr& instr = instrs[value];
+
+        const FxScriptRegister dest_reg = allocator.GetRegister(value);
+
+        // Spilled values are built in a reload register and then pushed
+        const FxScriptRegister output_reg = (dest_reg == spilled) ? FxScriptRegisterAllocator::ReloadRegisterA : dest_reg;
+
+        if (instr.Op == FxScriptIRInstr::IR_IMM) {
+            if (dest_reg == spilled) {
+                EmitPush32(instr.Imm);
+            }
+            else {
+                EmitMoveInt32(dest_reg, instr.Imm);
+            }
+
+            continue;
+        }
+
+        if (instr.Op == FxScriptIRInstr::IR_LOAD) {
+            // Variables from a previous scope are loaded from an absolute address, as local offsets change
+            // depending on where they are called.
+            DoLoad(instr.Var->Offset, output_reg, (instr.Var->ScopeIndex < mScopeIndex));
+        }
+        else if (instr.Op == FxScriptIRInstr::IR_ARITH) {
+            FxScriptRegister a_reg = allocator.GetRegister(instr.A);
+            FxScriptRegister b_reg = allocator.GetRegister(instr.B);
+
+            // Spilled operands are popped in the reverse order that they were pushed
+            if (b_reg == spilled) {
+                b_reg = FxScriptRegisterAllocator::ReloadRegisterB;
+                EmitPop32(b_reg);
+            }
+
+            if (a_reg == spilled) {
+                a_reg = FxScriptRegisterAllocator::ReloadRegisterA;
+                EmitPop32(a_reg);
+            }
+
+            WriteOp(OpBase_Arith, instr.OpSpec);
+
+            mBytecode.Insert(a_reg);
+            mBytecode.Insert(b_reg);
+        }
+        else if (instr.Op == FxScriptIRInstr::IR_CALL) {
+            DoActionCall(instr.Call);
+        }
+
+        // Arithmetic and action results are written to XR
+        const FxScriptRegister result_reg = (instr.Op == FxScriptIRInstr::IR_LOAD) ? output_reg : FX_REG_XR;
 
-    return FX_REG_XR;
+        if (dest_reg == spilled) {
+            EmitPush32r(result_reg);
+        }
+        else if (dest_reg != result_reg) {
+            EmitMoveReg32(dest_reg, result_reg);
+        }
+    }
+
+    return allocator.GetRegister(static_cast<uint32>(instrs.size() - 1));
 }
 
 FxScriptRegister FxScriptBCEmitter::EmitVarFetch(FxAstVarRef* ref, RhsMode mode)
@@ -2235,8 +2856,8 @@ FxScriptRegister FxScriptBCEmitter::EmitLiteralString(FxAstLiteral* literal, Rhs
 {
     const uint32 string_length = strlen(literal->Value.ValueString);
 
-    // Emit the length and string data
-    const uint32 string_position = EmitDataString(literal->Value.ValueString, string_length);
+    // Add the string to the data section
+    const uint32 string_position = InternDataString(literal->Value.ValueString, string_length);
 
     // local string some_value = "Some String";
     if (mode == RhsMode::RHS_DEFINE_IN_MEMORY) {
@@ -2272,6 +2893,7 @@ FxScriptRegister FxScriptBCEmitter::EmitLiteralString(FxAstLiteral* literal, Rhs
         const bool force_absolute_save = (handle->ScopeIndex < mScopeIndex);
 
         DoSaveInt32(handle->Offset, string_position, force_absolute_save);
+
         handle->Type = FxScriptValue::STRING;
 
         return FX_REG_NONE;
@@ -2308,7 +2930,7 @@ FxScriptRegister FxScriptBCEmitter::EmitRhs(FxAstNode* rhs, FxScriptBCEmitter::R
         FxScriptRegister result_register = FX_REG_XR;
 
         if (rhs->NodeType == FX_AST_BINOP) {
-            result_register = EmitBinop(reinterpret_cast<FxAstBinop*>(rhs), handle);
+            result_register = EmitExpression(rhs);
         }
 
         else if (rhs->NodeType == FX_AST_ACTIONCALL) {
@@ -2385,9 +3007,12 @@ FxScriptBytecodeVarHandle* FxScriptBCEmitter::DoVarDeclare(FxAstVarDecl* decl, V
         .ScopeIndex = mScopeIndex,
     };
 
+    const uint32 handle_position = static_cast<uint32>(VarHandles.Size());
+
     VarHandles.Insert(handle);
+    mVarHandleIndex.Insert(handle.HashedName, handle_position);
 
-    FxScriptBytecodeVarHandle* inserted_handle = &VarHandles[VarHandles.Size() - 1];
+    FxScriptBytecodeVarHandle* inserted_handle = &VarHandles[handle_position];
 
     if (mode == DECLARE_NO_EMIT) {
         // Do not emit any values
@@ -2414,41 +3039,51 @@ FxScriptBytecodeVarHandle* FxScriptBCEmitter::DoVarDeclare(FxAstVarDecl* decl, V
     return inserted_handle;
 }
 
+static bool ContainsActionCall(FxAstNode* node)
+{
+    if (node->NodeType == FX_AST_ACTIONCALL) {
+        return true;
+    }
+
+    if (node->NodeType == FX_AST_BINOP) {
+        FxAstBinop* binop = reinterpret_cast<FxAstBinop*>(node);
+        return (ContainsActionCall(binop->Left) || ContainsActionCall(binop->Right));
+    }
+
+    return false;
+}
+
 void FxScriptBCEmitter::DoActionCall(FxAstActionCall* call)
 {
     RETURN_IF_NO_NODE(call);
 
     FxScriptBytecodeActionHandle* handle = FindActionHandle(call->HashedName);
 
+    EmitPush32r(FX_REG_RA);
 
     std::vector<uint32> call_locations;
     call_locations.reserve(8);
 
-    // Push all params to stack
+    // Params that call an action are evaluated into temporaries before the params start. Calls reset the pushed
+    // types in the VM, so they cannot run between `paramsstart` and the call that the params are for.
     for (FxAstNode* param : call->Params) {
-        // FxScriptRegister reg =
-        if (param->NodeType == FX_AST_ACTIONCALL) {
+        if (ContainsActionCall(param)) {
             EmitRhs(param, RhsMode::RHS_DEFINE_IN_MEMORY, nullptr);
             call_locations.push_back(mStackOffset - 4);
         }
-        //MARK_REGISTER_FREE(reg);
     }
 
-    EmitPush32r(FX_REG_RA);
-
     EmitParamsStart();
 
-    int call_location_index = 0;
+    size_t call_location_index = 0;
 
     // Push all params to stack
     for (FxAstNode* param : call->Params) {
-        if (param->NodeType == FX_AST_ACTIONCALL) {
-            FxScriptRegister temp_register = FindFreeRegister();
-
-            DoLoad(call_locations[call_location_index], temp_register);
+        if (ContainsActionCall(param)) {
+            DoLoad(call_locations[call_location_index], FX_REG_XR);
             call_location_index++;
 
-            EmitPush32r(temp_register);
+            EmitPush32r(FX_REG_XR);
 
             continue;
         }
@@ -2466,13 +3101,26 @@ void FxScriptBCEmitter::DoActionCall(FxAstActionCall* call)
             mStackOffset -= 4;
         }
 
+        if (call->Name != nullptr) {
+            mExternalCallNames.try_emplace(call->HashedName, call->Name->Start, call->Name->Length);
+        }
+
         EmitJumpCallExternal(call->HashedName);
+    }
+    else {
+        EmitJumpCallAbsolute(handle->BytecodeIndex);
 
-        EmitPop32(FX_REG_RA);
-        return;
+        // The parameters are still on the stack when the action returns
+        for (size_t i = 0; i < call->Params.size(); i++) {
+            EmitPop32(FX_REG_RA);
+        }
     }
 
-    EmitJumpCallAbsolute(handle->BytecodeIndex);
+    // Pop the temporaries so that the return address, and anything that was pushed before the call, is back on the
+    // top of the stack. The return address register is restored by the last pop, so it is safe to pop into.
+    for (size_t i = 0; i < call_locations.size(); i++) {
+        EmitPop32(FX_REG_RA);
+    }
 
     EmitPop32(FX_REG_RA);
 }
@@ -2526,6 +3174,9 @@ void FxScriptBCEmitter::EmitAction(FxAstActionDecl* action)
 
     size_t start_var_handle_count = VarHandles.Size();
 
+    // Variables declared in the action are removed from lookups at the end of the action
+    const FxScopedHashIndex::Checkpoint var_handle_checkpoint = mVarHandleIndex.GetCheckpoint();
+
     // Offset for the pushed return address
     mStackOffset += 4;
 
@@ -2577,10 +3228,13 @@ void FxScriptBCEmitter::EmitAction(FxAstActionDecl* action)
     const size_t number_of_scope_var_handles = VarHandles.Size() - start_var_handle_count;
     printf("Number of var handles to remove: %zu\n", number_of_scope_var_handles);
 
+    mActionHandleIndex.Insert(action_handle.HashedName, static_cast<uint32>(ActionHandles.size()));
     ActionHandles.push_back(action_handle);
 
     --mScopeIndex;
 
+    mVarHandleIndex.Rollback(var_handle_checkpoint);
+
     // Delete the variables on the stack
     for (int i = 0; i < number_of_scope_var_handles; i++) {
         FxScriptBytecodeVarHandle* var = VarHandles.RemoveLast();
@@ -2686,8 +3340,61 @@ void FxScriptBCPrinter::DoArith(char* s, uint8 op_base, uint8 op_spec)
     uint8 a_reg = mBytecode[mBytecodeIndex++];
     uint8 b_reg = mBytecode[mBytecodeIndex++];
 
-    if (op_spec == OpSpecArith_Add) {
-        BC_PRINT_OP("add32 %s, %s", FxScriptBCEmitter::GetRegisterName(static_cast<FxScriptRegister>(a_reg)), FxScriptBCEmitter::GetRegisterName(static_cast<FxScriptRegister>(b_reg)));
+    const char* op_name = nullptr;
+
+    switch (op_spec) {
+    case OpSpecArith_Add:
+        op_name = "add32";
+        break;
+    case OpSpecArith_Sub:
+        op_name = "sub32";
+        break;
+    case OpSpecArith_Mul:
+        op_name = "mul32";
+        break;
+    case OpSpecArith_Div:
+        op_name = "div32";
+        break;
+    case OpSpecArith_Mod:
+        op_name = "mod32";
+        break;
+    case OpSpecArith_And:
+        op_name = "and32";
+        break;
+    case OpSpecArith_Or:
+        op_name = "or32";
+        break;
+    case OpSpecArith_Xor:
+        op_name = "xor32";
+        break;
+    case OpSpecArith_Shl:
+        op_name = "shl32";
+        break;
+    case OpSpecArith_Shr:
+        op_name = "shr32";
+        break;
+    case OpSpecArith_CmpEq:
+        op_name = "cmpeq32";
+        break;
+    case OpSpecArith_CmpNe:
+        op_name = "cmpne32";
+        break;
+    case OpSpecArith_CmpLt:
+        op_name = "cmplt32";
+        break;
+    case OpSpecArith_CmpLe:
+        op_name = "cmple32";
+        break;
+    case OpSpecArith_CmpGt:
+        op_name = "cmpgt32";
+        break;
+    case OpSpecArith_CmpGe:
+        op_name = "cmpge32";
+        break;
+    }
+
+    if (op_name != nullptr) {
+        BC_PRINT_OP("%s %s, %s", op_name, FxScriptBCEmitter::GetRegisterName(static_cast<FxScriptRegister>(a_reg)), FxScriptBCEmitter::GetRegisterName(static_cast<FxScriptRegister>(b_reg)));
     }
 }
 
@@ -2753,23 +3460,7 @@ void FxScriptBCPrinter::DoJump(char* s, uint8 op_base, uint8 op_spec)
 
 void FxScriptBCPrinter::DoData(char* s, uint8 op_base, uint8 op_spec)
 {
-    if (op_spec == OpSpecData_String) {
-        uint16 length = Read16();
-        char* data_str = FX_SCRIPT_ALLOC_MEMORY(char, length);
-        uint16* data_str16 = reinterpret_cast<uint16*>(data_str);
-
-        uint32 bytecode_end = mBytecodeIndex + length;
-        int data_index = 0;
-        while (mBytecodeIndex < bytecode_end) {
-            uint16 value16 = Read16();
-            data_str16[data_index++] = ((value16 << 8) | (value16 >> 8));
-        }
-
-        BC_PRINT_OP("datastr %d, %.*s", length, length, data_str);
-
-        FX_SCRIPT_FREE(char, data_str);
-    }
-    else if (op_spec == OpSpecData_ParamsStart) {
+    if (op_spec == OpSpecData_ParamsStart) {
         BC_PRINT_OP("paramsstart");
     }
 }
@@ -2793,6 +3484,27 @@ void FxScriptBCPrinter::DoMove(char* s, uint8 op_base, uint8 op_spec_raw)
         uint32 value = Read32();
         BC_PRINT_OP("move32 %s, %u\t", FxScriptBCEmitter::GetRegisterName(static_cast<FxScriptRegister>(op_reg)), value);
     }
+    else if (op_spec == OpSpecMove_Reg32) {
+        uint16 src_reg = Read16();
+        BC_PRINT_OP("move32r %s, %s", FxScriptBCEmitter::GetRegisterName(static_cast<FxScriptRegister>(op_reg)), FxScriptBCEmitter::GetRegisterName(static_cast<FxScriptRegister>(src_reg)));
+    }
+}
+
+void FxScriptBCPrinter::DoFused(char* s, uint8 op_base, uint8 op_spec)
+{
+    if (op_spec == OpSpecFused_AddLocalLocalToLocal) {
+        const int16 dest_offset = Read16();
+        const int16 a_offset = Read16();
+        const int16 b_offset = Read16();
+
+        BC_PRINT_OP("add32lll %d, %d, %d", dest_offset, a_offset, b_offset);
+    }
+    else if (op_spec == OpSpecFused_AddImmToLocal) {
+        const int16 offset = Read16();
+        const uint32 value = Read32();
+
+        BC_PRINT_OP("add32il %d, %u", offset, value);
+    }
 }
 
 
@@ -2803,6 +3515,19 @@ void FxScriptBCPrinter::Print()
     }
 }
 
+void FxScriptBCPrinter::PrintData(const std::vector<char>& data)
+{
+    size_t offset = 0;
+
+    while (offset < data.size()) {
+        const char* str = &data[offset];
+
+        printf("%-25s\t# Data: %zu\n", str, offset);
+
+        offset += strlen(str) + 1;
+    }
+}
+
 void FxScriptBCPrinter::PrintOp()
 {
     uint32 bc_index = mBytecodeIndex;
@@ -2842,6 +3567,9 @@ void FxScriptBCPrinter::PrintOp()
     case OpBase_Move:
         DoMove(s, op_base, op_spec);
         break;
+    case OpBase_Fused:
+        DoFused(s, op_base, op_spec);
+        break;
     }
 
     printf("%-25s", s);
@@ -2856,31 +3584,466 @@ void FxScriptBCPrinter::PrintOp()
 // Bytecode VM
 ///////////////////////////////////////////
 
-void FxScriptVM::PrintRegisters()
+/*
+ * Each (base, spec) pair is decoded into a single handler index using a table that is built at compile time.
+ * When a program is linked, the bytecode is translated into fixed width `FxScriptVMInstr`s that hold the handler
+ * index and the unpacked operands, so the VM never decodes the wire format while running. With computed goto
+ * (GCC, Clang) every handler jumps directly to the next handler, otherwise the handlers are cases of a switch
+ * inside of a loop.
+ */
+#if !defined(FX_SCRIPT_VM_NO_COMPUTED_GOTO) && (defined(__GNUC__) || defined(__clang__))
+#define FX_SCRIPT_VM_COMPUTED_GOTO 1
+#else
+#define FX_SCRIPT_VM_COMPUTED_GOTO 0
+#endif
+
+static constexpr FxScriptVMHandler DecodeVMHandler(uint8 op_base, uint8 op_spec_raw)
 {
-    printf("\n=== Register Dump ===\n\n");
-    printf("X0=%u\tX1=%u\tX2=%u\tX3=%u\n",
-        Registers[FX_REG_X0], Registers[FX_REG_X1], Registers[FX_REG_X2], Registers[FX_REG_X3]);
+    // Ops that take a register store the spec in the upper nibble
+    const uint8 op_spec_hi = ((op_spec_raw >> 4) & 0x0F);
 
-    printf("XR=%u\tRA=%u\n", Registers[FX_REG_XR], Registers[FX_REG_RA]);
+    switch (op_base) {
+    case 0:
+        return (op_spec_raw == 0) ? FX_VM_HALT : FX_VM_INVALID;
+    case OpBase_Push:
+        if (op_spec_raw == OpSpecPush_Int32) {
+            return FX_VM_PUSH32;
+        }
+        if (op_spec_raw == OpSpecPush_Reg32) {
+            return FX_VM_PUSH32R;
+        }
+        break;
+    case OpBase_Pop:
+        if (op_spec_hi == OpSpecPop_Int32) {
+            return FX_VM_POP32;
+        }
+        break;
+    case OpBase_Load:
+        if (op_spec_hi == OpSpecLoad_Int32) {
+            return FX_VM_LOAD32;
+        }
+        if (op_spec_hi == OpSpecLoad_AbsoluteInt32) {
+            return FX_VM_LOAD32A;
+        }
+        break;
+    case OpBase_Arith:
+        switch (op_spec_raw) {
+        case OpSpecArith_Add:
+            return FX_VM_ADD32;
+        case OpSpecArith_Sub:
+            return FX_VM_SUB32;
+        case OpSpecArith_Mul:
+            return FX_VM_MUL32;
+        case OpSpecArith_Div:
+            return FX_VM_DIV32;
+        case OpSpecArith_Mod:
+            return FX_VM_MOD32;
+        case OpSpecArith_And:
+            return FX_VM_AND32;
+        case OpSpecArith_Or:
+            return FX_VM_OR32;
+        case OpSpecArith_Xor:
+            return FX_VM_XOR32;
+        case OpSpecArith_Shl:
+            return FX_VM_SHL32;
+        case OpSpecArith_Shr:
+            return FX_VM_SHR32;
+        case OpSpecArith_CmpEq:
+            return FX_VM_CMPEQ32;
+        case OpSpecArith_CmpNe:
+            return FX_VM_CMPNE32;
+        case OpSpecArith_CmpLt:
+            return FX_VM_CMPLT32;
+        case OpSpecArith_CmpLe:
+            return FX_VM_CMPLE32;
+        case OpSpecArith_CmpGt:
+            return FX_VM_CMPGT32;
+        case OpSpecArith_CmpGe:
+            return FX_VM_CMPGE32;
+        }
+        break;
+    case OpBase_Save:
+        switch (op_spec_raw) {
+        case OpSpecSave_Int32:
+            return FX_VM_SAVE32;
+        case OpSpecSave_Reg32:
+            return FX_VM_SAVE32R;
+        case OpSpecSave_AbsoluteInt32:
+            return FX_VM_SAVE32A;
+        case OpSpecSave_AbsoluteReg32:
+            return FX_VM_SAVE32AR;
+        }
+        break;
+    case OpBase_Jump:
+        switch (op_spec_raw) {
+        case OpSpecJump_Relative:
+            return FX_VM_JMPR;
+        case OpSpecJump_Absolute:
+            return FX_VM_JMPA;
+        case OpSpecJump_AbsoluteReg32:
+            return FX_VM_JMPAR;
+        case OpSpecJump_CallAbsolute:
+            return FX_VM_CALLA;
+        case OpSpecJump_ReturnToCaller:
+            return FX_VM_RET;
+        case OpSpecJump_CallExternal:
+            return FX_VM_CALLEXT;
+        }
+        break;
+    case OpBase_Data:
+        if (op_spec_raw == OpSpecData_ParamsStart) {
+            return FX_VM_PARAMSSTART;
+        }
+        break;
+    case OpBase_Type:
+        if (op_spec_raw == OpSpecType_Int) {
+            return FX_VM_TYPEINT;
+        }
+        if (op_spec_raw == OpSpecType_String) {
+            return FX_VM_TYPESTR;
+        }
+        break;
+    case OpBase_Move:
+        if (op_spec_hi == OpSpecMove_Int32) {
+            return FX_VM_MOVE32;
+        }
+        if (op_spec_hi == OpSpecMove_Reg32) {
+            return FX_VM_MOVE32R;
+        }
+        break;
+    case OpBase_Fused:
+        if (op_spec_raw == OpSpecFused_AddLocalLocalToLocal) {
+            return FX_VM_ADD32LLL;
+        }
+        if (op_spec_raw == OpSpecFused_AddImmToLocal) {
+            return FX_VM_ADD32IL;
+        }
+        break;
+    }
 
-    printf("\n=====================\n\n");
+    return FX_VM_INVALID;
 }
 
-uint16 FxScriptVM::Read16()
+/**
+ * Handler index for every possible 16 bit opcode, indexed by `(op_base << 8) | op_spec`.
+ */
+static constexpr auto sVMHandlerTable = []
 {
-    uint8 lo = mBytecode[mPC++];
-    uint8 hi = mBytecode[mPC++];
+    std::array<uint8, 0x10000> table {};
 
-    return ((static_cast<uint16>(lo) << 8) | hi);
+    for (uint32 op_full = 0; op_full < table.size(); op_full++) {
+        table[op_full] = DecodeVMHandler(static_cast<uint8>(op_full >> 8), static_cast<uint8>(op_full & 0xFF));
+    }
+
+    return table;
+}();
+
+bool FxScriptProgram::Link(FxMPPagedArray<uint8>& bytecode, const std::vector<char>& data, const std::vector<FxScriptExternalFunc>& external_funcs, const std::unordered_map<FxHash, std::string>& external_call_names)
+{
+    Destroy();
+
+    mData = data;
+
+    const uint32 code_size = bytecode.Size();
+
+    uint8* code = static_cast<uint8*>(FxUtil::AllocAligned(FX_SCRIPT_PROGRAM_CODE_ALIGNMENT, code_size + FX_SCRIPT_PROGRAM_CODE_PADDING));
+
+    if (code == nullptr) {
+        FxPanic("FxScriptProgram", "Memory error allocating program code", 0);
+        return false; // for msvc
+    }
+
+    // Copy the bytecode a page at a time
+    uint32 copied_size = 0;
+
+    for (uint32 page_index = 0; copied_size < code_size; page_index++) {
+        const uint32 copy_size = std::min(bytecode.PageNodeCapacity, code_size - copied_size);
+
+        memcpy(code + copied_size, bytecode.PageDirectory[page_index]->Data, copy_size);
+        copied_size += copy_size;
+    }
+
+    memset(code + code_size, 0, FX_SCRIPT_PROGRAM_CODE_PADDING);
+
+    mCode = code;
+    mCodeSize = code_size;
+
+    Translate();
+
+    return ResolveExternalCalls(external_funcs, external_call_names);
 }
 
-uint32 FxScriptVM::Read32()
+/**
+ * @brief Decodes the instruction at `offset` in the code. Jump and call targets are left as byte offsets, with
+ * relative jumps resolved to the offset that they land on.
+ * @return The offset of the next instruction
+ */
+static uint32 DecodeVMInstr(const uint8* code, uint32 code_size, uint32 offset, FxScriptVMInstr& instr)
 {
-    uint16 lo = Read16();
-    uint16 hi = Read16();
+    const uint16 op_full = FxBytecodeRead16(code + offset);
+    const uint32 op_offset = offset;
 
-    return ((static_cast<uint32>(lo) << 16) | hi);
+    offset += sizeof(uint16);
+
+    instr = FxScriptVMInstr {};
+    instr.Handler = sVMHandlerTable[op_full];
+
+    // Register for ops that store it in the lower nibble of the spec
+    const uint8 op_reg = (op_full & 0x0F);
+
+    switch (instr.Handler) {
+    case FX_VM_PUSH32:
+        instr.Imm = FxBytecodeRead32(code + offset);
+        offset += 4;
+        break;
+    case FX_VM_PUSH32R:
+    case FX_VM_JMPAR:
+        instr.RegA = static_cast<uint8>(FxBytecodeRead16(code + offset));
+        offset += 2;
+        break;
+    case FX_VM_POP32:
+        instr.RegA = op_reg;
+        break;
+    case FX_VM_LOAD32:
+        instr.RegA = op_reg;
+        instr.Offset = static_cast<int16>(FxBytecodeRead16(code + offset));
+        offset += 2;
+        break;
+    case FX_VM_LOAD32A:
+        instr.RegA = op_reg;
+        instr.Offset = static_cast<int32>(FxBytecodeRead32(code + offset));
+        offset += 4;
+        break;
+    case FX_VM_ADD32:
+    case FX_VM_SUB32:
+    case FX_VM_MUL32:
+    case FX_VM_DIV32:
+    case FX_VM_MOD32:
+    case FX_VM_AND32:
+    case FX_VM_OR32:
+    case FX_VM_XOR32:
+    case FX_VM_SHL32:
+    case FX_VM_SHR32:
+    case FX_VM_CMPEQ32:
+    case FX_VM_CMPNE32:
+    case FX_VM_CMPLT32:
+    case FX_VM_CMPLE32:
+    case FX_VM_CMPGT32:
+    case FX_VM_CMPGE32:
+        instr.RegA = code[offset];
+        instr.RegB = code[offset + 1];
+        offset += 2;
+        break;
+    case FX_VM_SAVE32:
+        instr.Offset = static_cast<int16>(FxBytecodeRead16(code + offset));
+        instr.Imm = FxBytecodeRead32(code + offset + 2);
+        offset += 6;
+        break;
+    case FX_VM_SAVE32R:
+        instr.Offset = static_cast<int16>(FxBytecodeRead16(code + offset));
+        instr.RegA = static_cast<uint8>(FxBytecodeRead16(code + offset + 2));
+        offset += 4;
+        break;
+    case FX_VM_SAVE32A:
+        instr.Offset = static_cast<int32>(FxBytecodeRead32(code + offset));
+        instr.Imm = FxBytecodeRead32(code + offset + 4);
+        offset += 8;
+        break;
+    case FX_VM_SAVE32AR:
+        instr.Offset = static_cast<int32>(FxBytecodeRead32(code + offset));
+        instr.RegA = static_cast<uint8>(FxBytecodeRead16(code + offset + 4));
+        offset += 6;
+        break;
+    case FX_VM_JMPR:
+        // Relative jumps are from the end of the instruction
+        instr.Imm = offset + 2 + FxBytecodeRead16(code + offset);
+        offset += 2;
+        break;
+    case FX_VM_JMPA:
+    case FX_VM_CALLA:
+        instr.Imm = FxBytecodeRead32(code + offset);
+        offset += 4;
+        break;
+    case FX_VM_CALLEXT:
+        // Hashed name of the function, this is resolved to a function index in `ResolveExternalCalls`
+        instr.Imm = FxBytecodeRead32(code + offset);
+        instr.Offset = static_cast<int32>(op_offset);
+        offset += 4;
+        break;
+    case FX_VM_MOVE32:
+        instr.RegA = op_reg;
+        instr.Imm = FxBytecodeRead32(code + offset);
+        offset += 4;
+        break;
+    case FX_VM_MOVE32R:
+        instr.RegA = op_reg;
+        instr.RegB = static_cast<uint8>(FxBytecodeRead16(code + offset));
+        offset += 2;
+        break;
+    case FX_VM_ADD32LLL:
+        instr.Offset = static_cast<int16>(FxBytecodeRead16(code + offset));
+        instr.SrcOffsetA = static_cast<int16>(FxBytecodeRead16(code + offset + 2));
+        instr.SrcOffsetB = static_cast<int16>(FxBytecodeRead16(code + offset + 4));
+        offset += 6;
+        break;
+    case FX_VM_ADD32IL:
+        instr.Offset = static_cast<int16>(FxBytecodeRead16(code + offset));
+        instr.Imm = FxBytecodeRead32(code + offset + 2);
+        offset += 6;
+        break;
+    case FX_VM_INVALID:
+        // The length of the operands is unknown, there is nothing after this that can be decoded
+        instr.Imm = op_full;
+        instr.Offset = static_cast<int32>(op_offset);
+        offset = code_size;
+        break;
+    default:;
+    }
+
+    return offset;
+}
+
+void FxScriptProgram::Translate()
+{
+    const uint8* code = mCode;
+
+    std::vector<FxScriptVMInstr> instrs;
+    instrs.reserve(mCodeSize / 4);
+
+    // The instruction index for each byte offset in the code, used to resolve jump targets. Offsets that are not
+    // the start of an instruction are left as UINT32_MAX.
+    std::vector<uint32> instr_indices(mCodeSize + 1, UINT32_MAX);
+
+    // Instructions that have a byte offset in `Imm` that needs to be converted to an instruction index
+    std::vector<uint32> jump_fixups;
+
+    uint32 offset = 0;
+
+    while (offset < mCodeSize) {
+        instr_indices[offset] = static_cast<uint32>(instrs.size());
+
+        FxScriptVMInstr instr;
+        offset = DecodeVMInstr(code, mCodeSize, offset, instr);
+
+        if (instr.Handler == FX_VM_JMPR || instr.Handler == FX_VM_JMPA || instr.Handler == FX_VM_CALLA) {
+            jump_fixups.push_back(static_cast<uint32>(instrs.size()));
+        }
+
+        instrs.push_back(instr);
+    }
+
+    // End of the program. Any offsets past the end of the code will also land here.
+    const uint32 halt_index = static_cast<uint32>(instrs.size());
+    instr_indices[mCodeSize] = halt_index;
+
+    instrs.push_back(FxScriptVMInstr { .Handler = FX_VM_HALT });
+
+    for (uint32 fixup_index : jump_fixups) {
+        FxScriptVMInstr& instr = instrs[fixup_index];
+
+        const uint32 target = instr.Imm;
+
+        if (target > mCodeSize || instr_indices[target] == UINT32_MAX) {
+            printf("!!! Jump target %u is not the start of an instruction!\n", target);
+            instr.Imm = halt_index;
+            continue;
+        }
+
+        instr.Imm = instr_indices[target];
+    }
+
+    mInstrCount = static_cast<uint32>(instrs.size());
+
+    mInstrs = static_cast<FxScriptVMInstr*>(FxUtil::AllocAligned(FX_SCRIPT_PROGRAM_CODE_ALIGNMENT, sizeof(FxScriptVMInstr) * mInstrCount));
+
+    if (mInstrs == nullptr) {
+        FxPanic("FxScriptProgram", "Memory error allocating decoded instructions", 0);
+        return; // for msvc
+    }
+
+    memcpy(mInstrs, instrs.data(), sizeof(FxScriptVMInstr) * mInstrCount);
+}
+
+bool FxScriptProgram::ResolveExternalCalls(const std::vector<FxScriptExternalFunc>& external_funcs, const std::unordered_map<FxHash, std::string>& external_call_names)
+{
+    // The index in `mExternalFuncs` for each function in `external_funcs`, or UINT32_MAX if it has not been called yet
+    std::vector<uint32> func_indices(external_funcs.size(), UINT32_MAX);
+
+    bool all_resolved = true;
+
+    for (uint32 i = 0; i < mInstrCount; i++) {
+        FxScriptVMInstr& instr = mInstrs[i];
+
+        if (instr.Handler != FX_VM_CALLEXT) {
+            continue;
+        }
+
+        const FxHash hashed_name = instr.Imm;
+
+        auto it = std::find_if(external_funcs.begin(), external_funcs.end(),
+            [hashed_name](const FxScriptExternalFunc& func) { return func.HashedName == hashed_name; });
+
+        if (it == external_funcs.end()) {
+            auto name_it = external_call_names.find(hashed_name);
+
+            if (name_it != external_call_names.end()) {
+                printf("!!! Undefined external function '%s' called at offset %d\n", name_it->second.c_str(), instr.Offset);
+            }
+            else {
+                printf("!!! Undefined external function (hash %u) called at offset %d\n", hashed_name, instr.Offset);
+            }
+
+            all_resolved = false;
+
+            instr.Handler = FX_VM_HALT;
+            continue;
+        }
+
+        uint32& func_index = func_indices[it - external_funcs.begin()];
+
+        if (func_index == UINT32_MAX) {
+            func_index = static_cast<uint32>(mExternalFuncs.size());
+            mExternalFuncs.push_back(*it);
+        }
+
+        instr.Imm = func_index;
+    }
+
+    return all_resolved;
+}
+
+void FxScriptProgram::Destroy()
+{
+    if (mInstrs != nullptr) {
+        FxUtil::FreeAligned(mInstrs);
+    }
+
+    if (mCode != nullptr) {
+        FxUtil::FreeAligned(mCode);
+    }
+
+    mInstrs = nullptr;
+    mInstrCount = 0;
+
+    mCode = nullptr;
+    mCodeSize = 0;
+
+    mData.clear();
+
+    mExternalFuncs.clear();
+}
+
+void FxScriptVM::PrintRegisters()
+{
+    printf("\n=== Register Dump ===\n\n");
+    printf("X0=%u\tX1=%u\tX2=%u\tX3=%u\n",
+        Registers[FX_REG_X0], Registers[FX_REG_X1], Registers[FX_REG_X2], Registers[FX_REG_X3]);
+    printf("X4=%u\tX5=%u\tX6=%u\tX7=%u\n",
+        Registers[FX_REG_X4], Registers[FX_REG_X5], Registers[FX_REG_X6], Registers[FX_REG_X7]);
+
+    printf("XR=%u\tRA=%u\n", Registers[FX_REG_XR], Registers[FX_REG_RA]);
+
+    printf("\n=====================\n\n");
 }
 
 void FxScriptVM::Push16(uint16 value)
@@ -2951,291 +4114,1211 @@ FxScriptVMCallFrame* FxScriptVM::GetCurrentCallFrame()
     return &mCallFrames[mCallFrameIndex - 1];
 }
 
-FxScriptExternalFunc* FxScriptVM::FindExternalAction(FxHash hashed_name)
+inline void FxScriptVM::TrackPushedType()
 {
-    for (FxScriptExternalFunc& func : mExternalFuncs) {
-        if (func.HashedName == hashed_name) {
-            return &func;
-        }
+    if (!mIsInParams) {
+        return;
     }
-    return nullptr;
-}
 
-void FxScriptVM::ExecuteOp()
-{
-    uint16 op_full = Read16();
+    if (mCurrentType != FxScriptValue::NONETYPE) {
+        mPushedTypes.Insert(mCurrentType);
+        mCurrentType = FxScriptValue::NONETYPE;
+    }
+    else {
+        mPushedTypes.Insert(FxScriptValue::INT);
+    }
+}
+
+void FxScriptVM::Run()
+{
+    const FxScriptVMInstr* instr = nullptr;
+
+#if FX_SCRIPT_VM_COMPUTED_GOTO
+    // This must match the order of `FxScriptVMHandler`
+    static void* const handler_labels[] = {
+        &&Handler_HALT,
+        &&Handler_INVALID,
+        &&Handler_PUSH32,
+        &&Handler_PUSH32R,
+        &&Handler_POP32,
+        &&Handler_LOAD32,
+        &&Handler_LOAD32A,
+        &&Handler_ADD32,
+        &&Handler_SUB32,
+        &&Handler_MUL32,
+        &&Handler_DIV32,
+        &&Handler_MOD32,
+        &&Handler_AND32,
+        &&Handler_OR32,
+        &&Handler_XOR32,
+        &&Handler_SHL32,
+        &&Handler_SHR32,
+        &&Handler_CMPEQ32,
+        &&Handler_CMPNE32,
+        &&Handler_CMPLT32,
+        &&Handler_CMPLE32,
+        &&Handler_CMPGT32,
+        &&Handler_CMPGE32,
+        &&Handler_SAVE32,
+        &&Handler_SAVE32R,
+        &&Handler_SAVE32A,
+        &&Handler_SAVE32AR,
+        &&Handler_JMPR,
+        &&Handler_JMPA,
+        &&Handler_JMPAR,
+        &&Handler_CALLA,
+        &&Handler_RET,
+        &&Handler_CALLEXT,
+        &&Handler_PARAMSSTART,
+        &&Handler_TYPEINT,
+        &&Handler_TYPESTR,
+        &&Handler_MOVE32,
+        &&Handler_MOVE32R,
+        &&Handler_ADD32LLL,
+        &&Handler_ADD32IL,
+    };
 
-    const uint8 op_base = static_cast<uint8>(op_full >> 8);
-    const uint8 op_spec = static_cast<uint8>(op_full & 0xFF);
+    static_assert(std::size(handler_labels) == FX_VM_HANDLER_COUNT);
 
-    switch (op_base) {
-    case OpBase_Push:
-        DoPush(op_base, op_spec);
-        break;
-    case OpBase_Pop:
-        DoPop(op_base, op_spec);
-        break;
-    case OpBase_Load:
-        DoLoad(op_base, op_spec);
-        break;
-    case OpBase_Arith:
-        DoArith(op_base, op_spec);
-        break;
-    case OpBase_Jump:
-        DoJump(op_base, op_spec);
-        break;
-    case OpBase_Save:
-        DoSave(op_base, op_spec);
-        break;
-    case OpBase_Data:
-        DoData(op_base, op_spec);
-        break;
-    case OpBase_Type:
-        DoType(op_base, op_spec);
-        break;
-    case OpBase_Move:
-        DoMove(op_base, op_spec);
-        break;
+#define VM_HANDLER(handler_) Handler_##handler_:
+#define VM_DISPATCH() \
+    { \
+        instr = &mInstrs[mPC++]; \
+        goto* handler_labels[instr->Handler]; \
     }
-}
 
-void FxScriptVM::DoLoad(uint8 op_base, uint8 op_spec_raw)
-{
-    uint8 op_spec = ((op_spec_raw >> 4) & 0x0F);
-    uint8 op_reg = (op_spec_raw & 0x0F);
+    VM_DISPATCH();
+#else
+#define VM_HANDLER(handler_) case FX_VM_##handler_:
+#define VM_DISPATCH() continue
 
-    if (op_spec == OpSpecLoad_Int32) {
-        int16 offset = Read16();
+    while (true) {
+        instr = &mInstrs[mPC++];
 
-        uint8* dataptr = &Stack[Registers[FX_REG_SP] + offset];
-        uint32 data32 = *reinterpret_cast<uint32*>(dataptr);
+        switch (instr->Handler) {
+#endif
 
-        Registers[op_reg] = data32;
+    VM_HANDLER(HALT)
+    {
+        return;
     }
-    else if (op_spec == OpSpecLoad_AbsoluteInt32) {
-        uint32 offset = Read32();
 
-        uint8* dataptr = &Stack[offset];
-        uint32 data32 = *reinterpret_cast<uint32*>(dataptr);
+    VM_HANDLER(INVALID)
+    {
+        printf("!!! Invalid opcode %04X at offset %d!\n", instr->Imm, instr->Offset);
+        return;
+    }
+
+    VM_HANDLER(PUSH32)
+    {
+        TrackPushedType();
+        Push32(instr->Imm);
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(PUSH32R)
+    {
+        TrackPushedType();
+        Push32(Registers[instr->RegA]);
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(POP32)
+    {
+        Registers[instr->RegA] = Pop32();
+
+        if (mIsInParams) {
+            mPushedTypes.RemoveLast();
+        }
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(LOAD32)
+    {
+        uint8* dataptr = &Stack[Registers[FX_REG_SP] + instr->Offset];
+        Registers[instr->RegA] = *reinterpret_cast<uint32*>(dataptr);
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(LOAD32A)
+    {
+        uint8* dataptr = &Stack[static_cast<uint32>(instr->Offset)];
+        Registers[instr->RegA] = *reinterpret_cast<uint32*>(dataptr);
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(ADD32)
+    {
+        Registers[FX_REG_XR] = Registers[instr->RegA] + Registers[instr->RegB];
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(SUB32)
+    {
+        Registers[FX_REG_XR] = Registers[instr->RegA] - Registers[instr->RegB];
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(MUL32)
+    {
+        // Multiply as unsigned so that overflow wraps
+        Registers[FX_REG_XR] = static_cast<int32>(static_cast<uint32>(Registers[instr->RegA]) * static_cast<uint32>(Registers[instr->RegB]));
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(DIV32)
+    {
+        Registers[FX_REG_XR] = FxScriptDivide32(Registers[instr->RegA], Registers[instr->RegB]);
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(MOD32)
+    {
+        Registers[FX_REG_XR] = FxScriptModulo32(Registers[instr->RegA], Registers[instr->RegB]);
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(AND32)
+    {
+        Registers[FX_REG_XR] = Registers[instr->RegA] & Registers[instr->RegB];
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(OR32)
+    {
+        Registers[FX_REG_XR] = Registers[instr->RegA] | Registers[instr->RegB];
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(XOR32)
+    {
+        Registers[FX_REG_XR] = Registers[instr->RegA] ^ Registers[instr->RegB];
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(SHL32)
+    {
+        // Shift counts are masked to the width of the register, as they are on x86
+        Registers[FX_REG_XR] = static_cast<int32>(static_cast<uint32>(Registers[instr->RegA]) << (Registers[instr->RegB] & 31));
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(SHR32)
+    {
+        // Arithmetic shift, the sign bit is kept
+        Registers[FX_REG_XR] = Registers[instr->RegA] >> (Registers[instr->RegB] & 31);
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(CMPEQ32)
+    {
+        Registers[FX_REG_XR] = (Registers[instr->RegA] == Registers[instr->RegB]);
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(CMPNE32)
+    {
+        Registers[FX_REG_XR] = (Registers[instr->RegA] != Registers[instr->RegB]);
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(CMPLT32)
+    {
+        Registers[FX_REG_XR] = (Registers[instr->RegA] < Registers[instr->RegB]);
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(CMPLE32)
+    {
+        Registers[FX_REG_XR] = (Registers[instr->RegA] <= Registers[instr->RegB]);
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(CMPGT32)
+    {
+        Registers[FX_REG_XR] = (Registers[instr->RegA] > Registers[instr->RegB]);
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(CMPGE32)
+    {
+        Registers[FX_REG_XR] = (Registers[instr->RegA] >= Registers[instr->RegB]);
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(SAVE32)
+    {
+        // The offset is relative to the stack pointer
+        uint32* dataptr = reinterpret_cast<uint32*>(&Stack[Registers[FX_REG_SP] + instr->Offset]);
+        (*dataptr) = instr->Imm;
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(SAVE32R)
+    {
+        uint32* dataptr = reinterpret_cast<uint32*>(&Stack[Registers[FX_REG_SP] + instr->Offset]);
+        (*dataptr) = Registers[instr->RegA];
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(SAVE32A)
+    {
+        uint32* dataptr = reinterpret_cast<uint32*>(&Stack[static_cast<uint32>(instr->Offset)]);
+        (*dataptr) = instr->Imm;
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(SAVE32AR)
+    {
+        uint32* dataptr = reinterpret_cast<uint32*>(&Stack[static_cast<uint32>(instr->Offset)]);
+        (*dataptr) = Registers[instr->RegA];
+
+        VM_DISPATCH();
+    }
+
+    // Jump targets have been converted to instruction indices when the program was linked
+
+    VM_HANDLER(JMPR)
+    {
+        mPC = instr->Imm;
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(JMPA)
+    {
+        mPC = instr->Imm;
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(JMPAR)
+    {
+        mPC = Registers[instr->RegA];
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(CALLA)
+    {
+        Registers[FX_REG_RA] = mPC;
+
+        mPushedTypes.Clear();
+        mIsInParams = false;
+
+        PushCallFrame();
+
+        // Jump to the action address
+        mPC = instr->Imm;
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(RET)
+    {
+        PopCallFrame();
+
+        // Restore the return address register to its previous value. This is pushed when `paramsstart` is encountered.
+        mPC = Registers[FX_REG_RA];
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(CALLEXT)
+    {
+        DoCallExternal(instr->Imm);
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(PARAMSSTART)
+    {
+        mIsInParams = true;
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(TYPEINT)
+    {
+        mCurrentType = FxScriptValue::INT;
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(TYPESTR)
+    {
+        mCurrentType = FxScriptValue::STRING;
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(MOVE32)
+    {
+        Registers[instr->RegA] = instr->Imm;
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(MOVE32R)
+    {
+        Registers[instr->RegA] = Registers[instr->RegB];
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(ADD32LLL)
+    {
+        uint8* frameptr = &Stack[Registers[FX_REG_SP]];
+
+        const uint32 a = *reinterpret_cast<uint32*>(frameptr + instr->SrcOffsetA);
+        const uint32 b = *reinterpret_cast<uint32*>(frameptr + instr->SrcOffsetB);
+
+        Registers[FX_REG_XR] = static_cast<int32>(a + b);
+        *reinterpret_cast<uint32*>(frameptr + instr->Offset) = Registers[FX_REG_XR];
+
+        VM_DISPATCH();
+    }
+
+    VM_HANDLER(ADD32IL)
+    {
+        uint32* dataptr = reinterpret_cast<uint32*>(&Stack[Registers[FX_REG_SP] + instr->Offset]);
+
+        Registers[FX_REG_XR] = static_cast<int32>((*dataptr) + instr->Imm);
+        (*dataptr) = Registers[FX_REG_XR];
+
+        VM_DISPATCH();
+    }
+
+#if !FX_SCRIPT_VM_COMPUTED_GOTO
+        }
+    }
+#endif
+
+#undef VM_HANDLER
+#undef VM_DISPATCH
+}
+
+void FxScriptVM::DoCallExternal(uint32 func_index)
+{
+    // External calls are resolved when the program is linked
+    const FxScriptExternalFunc* external_func = &mExternalFuncs[func_index];
+
+    const uint32 num_params = mPushedTypes.Size();
+
+    // Bound functions read their arguments straight from the stack
+    if (external_func->Thunk != nullptr) {
+        if (num_params == external_func->ParameterTypes.size()) {
+            external_func->Thunk(this);
+        }
+        else {
+            printf("!!! Expected %zu parameters for external function, got %u!\n", external_func->ParameterTypes.size(), num_params);
+
+            for (uint32 i = 0; i < num_params; i++) {
+                Pop32();
+            }
+        }
+
+        mPushedTypes.Clear();
+        mIsInParams = false;
+
+        return;
+    }
+
+    if (mCallArgs.size() < num_params) {
+        mCallArgs.resize(num_params);
+    }
+
+    // Parameters are popped in reverse, fill the buffer from the back so they are passed in the order they were written
+    for (int i = num_params - 1; i >= 0; i--) {
+        FxScriptValue::ValueType param_type = mPushedTypes.GetLast();
+
+        FxScriptValue& value = mCallArgs[i];
+        value.Type = param_type;
+
+        if (param_type == FxScriptValue::INT) {
+            value.ValueInt = Pop32();
+            value.Type = param_type;
+        }
+        else if (param_type == FxScriptValue::STRING) {
+            value.ValueString = const_cast<char*>(GetString(Pop32()));
+            value.Type = param_type;
+        }
+
+        mPushedTypes.RemoveLast();
+    }
+
+    mPushedTypes.Clear();
+    mIsInParams = false;
+
+    FxScriptValue return_value{};
+    external_func->Function(this, std::span<const FxScriptValue>(mCallArgs.data(), num_params), &return_value);
+}
+
+
+/////////////////////////////////////////
+// Bytecode Peephole Optimizer
+/////////////////////////////////////////
+
+// The arithmetic handlers are encoded from their offset to FX_VM_ADD32
+static_assert(FX_VM_CMPGE32 - FX_VM_ADD32 == OpSpecArith_CmpGe - OpSpecArith_Add);
+
+static bool IsArithHandler(uint8 handler)
+{
+    return (handler >= FX_VM_ADD32 && handler <= FX_VM_CMPGE32);
+}
+
+static bool IsGeneralRegister(uint8 reg)
+{
+    return (reg >= FX_REG_X0 && reg <= FX_REG_X7);
+}
+
+static bool InstrReadsRegister(const FxScriptVMInstr& instr, uint8 reg)
+{
+    if (IsArithHandler(instr.Handler)) {
+        return (instr.RegA == reg || instr.RegB == reg);
+    }
+
+    switch (instr.Handler) {
+    case FX_VM_PUSH32R:
+    case FX_VM_SAVE32R:
+    case FX_VM_SAVE32AR:
+    case FX_VM_JMPAR:
+        return (instr.RegA == reg);
+    case FX_VM_MOVE32R:
+        return (instr.RegB == reg);
+    case FX_VM_RET:
+        return (reg == FX_REG_RA);
+    default:;
+    }
+
+    return false;
+}
+
+static bool InstrWritesRegister(const FxScriptVMInstr& instr, uint8 reg)
+{
+    if (IsArithHandler(instr.Handler) || instr.Handler == FX_VM_ADD32LLL || instr.Handler == FX_VM_ADD32IL) {
+        return (reg == FX_REG_XR);
+    }
+
+    switch (instr.Handler) {
+    case FX_VM_POP32:
+    case FX_VM_LOAD32:
+    case FX_VM_LOAD32A:
+    case FX_VM_MOVE32:
+    case FX_VM_MOVE32R:
+        return (instr.RegA == reg);
+    default:;
+    }
+
+    return false;
+}
+
+static void WriteBytecode16(FxMPPagedArray<uint8>& bytecode, uint16 value)
+{
+    bytecode.Insert(static_cast<uint8>(value >> 8));
+    bytecode.Insert(static_cast<uint8>(value));
+}
+
+static void WriteBytecode32(FxMPPagedArray<uint8>& bytecode, uint32 value)
+{
+    WriteBytecode16(bytecode, static_cast<uint16>(value >> 16));
+    WriteBytecode16(bytecode, static_cast<uint16>(value));
+}
+
+static void WriteBytecodeOp(FxMPPagedArray<uint8>& bytecode, uint8 op_base, uint8 op_spec)
+{
+    bytecode.Insert(op_base);
+    bytecode.Insert(op_spec);
+}
+
+void FxScriptBCOptimizer::Optimize()
+{
+    FxMPPagedArray<uint8>& bytecode = mEmitter.mBytecode;
+
+    const uint32 code_size = bytecode.Size();
+
+    if (code_size == 0) {
+        return;
+    }
+
+    // Flatten the bytecode so it can be decoded the same way as when it is linked
+    std::vector<uint8> code(code_size + FX_SCRIPT_PROGRAM_CODE_PADDING, 0);
+
+    uint32 copied_size = 0;
+
+    for (uint32 page_index = 0; copied_size < code_size; page_index++) {
+        const uint32 copy_size = std::min(bytecode.PageNodeCapacity, code_size - copied_size);
+
+        memcpy(code.data() + copied_size, bytecode.PageDirectory[page_index]->Data, copy_size);
+        copied_size += copy_size;
+    }
+
+    code.resize(code_size);
+
+    if (!Decode(code)) {
+        printf("!!! Could not decode bytecode, skipping peephole optimizations\n");
+        return;
+    }
+
+    while (RunPass()) {
+    }
+
+    SelectSuperinstructions();
+
+    Encode();
+}
+
+bool FxScriptBCOptimizer::Decode(const std::vector<uint8>& code)
+{
+    const uint32 code_size = static_cast<uint32>(code.size());
+
+    mInstrs.clear();
+
+    // The instruction index for each byte offset in the code. Offsets that are not the start of an instruction are
+    // left as UINT32_MAX.
+    std::vector<uint32> instr_indices(code_size + 1, UINT32_MAX);
+
+    uint32 offset = 0;
+
+    while (offset < code_size) {
+        instr_indices[offset] = static_cast<uint32>(mInstrs.size());
+
+        Instr instr;
+        instr.Offset = offset;
+
+        offset = DecodeVMInstr(code.data(), code_size, offset, instr.Op);
+
+        if (instr.Op.Handler == FX_VM_INVALID || offset > code_size) {
+            return false;
+        }
+
+        instr.Size = offset - instr.Offset;
+
+        mInstrs.push_back(instr);
+    }
+
+    // Jumps past the last instruction land on the end of the code
+    instr_indices[code_size] = static_cast<uint32>(mInstrs.size());
+
+    for (Instr& instr : mInstrs) {
+        const uint8 handler = instr.Op.Handler;
+
+        if (handler != FX_VM_JMPR && handler != FX_VM_JMPA && handler != FX_VM_CALLA) {
+            continue;
+        }
+
+        if (instr.Op.Imm > code_size || instr_indices[instr.Op.Imm] == UINT32_MAX) {
+            return false;
+        }
+
+        instr.Op.Imm = instr_indices[instr.Op.Imm];
+
+        if (instr.Op.Imm < mInstrs.size()) {
+            mInstrs[instr.Op.Imm].IsJumpTarget = true;
+        }
+    }
+
+    for (const FxScriptBytecodeActionHandle& action : mEmitter.ActionHandles) {
+        if (action.BytecodeIndex > code_size || instr_indices[action.BytecodeIndex] == UINT32_MAX) {
+            return false;
+        }
+
+        const uint32 instr_index = instr_indices[action.BytecodeIndex];
+
+        if (instr_index < mInstrs.size()) {
+            mInstrs[instr_index].IsJumpTarget = true;
+        }
+    }
+
+    return true;
+}
+
+void FxScriptBCOptimizer::Encode()
+{
+    const size_t instr_count = mInstrs.size();
+
+    // The position of each instruction in the new bytecode. Removed instructions are given the position of the next
+    // instruction that is kept, so anything that pointed to them lands in the same place.
+    std::vector<uint32> new_offsets(instr_count + 1);
+
+    uint32 offset = 0;
+
+    for (size_t i = 0; i < instr_count; i++) {
+        new_offsets[i] = offset;
+
+        if (!mInstrs[i].IsRemoved) {
+            offset += GetEncodedSize(mInstrs[i]);
+        }
+    }
+
+    new_offsets[instr_count] = offset;
+
+    FxMPPagedArray<uint8>& bytecode = mEmitter.mBytecode;
+
+    bytecode.Clear();
+
+    for (size_t i = 0; i < instr_count; i++) {
+        const Instr& instr = mInstrs[i];
+
+        if (instr.IsRemoved) {
+            continue;
+        }
+
+        const FxScriptVMInstr& op = instr.Op;
+
+        if (IsArithHandler(op.Handler)) {
+            WriteBytecodeOp(bytecode, OpBase_Arith, static_cast<uint8>(OpSpecArith_Add + (op.Handler - FX_VM_ADD32)));
+            bytecode.Insert(op.RegA);
+            bytecode.Insert(op.RegB);
+            continue;
+        }
+
+        switch (op.Handler) {
+        case FX_VM_PUSH32:
+            WriteBytecodeOp(bytecode, OpBase_Push, OpSpecPush_Int32);
+            WriteBytecode32(bytecode, op.Imm);
+            break;
+        case FX_VM_PUSH32R:
+            WriteBytecodeOp(bytecode, OpBase_Push, OpSpecPush_Reg32);
+            WriteBytecode16(bytecode, op.RegA);
+            break;
+        case FX_VM_POP32:
+            WriteBytecodeOp(bytecode, OpBase_Pop, (OpSpecPop_Int32 << 4) | (op.RegA & 0x0F));
+            break;
+        case FX_VM_LOAD32:
+            WriteBytecodeOp(bytecode, OpBase_Load, (OpSpecLoad_Int32 << 4) | (op.RegA & 0x0F));
+            WriteBytecode16(bytecode, static_cast<uint16>(op.Offset));
+            break;
+        case FX_VM_LOAD32A:
+            WriteBytecodeOp(bytecode, OpBase_Load, (OpSpecLoad_AbsoluteInt32 << 4) | (op.RegA & 0x0F));
+            WriteBytecode32(bytecode, static_cast<uint32>(op.Offset));
+            break;
+        case FX_VM_SAVE32:
+            WriteBytecodeOp(bytecode, OpBase_Save, OpSpecSave_Int32);
+            WriteBytecode16(bytecode, static_cast<uint16>(op.Offset));
+            WriteBytecode32(bytecode, op.Imm);
+            break;
+        case FX_VM_SAVE32R:
+            WriteBytecodeOp(bytecode, OpBase_Save, OpSpecSave_Reg32);
+            WriteBytecode16(bytecode, static_cast<uint16>(op.Offset));
+            WriteBytecode16(bytecode, op.RegA);
+            break;
+        case FX_VM_SAVE32A:
+            WriteBytecodeOp(bytecode, OpBase_Save, OpSpecSave_AbsoluteInt32);
+            WriteBytecode32(bytecode, static_cast<uint32>(op.Offset));
+            WriteBytecode32(bytecode, op.Imm);
+            break;
+        case FX_VM_SAVE32AR:
+            WriteBytecodeOp(bytecode, OpBase_Save, OpSpecSave_AbsoluteReg32);
+            WriteBytecode32(bytecode, static_cast<uint32>(op.Offset));
+            WriteBytecode16(bytecode, op.RegA);
+            break;
+        case FX_VM_JMPR:
+            // Relative jumps are from the end of the instruction
+            WriteBytecodeOp(bytecode, OpBase_Jump, OpSpecJump_Relative);
+            WriteBytecode16(bytecode, static_cast<uint16>(new_offsets[op.Imm] - (new_offsets[i] + 4)));
+            break;
+        case FX_VM_JMPA:
+            WriteBytecodeOp(bytecode, OpBase_Jump, OpSpecJump_Absolute);
+            WriteBytecode32(bytecode, new_offsets[op.Imm]);
+            break;
+        case FX_VM_JMPAR:
+            WriteBytecodeOp(bytecode, OpBase_Jump, OpSpecJump_AbsoluteReg32);
+            WriteBytecode16(bytecode, op.RegA);
+            break;
+        case FX_VM_CALLA:
+            WriteBytecodeOp(bytecode, OpBase_Jump, OpSpecJump_CallAbsolute);
+            WriteBytecode32(bytecode, new_offsets[op.Imm]);
+            break;
+        case FX_VM_RET:
+            WriteBytecodeOp(bytecode, OpBase_Jump, OpSpecJump_ReturnToCaller);
+            break;
+        case FX_VM_CALLEXT:
+            WriteBytecodeOp(bytecode, OpBase_Jump, OpSpecJump_CallExternal);
+            WriteBytecode32(bytecode, op.Imm);
+            break;
+        case FX_VM_PARAMSSTART:
+            WriteBytecodeOp(bytecode, OpBase_Data, OpSpecData_ParamsStart);
+            break;
+        case FX_VM_TYPEINT:
+            WriteBytecodeOp(bytecode, OpBase_Type, OpSpecType_Int);
+            break;
+        case FX_VM_TYPESTR:
+            WriteBytecodeOp(bytecode, OpBase_Type, OpSpecType_String);
+            break;
+        case FX_VM_MOVE32:
+            WriteBytecodeOp(bytecode, OpBase_Move, (OpSpecMove_Int32 << 4) | (op.RegA & 0x0F));
+            WriteBytecode32(bytecode, op.Imm);
+            break;
+        case FX_VM_MOVE32R:
+            WriteBytecodeOp(bytecode, OpBase_Move, (OpSpecMove_Reg32 << 4) | (op.RegA & 0x0F));
+            WriteBytecode16(bytecode, op.RegB);
+            break;
+        case FX_VM_ADD32LLL:
+            WriteBytecodeOp(bytecode, OpBase_Fused, OpSpecFused_AddLocalLocalToLocal);
+            WriteBytecode16(bytecode, static_cast<uint16>(op.Offset));
+            WriteBytecode16(bytecode, static_cast<uint16>(op.SrcOffsetA));
+            WriteBytecode16(bytecode, static_cast<uint16>(op.SrcOffsetB));
+            break;
+        case FX_VM_ADD32IL:
+            WriteBytecodeOp(bytecode, OpBase_Fused, OpSpecFused_AddImmToLocal);
+            WriteBytecode16(bytecode, static_cast<uint16>(op.Offset));
+            WriteBytecode32(bytecode, op.Imm);
+            break;
+        default:;
+        }
+    }
+
+    for (FxScriptBytecodeActionHandle& action : mEmitter.ActionHandles) {
+        auto it = std::lower_bound(mInstrs.begin(), mInstrs.end(), action.BytecodeIndex,
+            [](const Instr& instr, uint32 offset) { return instr.Offset < offset; });
+
+        action.BytecodeIndex = new_offsets[it - mInstrs.begin()];
+    }
+}
+
+uint32 FxScriptBCOptimizer::GetEncodedSize(const Instr& instr)
+{
+    const uint8 handler = instr.Op.Handler;
+
+    if (IsArithHandler(handler)) {
+        return 4;
+    }
+
+    switch (handler) {
+    case FX_VM_POP32:
+    case FX_VM_RET:
+    case FX_VM_PARAMSSTART:
+    case FX_VM_TYPEINT:
+    case FX_VM_TYPESTR:
+        return 2;
+    case FX_VM_PUSH32R:
+    case FX_VM_LOAD32:
+    case FX_VM_JMPR:
+    case FX_VM_JMPAR:
+    case FX_VM_MOVE32R:
+        return 4;
+    case FX_VM_PUSH32:
+    case FX_VM_LOAD32A:
+    case FX_VM_SAVE32R:
+    case FX_VM_JMPA:
+    case FX_VM_CALLA:
+    case FX_VM_CALLEXT:
+    case FX_VM_MOVE32:
+        return 6;
+    case FX_VM_SAVE32:
+    case FX_VM_SAVE32AR:
+    case FX_VM_ADD32LLL:
+    case FX_VM_ADD32IL:
+        return 8;
+    case FX_VM_SAVE32A:
+        return 10;
+    default:;
+    }
+
+    return instr.Size;
+}
+
+bool FxScriptBCOptimizer::RunPass()
+{
+    bool has_changed = false;
+
+    for (size_t i = 0; i < mInstrs.size(); i++) {
+        if (mInstrs[i].IsRemoved) {
+            continue;
+        }
 
-        Registers[op_reg] = data32;
+        if (TryRemoveUnreachable(i) || TryFoldPushPop(i) || TryFoldMovePush(i) || TryRemoveReload(i) ||
+            TryRemoveDeadDefinition(i)) {
+            has_changed = true;
+        }
     }
+
+    return has_changed;
 }
 
-void FxScriptVM::DoPush(uint8 op_base, uint8 op_spec)
+bool FxScriptBCOptimizer::TryFoldPushPop(size_t index)
 {
-    if (mIsInParams) {
-        if (mCurrentType != FxScriptValue::NONETYPE) {
-            mPushedTypes.Insert(mCurrentType);
-            mCurrentType = FxScriptValue::NONETYPE;
-        }
-        else {
-            mPushedTypes.Insert(FxScriptValue::INT);
-        }
+    Instr& push = mInstrs[index];
+
+    if (push.Op.Handler != FX_VM_PUSH32 && push.Op.Handler != FX_VM_PUSH32R) {
+        return false;
     }
 
-    if (op_spec == OpSpecPush_Int32) {
-        uint32 value = Read32();
-        Push32(value);
+    const size_t next_index = GetNextInstr(index);
+
+    if (next_index == mInstrs.size()) {
+        return false;
     }
-    else if (op_spec == OpSpecPush_Reg32) {
-        uint16 reg = Read16();
-        Push32(Registers[reg]);
+
+    Instr& pop = mInstrs[next_index];
+
+    if (pop.Op.Handler != FX_VM_POP32 || pop.IsJumpTarget) {
+        return false;
     }
-}
 
-void FxScriptVM::DoPop(uint8 op_base, uint8 op_spec_raw)
-{
-    uint8 op_spec = ((op_spec_raw >> 4) & 0x0F);
-    uint8 op_reg = (op_spec_raw & 0x0F);
+    const uint8 dest_reg = pop.Op.RegA;
 
-    if (op_spec == OpSpecPush_Int32) {
-        uint32 value = Pop32();
+    if (dest_reg == FX_REG_SP || (push.Op.Handler == FX_VM_PUSH32R && push.Op.RegA == FX_REG_SP)) {
+        return false;
+    }
 
-        Registers[op_reg] = value;
+    // The push takes the type set before it, removing the push would leave the type for the next push
+    if (IsTypePending(index)) {
+        return false;
     }
 
-    if (mIsInParams) {
-        mPushedTypes.RemoveLast();
+    if (push.Op.Handler == FX_VM_PUSH32) {
+        // push32 [i32], pop32 [%r32] -> move32 [%r32] [i32]
+        push.Op.Handler = FX_VM_MOVE32;
+        push.Op.RegA = dest_reg;
+    }
+    else if (push.Op.RegA == dest_reg) {
+        // push32r [%r32], pop32 [%r32] -> nothing
+        RemoveInstr(index);
+    }
+    else {
+        // push32r [%r32 a], pop32 [%r32 b] -> move32r [%r32 b] [%r32 a]
+        push.Op.Handler = FX_VM_MOVE32R;
+        push.Op.RegB = push.Op.RegA;
+        push.Op.RegA = dest_reg;
     }
-}
 
-void FxScriptVM::DoArith(uint8 op_base, uint8 op_spec)
-{
-    uint8 a_reg = mBytecode[mPC++];
-    uint8 b_reg = mBytecode[mPC++];
+    RemoveInstr(next_index);
 
-    if (op_spec == OpSpecArith_Add) {
-        Registers[FX_REG_XR] = Registers[a_reg] + Registers[b_reg];
-    }
+    return true;
 }
 
-void FxScriptVM::DoSave(uint8 op_base, uint8 op_spec)
+bool FxScriptBCOptimizer::TryFoldMovePush(size_t index)
 {
-    uint32 offset;
+    Instr& move = mInstrs[index];
 
-    if (op_spec == OpSpecSave_AbsoluteInt32 || op_spec == OpSpecSave_AbsoluteReg32) {
-        offset = Read32();
-    }
-    else {
-        // The offset is relative to the stack pointer, get the absolute value
-        const int16 relative_offset = static_cast<int16>(Read16());
-        offset = static_cast<uint32>(Registers[FX_REG_SP] + relative_offset);
+    if (move.Op.Handler != FX_VM_MOVE32 && move.Op.Handler != FX_VM_MOVE32R) {
+        return false;
     }
 
-    uint32* dataptr = reinterpret_cast<uint32*>(&Stack[offset]);
+    const size_t next_index = GetNextInstr(index);
 
-    // Save a imm32 into an offset in the stack
-    if (op_spec == OpSpecSave_Int32) {
-        (*dataptr) = Read32();
+    if (next_index == mInstrs.size()) {
+        return false;
     }
 
-    // Save a register into an offset in the stack
-    else if (op_spec == OpSpecSave_Reg32) {
-        uint16 reg = Read16();
-        (*dataptr) = Registers[reg];
+    Instr& push = mInstrs[next_index];
+
+    if (push.Op.Handler != FX_VM_PUSH32R || push.IsJumpTarget || push.Op.RegA != move.Op.RegA) {
+        return false;
     }
 
-    else if (op_spec == OpSpecSave_AbsoluteInt32) {
-        (*dataptr) = Read32();
+    // The register no longer holds the value after this, so it cannot be read again
+    if (IsRegisterLive(next_index, move.Op.RegA)) {
+        return false;
     }
 
-    else if (op_spec == OpSpecSave_AbsoluteReg32) {
-        uint16 reg = Read16();
-        (*dataptr) = Registers[reg];
+    if (move.Op.Handler == FX_VM_MOVE32) {
+        // move32 [%r32] [i32], push32r [%r32] -> push32 [i32]
+        push.Op.Handler = FX_VM_PUSH32;
+        push.Op.RegA = FX_REG_NONE;
+        push.Op.Imm = move.Op.Imm;
     }
+    else {
+        // move32r [%r32 a] [%r32 b], push32r [%r32 a] -> push32r [%r32 b]
+        push.Op.RegA = move.Op.RegB;
+    }
+
+    RemoveInstr(index);
+
+    return true;
 }
 
-void FxScriptVM::DoJump(uint8 op_base, uint8 op_spec)
+bool FxScriptBCOptimizer::TryRemoveDeadDefinition(size_t index)
 {
+    const FxScriptVMInstr& op = mInstrs[index].Op;
 
-    if (op_spec == OpSpecJump_Relative) {
-        uint16 offset = Read16();
-        mPC += offset;
+    if (op.Handler != FX_VM_LOAD32 && op.Handler != FX_VM_LOAD32A && op.Handler != FX_VM_MOVE32 &&
+        op.Handler != FX_VM_MOVE32R) {
+        return false;
     }
-    else if (op_spec == OpSpecJump_Absolute) {
-        uint32 position = Read32();
-        mPC = position;
+
+    if (op.RegA == FX_REG_SP) {
+        return false;
     }
-    else if (op_spec == OpSpecJump_AbsoluteReg32) {
-        uint16 reg = Read16();
-        mPC = Registers[reg];
+
+    const bool is_self_move = (op.Handler == FX_VM_MOVE32R && op.RegA == op.RegB);
+
+    if (!is_self_move && IsRegisterLive(index, op.RegA)) {
+        return false;
     }
-    else if (op_spec == OpSpecJump_CallAbsolute) {
-        uint32 call_address = Read32();
-        //printf("Call to address % 4u\n", call_address);
 
-        //Push32(mPC);
+    RemoveInstr(index);
 
-        Registers[FX_REG_RA] = mPC;
+    return true;
+}
 
-        mPushedTypes.Clear();
-        mIsInParams = false;
+bool FxScriptBCOptimizer::TryRemoveReload(size_t index)
+{
+    const FxScriptVMInstr& save = mInstrs[index].Op;
 
-        PushCallFrame();
+    if (save.Handler != FX_VM_SAVE32R && save.Handler != FX_VM_SAVE32AR) {
+        return false;
+    }
 
-        // Jump to the action address
-        mPC = call_address;
+    const size_t next_index = GetNextInstr(index);
+
+    if (next_index == mInstrs.size() || mInstrs[next_index].IsJumpTarget) {
+        return false;
     }
-    else if (op_spec == OpSpecJump_ReturnToCaller) {
-        PopCallFrame();
 
-        //uint32 return_address = Pop32();
+    const FxScriptVMInstr& load = mInstrs[next_index].Op;
 
-        uint32 return_address = Registers[FX_REG_RA];
-        //printf("Return to caller (%04d)\n", return_address);
-        mPC = return_address;
+    const uint8 load_handler = (save.Handler == FX_VM_SAVE32R) ? FX_VM_LOAD32 : FX_VM_LOAD32A;
 
-        // Restore the return address register to its previous value. This is pushed when `paramsstart` is encountered.
-        //Registers[FX_REG_RA] = Pop32();
+    // save32r [offset] [%r32], load32 [offset] [%r32] -> save32r [offset] [%r32]
+    if (load.Handler != load_handler || load.Offset != save.Offset || load.RegA != save.RegA) {
+        return false;
     }
-    else if (op_spec == OpSpecJump_CallExternal) {
-        uint32 hashed_name = Read32();
 
-        FxScriptExternalFunc* external_func = FindExternalAction(hashed_name);
+    RemoveInstr(next_index);
 
-        if (!external_func) {
-            printf("!!! Could not find external function in VM!\n");
-            return;
+    return true;
+}
+
+void FxScriptBCOptimizer::SelectSuperinstructions()
+{
+    for (size_t i = 0; i < mInstrs.size(); i++) {
+        if (mInstrs[i].IsRemoved) {
+            continue;
         }
 
-        std::vector<FxScriptValue> params;
-        params.reserve(external_func->ParameterTypes.size());
+        TryFuseAddToLocal(i);
+    }
+}
 
-        uint32 num_params = mPushedTypes.Size();
+bool FxScriptBCOptimizer::TryFuseAddToLocal(size_t index)
+{
+    // The two values that are added, the add, and the save of the result
+    size_t indices[4] = { index };
 
-        printf("Num Params: %u\n", num_params);
+    for (int i = 1; i < 4; i++) {
+        indices[i] = GetNextInstr(indices[i - 1]);
 
-        for (int i = 0; i < num_params; i++) {
-            FxScriptValue::ValueType param_type = mPushedTypes.GetLast();
+        // Jumps can only land on the first instruction, which is replaced by the superinstruction
+        if (indices[i] == mInstrs.size() || mInstrs[indices[i]].IsJumpTarget) {
+            return false;
+        }
+    }
 
-            FxScriptValue value;
-            value.Type = param_type;
+    Instr& first = mInstrs[indices[0]];
+    const Instr& second = mInstrs[indices[1]];
+    const FxScriptVMInstr& add = mInstrs[indices[2]].Op;
+    const FxScriptVMInstr& save = mInstrs[indices[3]].Op;
 
-            if (param_type == FxScriptValue::INT) {
-                value.ValueInt = Pop32();
-                value.Type = param_type;
-            }
-            else if (param_type == FxScriptValue::STRING) {
-                uint32 string_location = Pop32();
-                uint8* str_base_ptr = &mBytecode[string_location];
-                // uint16 str_length = *((uint16*)str_base_ptr);
+    if (add.Handler != FX_VM_ADD32 || save.Handler != FX_VM_SAVE32R || save.RegA != FX_REG_XR) {
+        return false;
+    }
 
-                str_base_ptr += 2;
+    const uint8 first_reg = first.Op.RegA;
+    const uint8 second_reg = second.Op.RegA;
 
-                value.ValueString = reinterpret_cast<char*>(str_base_ptr);
-                value.Type = param_type;
-            }
+    const bool is_first_load = (first.Op.Handler == FX_VM_LOAD32);
+    const bool is_second_load = (second.Op.Handler == FX_VM_LOAD32);
 
-            mPushedTypes.RemoveLast();
+    if ((!is_first_load && first.Op.Handler != FX_VM_MOVE32) || (!is_second_load && second.Op.Handler != FX_VM_MOVE32)) {
+        return false;
+    }
+
+    if (!IsGeneralRegister(first_reg) || !IsGeneralRegister(second_reg) || first_reg == second_reg) {
+        return false;
+    }
+
+    // Addition is commutative, so the operands can be in either order
+    const bool is_same_order = (add.RegA == first_reg && add.RegB == second_reg);
+    const bool is_swapped_order = (add.RegA == second_reg && add.RegB == first_reg);
+
+    if (!is_same_order && !is_swapped_order) {
+        return false;
+    }
+
+    // The registers are not written by the superinstruction
+    if (IsRegisterLive(indices[3], first_reg) || IsRegisterLive(indices[3], second_reg)) {
+        return false;
+    }
+
+    FxScriptVMInstr fused {};
+    fused.Offset = save.Offset;
+
+    if (is_first_load && is_second_load) {
+        // load32 [a] [%r32 x], load32 [b] [%r32 y], add32 [%r32 x] [%r32 y], save32r [dest] XR -> add32lll [dest] [a] [b]
+        fused.Handler = FX_VM_ADD32LLL;
+        fused.SrcOffsetA = static_cast<int16>(first.Op.Offset);
+        fused.SrcOffsetB = static_cast<int16>(second.Op.Offset);
+    }
+    else if (is_first_load || is_second_load) {
+        const FxScriptVMInstr& load = is_first_load ? first.Op : second.Op;
+        const FxScriptVMInstr& move = is_first_load ? second.Op : first.Op;
 
-            params.push_back(value);
+        // load32 [a] [%r32 x], move32 [%r32 y] [i32], add32 [%r32 x] [%r32 y], save32r [a] XR -> add32il [a] [i32]
+        if (load.Offset != save.Offset) {
+            return false;
         }
 
-        mPushedTypes.Clear();
-        mIsInParams = false;
+        fused.Handler = FX_VM_ADD32IL;
+        fused.Imm = move.Imm;
+    }
+    else {
+        return false;
+    }
+
+    first.Op = fused;
 
-        FxScriptValue return_value{};
-        external_func->Function(this, params, &return_value);
+    for (int i = 1; i < 4; i++) {
+        RemoveInstr(indices[i]);
     }
+
+    return true;
 }
 
-void FxScriptVM::DoData(uint8 op_base, uint8 op_spec)
+bool FxScriptBCOptimizer::TryRemoveUnreachable(size_t index)
 {
-    if (op_spec == OpSpecData_String) {
-        uint16 length = Read16();
-        mPC += length;
+    const uint8 handler = mInstrs[index].Op.Handler;
+
+    if (handler != FX_VM_RET && handler != FX_VM_JMPR && handler != FX_VM_JMPA && handler != FX_VM_JMPAR) {
+        return false;
     }
-    else if (op_spec == OpSpecData_ParamsStart) {
-        mIsInParams = true;
 
-        // Push the current return address pointer. This is so nested action calls can correctly navigate back
-        // to the caller.
-        //Push32(Registers[FX_REG_RA]);
+    bool has_removed = false;
+
+    // Nothing can reach the instructions after an unconditional jump until the next jump target
+    for (size_t i = GetNextInstr(index); i < mInstrs.size() && !mInstrs[i].IsJumpTarget; i = GetNextInstr(i)) {
+        RemoveInstr(i);
+        has_removed = true;
     }
+
+    return has_removed;
 }
 
-void FxScriptVM::DoType(uint8 op_base, uint8 op_spec)
+void FxScriptBCOptimizer::RemoveInstr(size_t index)
 {
-    if (op_spec == OpSpecType_Int) {
-        mCurrentType = FxScriptValue::INT;
+    Instr& instr = mInstrs[index];
+
+    instr.IsRemoved = true;
+
+    if (instr.IsJumpTarget) {
+        const size_t next_index = GetNextInstr(index);
+
+        if (next_index < mInstrs.size()) {
+            mInstrs[next_index].IsJumpTarget = true;
+        }
     }
-    else if (op_spec == OpSpecType_String) {
-        mCurrentType = FxScriptValue::STRING;
+}
+
+bool FxScriptBCOptimizer::IsRegisterLive(size_t index, uint8 reg) const
+{
+    for (size_t i = GetNextInstr(index); i < mInstrs.size(); i = GetNextInstr(i)) {
+        const FxScriptVMInstr& op = mInstrs[i].Op;
+
+        if (InstrReadsRegister(op, reg)) {
+            return true;
+        }
+
+        if (InstrWritesRegister(op, reg)) {
+            return false;
+        }
+
+        switch (op.Handler) {
+        case FX_VM_CALLA:
+        case FX_VM_CALLEXT:
+        case FX_VM_RET:
+            // Values are passed on the stack, and the general registers are not kept across calls
+            return !IsGeneralRegister(reg);
+        case FX_VM_JMPR:
+        case FX_VM_JMPA:
+        case FX_VM_JMPAR:
+            return true;
+        default:;
+        }
     }
+
+    // The result registers can still be read by the host after the program has finished
+    return !IsGeneralRegister(reg);
 }
 
-void FxScriptVM::DoMove(uint8 op_base, uint8 op_spec_raw)
+bool FxScriptBCOptimizer::IsTypePending(size_t index) const
 {
-    uint8 op_spec = ((op_spec_raw >> 4) & 0x0F);
-    FxScriptRegister op_reg = static_cast<FxScriptRegister>(op_spec_raw & 0x0F);
+    for (size_t i = index; i < mInstrs.size(); i = GetPrevInstr(i)) {
+        // Another path could have set the type before jumping here
+        if (mInstrs[i].IsJumpTarget) {
+            return true;
+        }
 
-    if (op_spec == OpSpecMove_Int32) {
-        int32 value = Read32();
-        Registers[op_reg] = value;
+        if (i == index) {
+            continue;
+        }
+
+        switch (mInstrs[i].Op.Handler) {
+        case FX_VM_TYPEINT:
+        case FX_VM_TYPESTR:
+            return true;
+        case FX_VM_PUSH32:
+        case FX_VM_PUSH32R:
+        case FX_VM_CALLA:
+        case FX_VM_CALLEXT:
+        case FX_VM_RET:
+        case FX_VM_JMPR:
+        case FX_VM_JMPA:
+        case FX_VM_JMPAR:
+            return false;
+        default:;
+        }
     }
+
+    return false;
+}
+
+size_t FxScriptBCOptimizer::GetNextInstr(size_t index) const
+{
+    for (size_t i = index + 1; i < mInstrs.size(); i++) {
+        if (!mInstrs[i].IsRemoved) {
+            return i;
+        }
+    }
+
+    return mInstrs.size();
 }
 
+size_t FxScriptBCOptimizer::GetPrevInstr(size_t index) const
+{
+    for (size_t i = index; i > 0; i--) {
+        if (!mInstrs[i - 1].IsRemoved) {
+            return i - 1;
+        }
+    }
+
+    return mInstrs.size();
+}
 
 
 //////////////////////////////////////////////////
@@ -3269,6 +5352,15 @@ static const char* GetX86Register(FxScriptRegister reg)
         return "ecx";
     case FX_REG_X3:
         return "edx";
+    case FX_REG_X4:
+        return "edi";
+    // There are not enough x86 registers for the rest, keep them in memory
+    case FX_REG_X5:
+        return "dword [fx_x5]";
+    case FX_REG_X6:
+        return "dword [fx_x6]";
+    case FX_REG_X7:
+        return "dword [fx_x7]";
     case FX_REG_SP:
         return "esp";
     case FX_REG_RA:
@@ -3280,6 +5372,28 @@ static const char* GetX86Register(FxScriptRegister reg)
     return "UNKNOWN";
 }
 
+static bool IsX86MemoryRegister(FxScriptRegister reg)
+{
+    return (reg == FX_REG_X5 || reg == FX_REG_X6 || reg == FX_REG_X7);
+}
+
+static const char* GetX86LowByteRegister(FxScriptRegister reg)
+{
+    switch (reg) {
+    case FX_REG_X0:
+    case FX_REG_XR:
+        return "al";
+    case FX_REG_X1:
+        return "bl";
+    case FX_REG_X2:
+        return "cl";
+    case FX_REG_X3:
+        return "dl";
+    default:;
+    }
+    return "UNKNOWN";
+}
+
 //#define BC_PRINT_OP(fmt_, ...) snprintf(s, 128, fmt_, ##__VA_ARGS__)
 
 void FxScriptTranspilerX86::DoLoad(char* s, uint8 op_base, uint8 op_spec_raw)
@@ -3291,13 +5405,20 @@ void FxScriptTranspilerX86::DoLoad(char* s, uint8 op_base, uint8 op_spec_raw)
         int16 offset = Read16();
         // load32 [off32] [%r32]
         offset += 8;
-        StrOut("mov %s, [ebp %c %d]", GetX86Register(static_cast<FxScriptRegister>(op_reg)), (offset <= 0 ? '+' : '-'), abs(offset));
+
+        char src[32];
+        snprintf(src, sizeof(src), "dword [ebp %c %d]", (offset <= 0 ? '+' : '-'), abs(offset));
+
+        MoveOut(GetX86Register(static_cast<FxScriptRegister>(op_reg)), src);
     }
     else if (op_spec == OpSpecLoad_AbsoluteInt32) {
         uint32 offset = Read32();
         //StrOut("load32a %u, %s", offset, GetX86Register(static_cast<FxScriptRegister>(op_reg)));
-        StrOut("mov %s, [esi + %u]", GetX86Register(static_cast<FxScriptRegister>(op_reg)), offset);
 
+        char src[32];
+        snprintf(src, sizeof(src), "dword [esi + %u]", offset);
+
+        MoveOut(GetX86Register(static_cast<FxScriptRegister>(op_reg)), src);
     }
 }
 
@@ -3332,12 +5453,121 @@ void FxScriptTranspilerX86::DoPop(char* s, uint8 op_base, uint8 op_spec_raw)
 
 void FxScriptTranspilerX86::DoArith(char* s, uint8 op_base, uint8 op_spec)
 {
-    uint8 a_reg = mBytecode[mBytecodeIndex++];
-    uint8 b_reg = mBytecode[mBytecodeIndex++];
+    const FxScriptRegister dest_reg = static_cast<FxScriptRegister>(mBytecode[mBytecodeIndex++]);
+    const FxScriptRegister b_reg = static_cast<FxScriptRegister>(mBytecode[mBytecodeIndex++]);
 
-    if (op_spec == OpSpecArith_Add) {
+    const char* b_name = GetX86Register(b_reg);
+
+    FxScriptRegister a_reg = dest_reg;
+
+    // imul and the compares need a register destination, and edi has no low byte register to set. Do the
+    // operation in a scratch register for those and copy the result back.
+    const bool is_compare = (op_spec >= OpSpecArith_CmpEq && op_spec <= OpSpecArith_CmpGe);
+
+    if (IsX86MemoryRegister(dest_reg) || (is_compare && dest_reg == FX_REG_X4)) {
+        for (FxScriptRegister scratch_reg : { FX_REG_X1, FX_REG_X3, FX_REG_X0 }) {
+            if (strcmp(GetX86Register(scratch_reg), b_name) != 0) {
+                a_reg = scratch_reg;
+                break;
+            }
+        }
+
+        StrOut("push %s", GetX86Register(a_reg));
+        StrOut("mov %s, %s", GetX86Register(a_reg), GetX86Register(dest_reg));
+    }
+
+    const char* a_name = GetX86Register(a_reg);
+
+    // As with add, the result is left in the A register
+    switch (op_spec) {
+    case OpSpecArith_Add:
         // add32 [%reg32] [%reg32]
-        StrOut("add %s, %s", GetX86Register(static_cast<FxScriptRegister>(a_reg)), GetX86Register(static_cast<FxScriptRegister>(b_reg)));
+        StrOut("add %s, %s", a_name, b_name);
+        break;
+    case OpSpecArith_Sub:
+        StrOut("sub %s, %s", a_name, b_name);
+        break;
+    case OpSpecArith_Mul:
+        StrOut("imul %s, %s", a_name, b_name);
+        break;
+    case OpSpecArith_Div:
+    case OpSpecArith_Mod:
+    {
+        // idiv divides edx:eax, the quotient is in eax and the remainder is in edx. The divisor is read from the
+        // stack as it may be in either of them.
+        const bool save_eax = (strcmp(a_name, "eax") != 0);
+        const bool save_edx = (strcmp(a_name, "edx") != 0);
+
+        if (save_eax) {
+            StrOut("push eax");
+        }
+        if (save_edx) {
+            StrOut("push edx");
+        }
+
+        StrOut("push %s", b_name);
+        StrOut("mov eax, %s", a_name);
+        StrOut("cdq");
+        StrOut("idiv dword [esp]");
+        StrOut("add esp, 4");
+        StrOut("mov %s, %s", a_name, (op_spec == OpSpecArith_Div) ? "eax" : "edx");
+
+        if (save_edx) {
+            StrOut("pop edx");
+        }
+        if (save_eax) {
+            StrOut("pop eax");
+        }
+        break;
+    }
+    case OpSpecArith_And:
+        StrOut("and %s, %s", a_name, b_name);
+        break;
+    case OpSpecArith_Or:
+        StrOut("or %s, %s", a_name, b_name);
+        break;
+    case OpSpecArith_Xor:
+        StrOut("xor %s, %s", a_name, b_name);
+        break;
+    case OpSpecArith_Shl:
+    case OpSpecArith_Shr:
+    {
+        // The shift count must be in cl
+        const char* shift_name = (op_spec == OpSpecArith_Shl) ? "shl" : "sar";
+
+        if (strcmp(a_name, "ecx") == 0) {
+            // Swap the value and the count, shift, and swap back
+            StrOut("xchg ecx, %s", b_name);
+            StrOut("%s %s, cl", shift_name, b_name);
+            StrOut("xchg ecx, %s", b_name);
+        }
+        else {
+            StrOut("push ecx");
+            StrOut("mov ecx, %s", b_name);
+            StrOut("%s %s, cl", shift_name, a_name);
+            StrOut("pop ecx");
+        }
+        break;
+    }
+    case OpSpecArith_CmpEq:
+    case OpSpecArith_CmpNe:
+    case OpSpecArith_CmpLt:
+    case OpSpecArith_CmpLe:
+    case OpSpecArith_CmpGt:
+    case OpSpecArith_CmpGe:
+    {
+        const char* set_names[] = { "sete", "setne", "setl", "setle", "setg", "setge" };
+
+        StrOut("cmp %s, %s", a_name, b_name);
+        StrOut("%s %s", set_names[op_spec - OpSpecArith_CmpEq], GetX86LowByteRegister(static_cast<FxScriptRegister>(a_reg)));
+        StrOut("movzx %s, %s", a_name, GetX86LowByteRegister(static_cast<FxScriptRegister>(a_reg)));
+        break;
+    }
+    }
+
+    if (a_reg != dest_reg) {
+        StrOut("mov %s, %s", GetX86Register(dest_reg), a_name);
+        StrOut("pop %s", a_name);
     }
 }
 
@@ -3360,7 +5590,10 @@ void FxScriptTranspilerX86::DoSave(char* s, uint8 op_base, uint8 op_spec)
 
         offset += 8;
 
-        StrOut("mov [ebp %c %d], %s", (offset <= 0 ? '+' : '-'), abs(offset), GetX86Register(static_cast<FxScriptRegister>(reg)));
+        char dest[32];
+        snprintf(dest, sizeof(dest), "dword [ebp %c %d]", (offset <= 0 ? '+' : '-'), abs(offset));
+
+        MoveOut(dest, GetX86Register(static_cast<FxScriptRegister>(reg)));
         //BC_PRINT_OP("save32r %d, %s", offset, GetX86Register(static_cast<FxScriptRegister>(reg)));
     }
     else if (op_spec == OpSpecSave_AbsoluteInt32) {
@@ -3375,7 +5608,11 @@ void FxScriptTranspilerX86::DoSave(char* s, uint8 op_base, uint8 op_spec)
         uint16 reg = Read16();
 
         //StrOut("save32ar %u, %s", offset, GetX86Register(static_cast<FxScriptRegister>(reg)));
-        StrOut("mov [esi %c %d], %s", (offset <= 0 ? '+' : '-'), offset, GetX86Register(static_cast<FxScriptRegister>(reg)));
+
+        char dest[32];
+        snprintf(dest, sizeof(dest), "dword [esi + %u]", offset);
+
+        MoveOut(dest, GetX86Register(static_cast<FxScriptRegister>(reg)));
     }
 }
 
@@ -3439,23 +5676,7 @@ void FxScriptTranspilerX86::DoJump(char* s, uint8 op_base, uint8 op_spec)
 
 void FxScriptTranspilerX86::DoData(char* s, uint8 op_base, uint8 op_spec)
 {
-    if (op_spec == OpSpecData_String) {
-        uint16 length = Read16();
-        char* data_str = FX_SCRIPT_ALLOC_MEMORY(char, length);
-        uint16* data_str16 = reinterpret_cast<uint16*>(data_str);
-
-        uint32 bytecode_end = mBytecodeIndex + length;
-        int data_index = 0;
-        while (mBytecodeIndex < bytecode_end) {
-            uint16 value16 = Read16();
-            data_str16[data_index++] = ((value16 << 8) | (value16 >> 8));
-        }
-
-        StrOut("datastr %d, %.*s", length, length, data_str);
-
-        FX_SCRIPT_FREE(char, data_str);
-    }
-    else if (op_spec == OpSpecData_ParamsStart) {
+    if (op_spec == OpSpecData_ParamsStart) {
         StrOut("; Parameters start");
         //BC_PRINT_OP("paramsstart");
     }
@@ -3481,6 +5702,31 @@ void FxScriptTranspilerX86::DoMove(char* s, uint8 op_base, uint8 op_spec_raw)
         //StrOut("move32 %s, %u", FxScriptBCEmitter::GetRegisterName(op_reg), value);
         StrOut("mov %s, %d", GetX86Register(op_reg), value);
     }
+    else if (op_spec == OpSpecMove_Reg32) {
+        FxScriptRegister src_reg = static_cast<FxScriptRegister>(Read16());
+        MoveOut(GetX86Register(op_reg), GetX86Register(src_reg));
+    }
+}
+
+void FxScriptTranspilerX86::DoFused(char* s, uint8 op_base, uint8 op_spec)
+{
+    if (op_spec == OpSpecFused_AddLocalLocalToLocal) {
+        const int16 dest_offset = Read16() + 8;
+        const int16 a_offset = Read16() + 8;
+        const int16 b_offset = Read16() + 8;
+
+        StrOut("mov eax, [ebp %c %d]", (a_offset <= 0 ? '+' : '-'), abs(a_offset));
+        StrOut("add eax, [ebp %c %d]", (b_offset <= 0 ? '+' : '-'), abs(b_offset));
+        StrOut("mov [ebp %c %d], eax", (dest_offset <= 0 ? '+' : '-'), abs(dest_offset));
+    }
+    else if (op_spec == OpSpecFused_AddImmToLocal) {
+        const int16 offset = Read16() + 8;
+        const int32 value = Read32();
+
+        StrOut("mov eax, [ebp %c %d]", (offset <= 0 ? '+' : '-'), abs(offset));
+        StrOut("add eax, %d", value);
+        StrOut("mov [ebp %c %d], eax", (offset <= 0 ? '+' : '-'), abs(offset));
+    }
 }
 
 
@@ -3501,6 +5747,24 @@ void FxScriptTranspilerX86::Print()
     StrOut("mov ebx, eax");
     StrOut("mov eax, 1");
     StrOut("int 0x80");
+
+    // Storage for the registers that do not fit into x86 registers
+    StrOut("section .bss");
+    StrOut("fx_x5: resd 1");
+    StrOut("fx_x6: resd 1");
+    StrOut("fx_x7: resd 1");
+}
+
+void FxScriptTranspilerX86::MoveOut(const char* dest, const char* src)
+{
+    // x86 cannot move from memory to memory
+    if (strchr(dest, '[') && strchr(src, '[')) {
+        StrOut("push %s", src);
+        StrOut("pop %s", dest);
+        return;
+    }
+
+    StrOut("mov %s, %s", dest, src);
 }
 
 #include <cstdarg>
@@ -3558,6 +5822,9 @@ void FxScriptTranspilerX86::PrintOp()
     case OpBase_Move:
         DoMove(s, op_base, op_spec);
         break;
+    case OpBase_Fused:
+        DoFused(s, op_base, op_spec);
+        break;
     }
     //printf("%-25s\n", s);
 
@@ -1,7 +1,14 @@
 #pragma once
 
+#include <span>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
+#include "FxHashIndex.hpp"
 #include "FxMPPagedArray.hpp"
 #include "FxTokenizer.hpp"
 
@@ -248,6 +255,7 @@ struct FxAstActionCall : public FxAstNode
     }
 
     FxScriptAction* Action = nullptr;
+    FxTokenizer::Token* Name = nullptr;
     FxHash HashedName = 0;
     std::vector<FxAstNode*> Params{}; // FxAstLiteral or FxAstVarRef
 };
@@ -338,6 +346,8 @@ struct FxScriptVar : public FxScriptLabelledData
 
     ~FxScriptVar()
     {
+        // When the memory pool is used, the tokens for external variables are owned by the script's pool
+#ifndef FX_SCRIPT_USE_MEMPOOL
         if (!IsExternal) {
             return;
         }
@@ -350,6 +360,7 @@ struct FxScriptVar : public FxScriptLabelledData
         if (this->Name && this->Name->Start) {
             FX_SCRIPT_FREE(char, this->Name->Start);
         }
+#endif
     }
 };
 
@@ -361,13 +372,25 @@ struct FxScriptExternalFunc
 {
     //using FuncType = void (*)(FxScriptInterpreter& interpreter, std::vector<FxScriptValue>& params, FxScriptValue* return_value);
 
-    using FuncType = void (*)(FxScriptVM* vm, std::vector<FxScriptValue>& params, FxScriptValue* return_value);
+    /**
+     * @brief Callback for an external function. `params` are in the order they were passed in the script, and point
+     * into a buffer owned by the VM that is only valid for the duration of the call.
+     */
+    using FuncType = void (*)(FxScriptVM* vm, std::span<const FxScriptValue> params, FxScriptValue* return_value);
+
+    /**
+     * @brief Marshalling thunk generated by `FxConfigScript::Bind`. The thunk pops its arguments from the VM stack
+     * itself, so `Function` is not used when this is set.
+     */
+    using ThunkType = void (*)(FxScriptVM* vm);
 
     FxHash HashedName = 0;
     FuncType Function = nullptr;
 
     std::vector<FxScriptValue::ValueType> ParameterTypes;
     bool IsVariadic = false;
+
+    ThunkType Thunk = nullptr;
 };
 
 struct FxScriptScope
@@ -375,6 +398,10 @@ struct FxScriptScope
     FxMPPagedArray<FxScriptVar> Vars;
     FxMPPagedArray<FxScriptAction> Actions;
 
+    /** Index from the hashed name to the position of the first var or action with that name */
+    FxHashIndex VarIndex;
+    FxHashIndex ActionIndex;
+
     FxScriptScope* Parent = nullptr;
 
     // This points to the return value for the current scope. If an action returns a value,
@@ -389,26 +416,59 @@ struct FxScriptScope
         }
     }
 
+    FxScriptVar* AddVar(const FxScriptVar& var)
+    {
+        return AddToScope<FxScriptVar>(var, Vars, VarIndex);
+    }
+
+    FxScriptAction* AddAction(const FxScriptAction& action)
+    {
+        return AddToScope<FxScriptAction>(action, Actions, ActionIndex);
+    }
+
     FxScriptVar* FindVarInScope(FxHash hashed_name)
     {
-        return FindInScope<FxScriptVar>(hashed_name, Vars);
+        return FindInScope<FxScriptVar>(hashed_name, Vars, VarIndex);
     }
 
     FxScriptAction* FindActionInScope(FxHash hashed_name)
     {
-        return FindInScope<FxScriptAction>(hashed_name, Actions);
+        return FindInScope<FxScriptAction>(hashed_name, Actions, ActionIndex);
     }
 
     template <typename T> requires std::is_base_of_v<FxScriptLabelledData, T>
-    T* FindInScope(FxHash hashed_name, const FxMPPagedArray<T>& buffer)
+    T* FindInScope(FxHash hashed_name)
     {
-        for (T& var : buffer) {
-            if (var.HashedName == hashed_name) {
-                return &var;
-            }
+        if constexpr (std::is_same_v<T, FxScriptVar>) {
+            return FindVarInScope(hashed_name);
+        }
+        else {
+            return FindActionInScope(hashed_name);
         }
+    }
 
-        return nullptr;
+private:
+    template <typename T>
+    T* AddToScope(const T& value, FxMPPagedArray<T>& buffer, FxHashIndex& index)
+    {
+        const uint32 position = static_cast<uint32>(buffer.Size());
+
+        buffer.Insert(value);
+        index.Insert(value.HashedName, position);
+
+        return &buffer[position];
+    }
+
+    template <typename T>
+    T* FindInScope(FxHash hashed_name, FxMPPagedArray<T>& buffer, const FxHashIndex& index)
+    {
+        const uint32 position = index.Find(hashed_name);
+
+        if (position == FxHashIndex::NotFound) {
+            return nullptr;
+        }
+
+        return &buffer[position];
     }
 };
 
@@ -421,9 +481,17 @@ class FxConfigScript
 
 public:
     FxConfigScript() = default;
+    ~FxConfigScript();
 
     void LoadFile(const char* path);
 
+    /**
+     * @brief Loads a script that is read and tokenized in chunks while it is being parsed, see `FxTokenStream`.
+     * The stream is read until the end of the input, so it must stay open until the script has been parsed.
+     */
+    void LoadStream(FILE* fp);
+    void LoadStream(FxTokenStream::ReadFunc read_func, void* user_data);
+
     void PushScope();
     void PopScope();
 
@@ -440,7 +508,17 @@ public:
 
     FxAstActionDecl* ParseActionDeclare();
 
+    /**
+     * @brief Parses an expression of operands and binary operators.
+     */
     FxAstNode* ParseRhs();
+
+    /**
+     * @brief Parses a single operand of an expression, which is a literal, variable, action call or an expression
+     * in parentheses, with any unary minuses in front of it.
+     */
+    FxAstNode* ParseOperand();
+
     FxAstActionCall* ParseActionCall();
 
     /**
@@ -473,21 +551,51 @@ public:
      */
     bool ExecuteUserCommand(const char* command, FxScriptInterpreter& interpreter);
 
-    Token& GetToken(int offset = 0);
-    Token& EatToken(TT token_type);
+    /**
+     * @brief Gets the type of a token without reading the rest of the token.
+     */
+    TT GetTokenType(int offset = 0);
+    Token GetToken(int offset = 0);
+
+    /**
+     * @brief Checks that the current token is of type `token_type` and moves to the next token.
+     */
+    void EatToken(TT token_type);
+
+    /**
+     * @brief Eats the current token and returns a copy of it that lives for as long as the script, for tokens
+     * that are referenced by the AST.
+     */
+    Token* TakeToken(TT token_type);
 
     void RegisterExternalFunc(FxHash func_name, std::vector<FxScriptValue::ValueType> param_types, FxScriptExternalFunc::FuncType func, bool is_variadic);
 
+    /**
+     * @brief Binds a native function to be called from the script. The parameter and return types are deduced from
+     * `TFunc`, supported types are `int32`, `uint32` and `const char*`. Integer return values are written to XR.
+     * @param name The name of the function in the script
+     */
+    template <auto TFunc>
+    void Bind(const char* name);
+
     void DefineExternalVar(const char* type, const char* name, const FxScriptValue& value);
 
+    /**
+     * @brief Sets if `Parse` prints the AST once the script has been parsed. This is enabled by default.
+     */
+    void SetPrintAst(bool print_ast)
+    {
+        mPrintAst = print_ast;
+    }
+
 private:
     template <typename T> requires std::is_base_of_v<FxScriptLabelledData, T>
-    T* FindLabelledData(FxHash hashed_name, FxMPPagedArray<T>& buffer)
+    T* FindLabelledData(FxHash hashed_name)
     {
         FxScriptScope* scope = mCurrentScope;
 
         while (scope) {
-            T* var = scope->FindInScope<T>(hashed_name, buffer);
+            T* var = scope->template FindInScope<T>(hashed_name);
             if (var) {
                 return var;
             }
@@ -503,7 +611,29 @@ private:
     Token* CreateTokenFromString(FxTokenizer::TokenType type, const char* text);
     void CreateInternalVariableTokens();
 
+    /**
+     * @brief Creates the global scope and internal variables once the script has been loaded.
+     */
+    void CreateGlobalScope();
+
+    /**
+     * @brief Checks if there is a token at `offset` from the current token, reading more of the stream if the
+     * script is being loaded from one.
+     */
+    bool HasToken(int offset = 0);
+
+    /**
+     * @brief Takes ownership of the files included by `tokenizer` so that its tokens stay valid.
+     */
+    void KeepIncludedFiles(FxTokenizer& tokenizer);
+
 private:
+    /**
+     * @brief Owns the AST nodes, fabricated tokens and file data for the script. This is declared first so that it
+     * is destroyed after everything that points into it.
+     */
+    FxMemPool mMemPool;
+
     FxMPPagedArray<FxScriptScope> mScopes;
     FxScriptScope* mCurrentScope;
 
@@ -515,11 +645,27 @@ private:
 
     bool mHasErrors = false;
     bool mInCommandMode = false;
+    bool mPrintAst = true;
 
-    char* mFileData;
-    FxMPPagedArray<Token> mTokens = {};
+    /** The script file and any files it includes, which the tokens point into */
+    std::vector<FxMappedFile> mFiles;
+    std::vector<std::shared_ptr<const FxIncludedFile>> mIncludedFiles;
+
+    FxTokenizer::TokenBuffer mTokens;
     uint32 mTokenIndex = 0;
 
+    /** A binary operator that has its left hand side and is waiting for its right hand side, see `ParseRhs` */
+    struct PendingBinop
+    {
+        FxAstBinop* Binop = nullptr;
+        int Precedence = 0;
+    };
+
+    std::vector<PendingBinop> mPendingBinops;
+
+    /** The stream that the script is being read from, if it was loaded with `LoadStream` */
+    std::unique_ptr<FxTokenStream> mTokenStream = nullptr;
+
     // Name tokens for internal variables
     Token* mTokenReturnVar = nullptr;
 
@@ -631,6 +777,58 @@ public:
     //FxAstBlock* mRootBlock = nullptr;
 };
 
+//////////////////////////////////
+// Script AST Optimizer
+//////////////////////////////////
+
+/**
+ * @brief Simplifies the AST before it is emitted. Binary operations on int literals are folded into a single
+ * literal, and references to int variables that are initialized with a constant and never assigned to again are
+ * replaced with that constant.
+ *
+ * Names are resolved in the same order and with the same scoping as `FxScriptBCEmitter`. References that do not
+ * resolve to a declaration in the script are left as they are.
+ */
+class FxAstOptimizer
+{
+public:
+    FxAstOptimizer() = default;
+
+    void Optimize(FxAstBlock* root_block);
+
+private:
+    struct VarInfo
+    {
+        FxAstVarDecl* Decl = nullptr;
+
+        /** True if every use of the variable can be replaced with `Value` */
+        bool IsConstant = false;
+        int32 Value = 0;
+    };
+
+    void Visit(FxAstNode* node);
+    void VisitAction(FxAstActionDecl* action);
+    void VisitVarDecl(FxAstVarDecl* decl);
+
+    /**
+     * @brief Folds and propagates constants in an rhs.
+     * @return The node that should replace `node` in its parent
+     */
+    FxAstNode* VisitRhs(FxAstNode* node);
+
+    uint32 DeclareVar(FxAstVarDecl* decl);
+    VarInfo* FindVar(FxHash hashed_name);
+
+private:
+    /** Set during the first pass, which only records the variables that are assigned to */
+    bool mIsFindingAssignments = false;
+
+    std::unordered_set<FxAstVarDecl*> mAssignedVars;
+
+    std::vector<VarInfo> mVars;
+    FxScopedHashIndex mVarIndex;
+};
+
 /////////////////////////////////////////////
 // Script Bytecode Emitter
 /////////////////////////////////////////////
@@ -642,6 +840,10 @@ enum FxScriptRegister : uint8
     FX_REG_X1,
     FX_REG_X2,
     FX_REG_X3,
+    FX_REG_X4,
+    FX_REG_X5,
+    FX_REG_X6,
+    FX_REG_X7,
 
     /**
      * @brief Return address register.
@@ -668,8 +870,12 @@ enum FxScriptRegisterFlag : uint16
     FX_REGFLAG_X1 = 0x02,
     FX_REGFLAG_X2 = 0x04,
     FX_REGFLAG_X3 = 0x08,
-    FX_REGFLAG_RA = 0x10,
-    FX_REGFLAG_XR = 0x20,
+    FX_REGFLAG_X4 = 0x10,
+    FX_REGFLAG_X5 = 0x20,
+    FX_REGFLAG_X6 = 0x40,
+    FX_REGFLAG_X7 = 0x80,
+    FX_REGFLAG_RA = 0x100,
+    FX_REGFLAG_XR = 0x200,
 };
 
 inline FxScriptRegisterFlag operator | (FxScriptRegisterFlag a, FxScriptRegisterFlag b)
@@ -698,6 +904,71 @@ struct FxScriptBytecodeActionHandle
     uint32 BytecodeIndex = 0;
 };
 
+/**
+ * @brief Instruction in the small IR that expressions are lowered to before registers are allocated. Each
+ * instruction defines a single value, which is referred to by the index of the instruction.
+ */
+struct FxScriptIRInstr
+{
+    enum OpType : uint8
+    {
+        IR_IMM,      // value = Imm
+        IR_LOAD,     // value = *Var
+        IR_ARITH,    // value = A <OpSpec> B
+        IR_CALL,     // value = Call(...)
+    };
+
+    OpType Op = IR_IMM;
+
+    /** The arithmetic op for `IR_ARITH` */
+    uint8 OpSpec = 0;
+
+    /** Operands of `IR_ARITH`, as the indices of the instructions that define them */
+    uint32 A = 0;
+    uint32 B = 0;
+
+    uint32 Imm = 0;
+
+    FxScriptBytecodeVarHandle* Var = nullptr;
+    FxAstActionCall* Call = nullptr;
+};
+
+/**
+ * @brief Linear scan register allocator for expression IR.
+ *
+ * Values are given a general register for the range between their definition and their last use. Results of
+ * arithmetic and calls stay in XR when nothing else writes to XR before they are used. Values that are live across
+ * a call, or that do not fit into the registers, are spilled to a slot on the stack. Spills are pushed where the
+ * value is defined and popped where it is used, which is always in stack order for an expression tree.
+ */
+class FxScriptRegisterAllocator
+{
+public:
+    /** Location given to values that are spilled to the stack */
+    static constexpr FxScriptRegister Spilled = FX_REG_NONE;
+
+    /** Registers that values can be allocated to */
+    static constexpr FxScriptRegister FirstRegister = FX_REG_X0;
+    static constexpr FxScriptRegister LastRegister = FX_REG_X5;
+
+    /** Registers that spilled operands are popped into before they are used */
+    static constexpr FxScriptRegister ReloadRegisterA = FX_REG_X6;
+    static constexpr FxScriptRegister ReloadRegisterB = FX_REG_X7;
+
+public:
+    void Allocate(const std::vector<FxScriptIRInstr>& instrs);
+
+    FxScriptRegister GetRegister(uint32 value) const
+    {
+        return mRegisters[value];
+    }
+
+private:
+    /** The index of the last instruction that reads each value */
+    std::vector<uint32> mLastUse;
+    std::vector<FxScriptRegister> mRegisters;
+};
+
 class FxScriptBCEmitter
 {
 public:
@@ -725,6 +996,18 @@ public:
 
     FxMPPagedArray<uint8> mBytecode{};
 
+    /**
+     * @brief Read only data referenced by the bytecode, such as string literals. Strings are null terminated and
+     * referenced by their offset.
+     */
+    std::vector<char> mData{};
+
+    /**
+     * @brief The names of the external functions that the bytecode calls, by their hashed name. This is only used to
+     * report calls that cannot be resolved when the program is linked.
+     */
+    std::unordered_map<FxHash, std::string> mExternalCallNames{};
+
     enum VarDeclareMode {
         DECLARE_DEFAULT,
         DECLARE_NO_EMIT,
@@ -768,13 +1051,23 @@ private:
     void EmitJumpCallExternal(FxHash hashed_name);
 
     void EmitMoveInt32(FxScriptRegister reg, uint32 value);
+    void EmitMoveReg32(FxScriptRegister dest_reg, FxScriptRegister src_reg);
 
     void EmitParamsStart();
     void EmitType(FxScriptValue::ValueType type);
 
-    uint32 EmitDataString(char* str, uint16 length);
+    /**
+     * @brief Adds a string to the data section, reusing the existing copy if the same string has been added before.
+     * @return The offset of the string in the data section
+     */
+    uint32 InternDataString(const char* str, uint16 length);
 
-    FxScriptRegister EmitBinop(FxAstBinop* binop, FxScriptBytecodeVarHandle* handle);
+    /**
+     * @brief Lowers an expression to IR, allocates registers for it and emits it.
+     * @return The register that holds the result of the expression
+     */
+    FxScriptRegister EmitExpression(FxAstNode* rhs);
+    uint32 LowerExpression(FxAstNode* node, std::vector<FxScriptIRInstr>& instrs);
 
     FxScriptRegister EmitRhs(FxAstNode* rhs, RhsMode mode, FxScriptBytecodeVarHandle* handle);
 
@@ -801,6 +1094,14 @@ public:
     FxMPPagedArray<FxScriptBytecodeVarHandle> VarHandles;
     std::vector<FxScriptBytecodeActionHandle> ActionHandles;
 private:
+    /** Position of the innermost var handle in `VarHandles` for each name that is in scope */
+    FxScopedHashIndex mVarHandleIndex;
+
+    /** Position of the first action handle in `ActionHandles` for each name */
+    FxHashIndex mActionHandleIndex;
+
+    /** Offset in `mData` of the first string added for each hash */
+    FxHashIndex mDataIndex;
 
     FxScriptRegisterFlag mRegsInUse = FX_REGFLAG_NONE;
 
@@ -822,6 +1123,11 @@ public:
     void Print();
     void PrintOp();
 
+    /**
+     * @brief Prints each string in a data section with its offset.
+     */
+    void PrintData(const std::vector<char>& data);
+
 
 private:
     uint16 Read16();
@@ -836,6 +1142,7 @@ private:
     void DoData(char* s, uint8 op_base, uint8 op_spec);
     void DoType(char* s, uint8 op_base, uint8 op_spec);
     void DoMove(char* s, uint8 op_base, uint8 op_spec);
+    void DoFused(char* s, uint8 op_base, uint8 op_spec);
 
 private:
     uint32 mBytecodeIndex = 0;
@@ -847,6 +1154,176 @@ private:
 // Bytecode VM
 ///////////////////////////////////////////
 
+/**
+ * @brief Every (base, spec) pair that the VM can execute, flattened into a single index for dispatch.
+ */
+enum FxScriptVMHandler : uint8
+{
+    FX_VM_HALT = 0,
+    FX_VM_INVALID,
+
+    FX_VM_PUSH32,
+    FX_VM_PUSH32R,
+    FX_VM_POP32,
+
+    FX_VM_LOAD32,
+    FX_VM_LOAD32A,
+
+    FX_VM_ADD32,
+    FX_VM_SUB32,
+    FX_VM_MUL32,
+    FX_VM_DIV32,
+    FX_VM_MOD32,
+    FX_VM_AND32,
+    FX_VM_OR32,
+    FX_VM_XOR32,
+    FX_VM_SHL32,
+    FX_VM_SHR32,
+
+    FX_VM_CMPEQ32,
+    FX_VM_CMPNE32,
+    FX_VM_CMPLT32,
+    FX_VM_CMPLE32,
+    FX_VM_CMPGT32,
+    FX_VM_CMPGE32,
+
+    FX_VM_SAVE32,
+    FX_VM_SAVE32R,
+    FX_VM_SAVE32A,
+    FX_VM_SAVE32AR,
+
+    FX_VM_JMPR,
+    FX_VM_JMPA,
+    FX_VM_JMPAR,
+    FX_VM_CALLA,
+    FX_VM_RET,
+    FX_VM_CALLEXT,
+
+    FX_VM_PARAMSSTART,
+
+    FX_VM_TYPEINT,
+    FX_VM_TYPESTR,
+
+    FX_VM_MOVE32,
+    FX_VM_MOVE32R,
+
+    FX_VM_ADD32LLL,
+    FX_VM_ADD32IL,
+
+    FX_VM_HANDLER_COUNT,
+};
+
+/**
+ * @brief A decoded instruction. Bytecode is translated into these when a program is linked so that the registers
+ * and operands do not need to be unpacked from the wire format every time an instruction is executed.
+ */
+struct FxScriptVMInstr
+{
+    uint8 Handler = FX_VM_HALT;
+
+    uint8 RegA = FX_REG_NONE;
+    uint8 RegB = FX_REG_NONE;
+
+    /**
+     * @brief Stack offset for loads and saves. Relative to the stack pointer, or absolute for the `a` variants.
+     */
+    int32 Offset = 0;
+
+    /**
+     * @brief Immediate value. For jumps and calls this is the index of the target instruction.
+     */
+    uint32 Imm = 0;
+
+    /**
+     * @brief Stack offsets of the values read by `FX_VM_ADD32LLL`, which saves to `Offset`.
+     */
+    int16 SrcOffsetA = 0;
+    int16 SrcOffsetB = 0;
+};
+
+/**
+ * @brief Linked bytecode that is ready to be executed by the VM. The emitted bytecode is flattened into a single
+ * aligned buffer and translated into an array of fixed width `FxScriptVMInstr`, which is what the VM executes, so
+ * operands are only decoded once at link time. String data is kept in a separate data section so that it does not
+ * take up space between instructions.
+ */
+class FxScriptProgram
+{
+public:
+    FxScriptProgram() = default;
+
+    FxScriptProgram(const FxScriptProgram& other) = delete;
+    FxScriptProgram& operator = (const FxScriptProgram& other) = delete;
+
+    ~FxScriptProgram()
+    {
+        Destroy();
+    }
+
+    /**
+     * @brief Copies the bytecode and data from the emitter into the program and translates the bytecode into decoded
+     * instructions.
+     *
+     * External calls are resolved against `external_funcs` and rewritten to index into the program's function table.
+     * @param bytecode The bytecode output from `FxScriptBCEmitter`
+     * @param data The data section output from `FxScriptBCEmitter`
+     * @param external_funcs The external functions that the program can call
+     * @param external_call_names The names of the called external functions by hashed name, used in link errors
+     * @return false if the program calls an external function that has not been registered
+     */
+    bool Link(FxMPPagedArray<uint8>& bytecode, const std::vector<char>& data, const std::vector<FxScriptExternalFunc>& external_funcs = {}, const std::unordered_map<FxHash, std::string>& external_call_names = {});
+
+    void Destroy();
+
+    const uint8* GetCode() const
+    {
+        return mCode;
+    }
+
+    uint32 GetSize() const
+    {
+        return mCodeSize;
+    }
+
+    const char* GetData() const
+    {
+        return mData.data();
+    }
+
+    const FxScriptVMInstr* GetInstructions() const
+    {
+        return mInstrs;
+    }
+
+    uint32 GetInstructionCount() const
+    {
+        return mInstrCount;
+    }
+
+    const FxScriptExternalFunc* GetExternalFuncs() const
+    {
+        return mExternalFuncs.data();
+    }
+
+private:
+    void Translate();
+    bool ResolveExternalCalls(const std::vector<FxScriptExternalFunc>& external_funcs, const std::unordered_map<FxHash, std::string>& external_call_names);
+
+private:
+    uint8* mCode = nullptr;
+    uint32 mCodeSize = 0;
+
+    std::vector<char> mData;
+
+    FxScriptVMInstr* mInstrs = nullptr;
+    uint32 mInstrCount = 0;
+
+    /**
+     * @brief The external functions called by the program, indexed by the `Imm` of `FX_VM_CALLEXT` instructions.
+     */
+    std::vector<FxScriptExternalFunc> mExternalFuncs;
+};
+
 struct FxScriptVMCallFrame
 {
     uint32 StartStackIndex = 0;
@@ -857,19 +1334,31 @@ class FxScriptVM
 public:
     FxScriptVM() = default;
 
-    void Start(FxMPPagedArray<uint8>&& bytecode)
+    void Start(const FxScriptProgram& program)
     {
-        mBytecode = std::move(bytecode);
+        mData = program.GetData();
+        mInstrs = program.GetInstructions();
+        mExternalFuncs = program.GetExternalFuncs();
+        mPC = 0;
+
         mPushedTypes.Create(64);
 
-        Stack = FX_SCRIPT_ALLOC_MEMORY(uint8, 1024);
+        // Reuse the stack if the VM has already been started
+        if (Stack == nullptr) {
+            Stack = FX_SCRIPT_ALLOC_MEMORY(uint8, 1024);
+        }
+
         //mStackOffset = 0;
         Registers[FX_REG_SP] = 0;
         memset(Registers, 0, sizeof(Registers));
 
-        while (mPC < mBytecode.Size()) {
-            ExecuteOp();
-        }
+        mIsInCallFrame = false;
+        mCallFrameIndex = 0;
+
+        mIsInParams = false;
+        mCurrentType = FxScriptValue::NONETYPE;
+
+        Run();
 
         PrintRegisters();
     }
@@ -881,39 +1370,42 @@ public:
 
     uint32 Pop32();
 
+    /**
+     * @brief Gets a string from the program's data section.
+     * @param location The offset of the string that was pushed to the stack
+     */
+    const char* GetString(uint32 location) const
+    {
+        return mData + location;
+    }
+
 private:
-    void ExecuteOp();
-
-    void DoPush(uint8 op_base, uint8 op_spec);
-    void DoPop(uint8 op_base, uint8 op_spec);
-    void DoLoad(uint8 op_base, uint8 op_spec);
-    void DoArith(uint8 op_base, uint8 op_spec);
-    void DoSave(uint8 op_base, uint8 op_spec);
-    void DoJump(uint8 op_base, uint8 op_spec);
-    void DoData(uint8 op_base, uint8 op_spec);
-    void DoType(uint8 op_base, uint8 op_spec);
-    void DoMove(uint8 op_base, uint8 op_spec);
+    /**
+     * @brief Executes the program until the end of the code is reached.
+     */
+    void Run();
 
-    uint16 Read16();
-    uint32 Read32();
+    void DoCallExternal(uint32 func_index);
+    void TrackPushedType();
 
     FxScriptVMCallFrame& PushCallFrame();
     FxScriptVMCallFrame* GetCurrentCallFrame();
     void PopCallFrame();
 
-    FxScriptExternalFunc* FindExternalAction(FxHash hashed_name);
-
 public:
-    // NONE, X0, X1, X2, X3, RA, XR, SP
+    // NONE, X0-X7, RA, XR, SP
     int32 Registers[FX_REG_SIZE];
 
     uint8* Stack = nullptr;
 
-    std::vector<FxScriptExternalFunc> mExternalFuncs;
-
-    FxMPPagedArray<uint8> mBytecode;
-
 private:
+    const char* mData = nullptr;
+    const FxScriptVMInstr* mInstrs = nullptr;
+    const FxScriptExternalFunc* mExternalFuncs = nullptr;
+
+    /**
+     * @brief Index of the next instruction in `mInstrs`
+     */
     uint32 mPC = 0;
 
 
@@ -925,9 +1417,203 @@ private:
     bool mIsInParams = false;
     FxMPPagedArray<FxScriptValue::ValueType> mPushedTypes;
 
+    /**
+     * @brief Argument buffer for external calls. This is reused between calls and only grows.
+     */
+    std::vector<FxScriptValue> mCallArgs;
+
     FxScriptValue::ValueType mCurrentType = FxScriptValue::NONETYPE;
 };
 
+////////////////////////////////////////////////
+// Bytecode Peephole Optimizer
+////////////////////////////////////////////////
+
+/**
+ * @brief Rewrites the bytecode output from `FxScriptBCEmitter` to remove redundant instructions, such as values
+ * that are pushed to the stack and immediately popped back into a register.
+ *
+ * The bytecode is decoded into a list of instructions, rewritten, and then encoded again. Jump and call targets
+ * and action handles are moved to the new positions of the instructions that they point to.
+ *
+ * Once nothing else can be removed, common sequences of instructions are replaced with superinstructions so that
+ * the VM dispatches fewer instructions.
+ */
+class FxScriptBCOptimizer
+{
+public:
+    FxScriptBCOptimizer(FxScriptBCEmitter& emitter)
+        : mEmitter(emitter)
+    {
+    }
+
+    /**
+     * @brief Optimizes the emitter's bytecode in place. The bytecode is left unchanged if it cannot be decoded.
+     */
+    void Optimize();
+
+private:
+    struct Instr
+    {
+        /**
+         * @brief The decoded instruction. Jump and call targets are stored in `Imm` as indices into `mInstrs`.
+         */
+        FxScriptVMInstr Op;
+
+        /** Position and size of the instruction in the original bytecode */
+        uint32 Offset = 0;
+        uint32 Size = 0;
+
+        /** True if a jump or call can land on this instruction */
+        bool IsJumpTarget = false;
+
+        bool IsRemoved = false;
+    };
+
+    bool Decode(const std::vector<uint8>& code);
+    void Encode();
+
+    /**
+     * @brief Runs each of the rewrite rules over the instructions once.
+     * @return true if any instructions were changed
+     */
+    bool RunPass();
+
+    bool TryFoldPushPop(size_t index);
+    bool TryFoldMovePush(size_t index);
+    bool TryRemoveDeadDefinition(size_t index);
+    bool TryRemoveReload(size_t index);
+    bool TryRemoveUnreachable(size_t index);
+
+    /**
+     * @brief Replaces sequences of instructions with superinstructions. This runs after the other rewrite rules,
+     * which do not understand the fused instructions.
+     */
+    void SelectSuperinstructions();
+
+    bool TryFuseAddToLocal(size_t index);
+
+    /**
+     * @brief Removes an instruction. Jumps to the instruction will land on the next instruction instead.
+     */
+    void RemoveInstr(size_t index);
+
+    /**
+     * @brief Checks if `reg` can be read after the instruction at `index` before it is written to.
+     */
+    bool IsRegisterLive(size_t index, uint8 reg) const;
+
+    /**
+     * @brief Checks if a type has been set for the next value pushed to the stack at the instruction at `index`.
+     */
+    bool IsTypePending(size_t index) const;
+
+    size_t GetNextInstr(size_t index) const;
+    size_t GetPrevInstr(size_t index) const;
+
+    static uint32 GetEncodedSize(const Instr& instr);
+
+private:
+    FxScriptBCEmitter& mEmitter;
+
+    std::vector<Instr> mInstrs;
+};
+
+////////////////////////////////////////////////
+// Native Function Binding
+////////////////////////////////////////////////
+
+template <typename T>
+struct FxScriptBindArg;
+
+template <>
+struct FxScriptBindArg<int32>
+{
+    static constexpr FxScriptValue::ValueType Type = FxScriptValue::INT;
+
+    static int32 Pop(FxScriptVM* vm)
+    {
+        return static_cast<int32>(vm->Pop32());
+    }
+};
+
+template <>
+struct FxScriptBindArg<uint32>
+{
+    static constexpr FxScriptValue::ValueType Type = FxScriptValue::INT;
+
+    static uint32 Pop(FxScriptVM* vm)
+    {
+        return vm->Pop32();
+    }
+};
+
+template <>
+struct FxScriptBindArg<const char*>
+{
+    static constexpr FxScriptValue::ValueType Type = FxScriptValue::STRING;
+
+    static const char* Pop(FxScriptVM* vm)
+    {
+        return vm->GetString(vm->Pop32());
+    }
+};
+
+template <typename TFunc>
+struct FxScriptBindSignature;
+
+template <typename TReturn, typename... TArgs>
+struct FxScriptBindSignature<TReturn (*)(TArgs...)>
+{
+    static_assert(std::is_void_v<TReturn> || std::is_integral_v<TReturn>, "Bound functions must return void or an integer");
+
+    static std::vector<FxScriptValue::ValueType> GetParameterTypes()
+    {
+        return { FxScriptBindArg<std::decay_t<TArgs>>::Type... };
+    }
+
+    template <auto TFunc>
+    static void Thunk(FxScriptVM* vm)
+    {
+        CallWithArgs<TFunc>(vm, std::index_sequence_for<TArgs...> {});
+    }
+
+private:
+    template <auto TFunc, size_t... TIndices>
+    static void CallWithArgs(FxScriptVM* vm, std::index_sequence<TIndices...>)
+    {
+        using ArgsTuple = std::tuple<std::decay_t<TArgs>...>;
+        constexpr size_t last_index = sizeof...(TArgs) - 1;
+
+        ArgsTuple args;
+
+        // Arguments are pushed in order, so the last argument is on the top of the stack
+        ((std::get<last_index - TIndices>(args) = FxScriptBindArg<std::tuple_element_t<last_index - TIndices, ArgsTuple>>::Pop(vm)), ...);
+
+        if constexpr (std::is_void_v<TReturn>) {
+            std::apply(TFunc, args);
+        }
+        else {
+            vm->Registers[FX_REG_XR] = static_cast<int32>(std::apply(TFunc, args));
+        }
+    }
+};
+
+template <auto TFunc>
+void FxConfigScript::Bind(const char* name)
+{
+    using Signature = FxScriptBindSignature<decltype(TFunc)>;
+
+    FxScriptExternalFunc func {
+        .HashedName = FxHashStr(name),
+        .ParameterTypes = Signature::GetParameterTypes(),
+        .IsVariadic = false,
+        .Thunk = &Signature::template Thunk<TFunc>,
+    };
+
+    mExternalFuncs.push_back(func);
+}
+
 ////////////////////////////////////////////////
 // Script Interpreter
 ////////////////////////////////////////////////
@@ -1013,7 +1699,12 @@ private:
     void DoData(char* s, uint8 op_base, uint8 op_spec);
     void DoType(char* s, uint8 op_base, uint8 op_spec);
     void DoMove(char* s, uint8 op_base, uint8 op_spec);
+    void DoFused(char* s, uint8 op_base, uint8 op_spec);
 
+    /**
+     * @brief Outputs a 32 bit move. If both operands are in memory, the value is moved through the stack.
+     */
+    void MoveOut(const char* dest, const char* src);
 
     void StrOut(const char* fmt, ...);
 
@@ -18,6 +18,7 @@ enum OpBase : uint8
     OpBase_Data,
     OpBase_Type,
     OpBase_Move,
+    OpBase_Fused,
 };
 
 enum OpSpecPush : uint8
@@ -37,11 +38,99 @@ enum OpSpecLoad : uint8
     OpSpecLoad_AbsoluteInt32,
 };
 
+/*
+Arithmetic ops take two registers and store the result in XR. Operands are signed, and
+comparisons produce 1 or 0.
+*/
 enum OpSpecArith : uint8
 {
-    OpSpecArith_Add = 1     // ADD [%r32] [%r32]
+    OpSpecArith_Add = 1,    // ADD [%r32] [%r32]
+    OpSpecArith_Sub,        // SUB [%r32] [%r32]
+    OpSpecArith_Mul,        // MUL [%r32] [%r32]
+    OpSpecArith_Div,        // DIV [%r32] [%r32]
+    OpSpecArith_Mod,        // MOD [%r32] [%r32]
+    OpSpecArith_And,        // AND [%r32] [%r32]
+    OpSpecArith_Or,         // OR  [%r32] [%r32]
+    OpSpecArith_Xor,        // XOR [%r32] [%r32]
+    OpSpecArith_Shl,        // SHL [%r32] [%r32]
+    OpSpecArith_Shr,        // SHR [%r32] [%r32]
+
+    OpSpecArith_CmpEq,      // CMPEQ [%r32] [%r32]
+    OpSpecArith_CmpNe,      // CMPNE [%r32] [%r32]
+    OpSpecArith_CmpLt,      // CMPLT [%r32] [%r32]
+    OpSpecArith_CmpLe,      // CMPLE [%r32] [%r32]
+    OpSpecArith_CmpGt,      // CMPGT [%r32] [%r32]
+    OpSpecArith_CmpGe,      // CMPGE [%r32] [%r32]
 };
 
+/*
+Division and modulo by zero produce 0, and INT32_MIN / -1 wraps to INT32_MIN.
+*/
+inline int32 FxScriptDivide32(int32 a, int32 b)
+{
+    if (b == 0) {
+        return 0;
+    }
+
+    if (b == -1) {
+        return static_cast<int32>(0u - static_cast<uint32>(a));
+    }
+
+    return a / b;
+}
+
+inline int32 FxScriptModulo32(int32 a, int32 b)
+{
+    if (b == 0 || b == -1) {
+        return 0;
+    }
+
+    return a % b;
+}
+
+/*
+Evaluates an arithmetic op the same way that the VM does.
+*/
+inline int32 FxScriptEvalArith32(uint8 op_spec, int32 a, int32 b)
+{
+    switch (op_spec) {
+    case OpSpecArith_Add:
+        return static_cast<int32>(static_cast<uint32>(a) + static_cast<uint32>(b));
+    case OpSpecArith_Sub:
+        return static_cast<int32>(static_cast<uint32>(a) - static_cast<uint32>(b));
+    case OpSpecArith_Mul:
+        return static_cast<int32>(static_cast<uint32>(a) * static_cast<uint32>(b));
+    case OpSpecArith_Div:
+        return FxScriptDivide32(a, b);
+    case OpSpecArith_Mod:
+        return FxScriptModulo32(a, b);
+    case OpSpecArith_And:
+        return a & b;
+    case OpSpecArith_Or:
+        return a | b;
+    case OpSpecArith_Xor:
+        return a ^ b;
+    case OpSpecArith_Shl:
+        return static_cast<int32>(static_cast<uint32>(a) << (b & 31));
+    case OpSpecArith_Shr:
+        return a >> (b & 31);
+    case OpSpecArith_CmpEq:
+        return (a == b);
+    case OpSpecArith_CmpNe:
+        return (a != b);
+    case OpSpecArith_CmpLt:
+        return (a < b);
+    case OpSpecArith_CmpLe:
+        return (a <= b);
+    case OpSpecArith_CmpGt:
+        return (a > b);
+    case OpSpecArith_CmpGe:
+        return (a >= b);
+    }
+
+    return 0;
+}
+
 enum OpSpecSave : uint8
 {
     OpSpecSave_Int32 = 1,
@@ -62,10 +151,12 @@ enum OpSpecJump : uint8
     OpSpecJump_CallExternal,
 };
 
+/*
+String data is not stored in the code, it is read from the program's data section by its offset.
+*/
 enum OpSpecData : uint8
 {
-    OpSpecData_String = 1,
-    OpSpecData_ParamsStart,
+    OpSpecData_ParamsStart = 1,
 };
 
 enum OpSpecType : uint8
@@ -76,5 +167,46 @@ enum OpSpecType : uint8
 
 enum OpSpecMove : uint8
 {
-    OpSpecMove_Int32 = 1,
+    OpSpecMove_Int32 = 1,    // MOVE32  [%r32] [i32]
+    OpSpecMove_Reg32,        // MOVE32r [%r32] [%r32]
 };
+
+/*
+Superinstructions that replace a common sequence of ops with a single op. Offsets are relative to
+the stack pointer, as with LOAD32. The result is also stored in XR, as it would be by the ops that
+they replace.
+*/
+enum OpSpecFused : uint8
+{
+    OpSpecFused_AddLocalLocalToLocal = 1,    // ADD32LLL [offset dest] [offset a] [offset b]
+    OpSpecFused_AddImmToLocal,               // ADD32IL  [offset] [i32]
+};
+
+/*
+Operands are stored big endian and are not aligned to their size. These read an operand straight
+from a flat code buffer.
+*/
+
+inline uint16 FxBytecodeRead16(const uint8* data)
+{
+    uint16 value;
+    std::memcpy(&value, data, sizeof(uint16));
+
+    if constexpr (std::endian::native == std::endian::little) {
+        value = FxByteSwap16(value);
+    }
+
+    return value;
+}
+
+inline uint32 FxBytecodeRead32(const uint8* data)
+{
+    uint32 value;
+    std::memcpy(&value, data, sizeof(uint32));
+
+    if constexpr (std::endian::native == std::endian::little) {
+        value = FxByteSwap32(value);
+    }
+
+    return value;
+}
@@ -9,12 +9,10 @@
 
 #include <type_traits>
 
-// #define FX_SCRIPT_USE_MEMPOOL 1
+#define FX_SCRIPT_USE_MEMPOOL 1
 
 #ifdef FX_SCRIPT_USE_MEMPOOL
 
-#include "FxMemPool.hpp"
-
 #define FX_SCRIPT_ALLOC_MEMORY(ptrtype_, size_) FxMemPool::Alloc<ptrtype_>(size_)
 #define FX_SCRIPT_ALLOC_NODE(nodetype_) FxMemPool::Alloc<nodetype_>(sizeof(nodetype_))
 #define FX_SCRIPT_FREE(ptrtype_, ptr_) FxMemPool::Free<ptrtype_>(ptr_)
@@ -26,10 +24,10 @@
 #define FX_SCRIPT_ALLOC_NODE(nodetype_) FxScriptAllocMemory<nodetype_>(sizeof(nodetype_))
 #define FX_SCRIPT_FREE(ptrtype_, ptr_) FxScriptFreeMemory<ptrtype_>(ptr_)
 
-#include <cstdlib>
-
 #endif
 
+#include <cstdlib>
+
 template <typename T>
 T* FxScriptAllocMemory(size_t size)
 {
@@ -70,6 +68,11 @@ typedef float float32;
 typedef double float64;
 
 #include <cstdio>
+#include <cstdlib>
+
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
 
 /////////////////////////////
 // Utility Functions
@@ -84,8 +87,48 @@ public:
         // TODO: readd fopen_s for Windows;
         return std::fopen(path, mode);
     }
+
+    /**
+     * Allocates a block of memory aligned to `alignment` bytes. Must be freed with `FreeAligned`.
+     */
+    static void* AllocAligned(size_t alignment, size_t size)
+    {
+#ifdef _MSC_VER
+        return _aligned_malloc(size, alignment);
+#else
+        // aligned_alloc requires the size to be a multiple of the alignment
+        return std::aligned_alloc(alignment, (size + alignment - 1) & ~(alignment - 1));
+#endif
+    }
+
+    static void FreeAligned(void* ptr)
+    {
+#ifdef _MSC_VER
+        _aligned_free(ptr);
+#else
+        std::free(ptr);
+#endif
+    }
 };
 
+inline uint16 FxByteSwap16(uint16 value)
+{
+#ifdef _MSC_VER
+    return _byteswap_ushort(value);
+#else
+    return __builtin_bswap16(value);
+#endif
+}
+
+inline uint32 FxByteSwap32(uint32 value)
+{
+#ifdef _MSC_VER
+    return _byteswap_ulong(value);
+#else
+    return __builtin_bswap32(value);
+#endif
+}
+
 /////////////////////////////
 // Hashing Functions
 /////////////////////////////
@@ -156,3 +199,6 @@ inline constexpr FxHash FxHashStr(const char *str, uint32 length)
 
     return hash;
 }
+
+// Included last as the pool depends on the types and allocation functions above
+#include "FxMemPool.hpp"
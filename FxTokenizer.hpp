@@ -1,18 +1,153 @@
 #pragma once
 
 #include "FxScriptUtil.hpp"
+#include "FxMappedFile.hpp"
 #include "FxMPPagedArray.hpp"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <charconv>
 #include <cstdlib>
 #include <cstring>
 #include <cassert>
+#include <filesystem>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// The tokenizer scans runs of characters 16 at a time with SSE2 where it is available. Define
+// FX_TOKENIZER_NO_SIMD to always use the scalar path.
+#if !defined(FX_TOKENIZER_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define FX_TOKENIZER_SSE2 1
+#include <emmintrin.h>
+#else
+#define FX_TOKENIZER_SSE2 0
+#endif
+
+// Floating point `std::from_chars` is missing from some standard libraries, fall back to strtof without it.
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+#define FX_TOKENIZER_FLOAT_FROM_CHARS 1
+#else
+#define FX_TOKENIZER_FLOAT_FROM_CHARS 0
+#endif
+
+struct FxIncludedFile;
 
 class FxTokenizer
 {
 private:
 public:
-    const char* SingleCharOperators = "=()[]{}+-$.,;?";
+    static constexpr const char* SingleCharOperators = "=()[]{}+-$.,;?*/%&|^!<>";
+
+    /**
+     * @brief Flags for the role of a character in the tokenizer, looked up through `sCharClasses`.
+     */
+    enum CharClass : uint8
+    {
+        CharClass_Whitespace = 0x01,
+        CharClass_Newline = 0x02,
+        CharClass_Operator = 0x04,
+        CharClass_Quote = 0x08,
+        CharClass_Slash = 0x10,
+        CharClass_Internal = 0x20,
+        CharClass_Null = 0x40,
+        CharClass_Star = 0x80,
+
+        /** Characters that end a run of plain token characters */
+        CharClass_TokenEnd = CharClass_Whitespace | CharClass_Operator | CharClass_Quote | CharClass_Slash | CharClass_Internal | CharClass_Null,
+
+        /** Characters that need to be checked while in a line comment */
+        CharClass_CommentEnd = CharClass_Newline | CharClass_Slash | CharClass_Null,
+
+        /** Characters that need to be checked while in a string */
+        CharClass_StringEnd = CharClass_Quote | CharClass_Slash | CharClass_Null,
+
+        /** Characters that need to be checked while in a block comment */
+        CharClass_BlockCommentEnd = CharClass_Star | CharClass_Null,
+    };
+
+    static constexpr std::array<uint8, 256> sCharClasses = []()
+    {
+        std::array<uint8, 256> classes {};
+
+        classes[' '] = CharClass_Whitespace;
+        classes['\t'] = CharClass_Whitespace;
+        classes['\r'] = CharClass_Whitespace;
+        classes['\n'] = CharClass_Whitespace | CharClass_Newline;
+
+        for (const char* op = SingleCharOperators; *op; op++) {
+            classes[static_cast<uint8>(*op)] |= CharClass_Operator;
+        }
+
+        classes['"'] = CharClass_Quote;
+        classes['/'] |= CharClass_Slash;
+        classes['@'] = CharClass_Internal;
+        classes['\0'] = CharClass_Null;
+        classes['*'] |= CharClass_Star;
+
+        return classes;
+    }();
+
+    static uint8 GetCharClass(char ch)
+    {
+        return sCharClasses[static_cast<uint8>(ch)];
+    }
+
+    /**
+     * @brief Finds the first character in [data, end) that has any of the flags in `char_class`.
+     * @return A pointer to the character, or `end` if there is none.
+     */
+    static char* ScanToCharClass(char* data, char* end, uint8 char_class)
+    {
+#if FX_TOKENIZER_SSE2
+        // Every character with a class is either below 'A' or is one of `[]{}^|`, so only those need to be checked
+        // against the table. Letters, digits and underscores are skipped 16 at a time.
+        const __m128i max_candidate = _mm_set1_epi8('@');
+        const __m128i case_bit = _mm_set1_epi8(0x20);
+        const __m128i high_start = _mm_set1_epi8('{');
+        const __m128i high_end = _mm_set1_epi8('~');
+
+        while (end - data >= 16) {
+            const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+
+            // Unsigned `bytes <= '@'`
+            const __m128i is_low = _mm_cmpeq_epi8(_mm_max_epu8(bytes, max_candidate), max_candidate);
+
+            // Setting the case bit maps '[', ']' and '^' to '{', '}' and '~', so all of them fall in ['{', '~']
+            const __m128i folded = _mm_or_si128(bytes, case_bit);
+            const __m128i is_high = _mm_and_si128(
+                _mm_cmpeq_epi8(_mm_max_epu8(folded, high_start), folded),
+                _mm_cmpeq_epi8(_mm_min_epu8(folded, high_end), folded)
+            );
+
+            uint32 candidates = static_cast<uint32>(_mm_movemask_epi8(_mm_or_si128(is_low, is_high)));
+
+            while (candidates) {
+                const int index = std::countr_zero(candidates);
+
+                if (GetCharClass(data[index]) & char_class) {
+                    return data + index;
+                }
+
+                candidates &= candidates - 1;
+            }
+
+            data += 16;
+        }
+#endif
+
+        while (data < end && !(GetCharClass(*data) & char_class)) {
+            ++data;
+        }
+
+        return data;
+    }
 
     struct State
     {
@@ -20,8 +155,7 @@ public:
         char* DataEnd = nullptr;
         bool InString = false;
 
-        uint32 FileLine = 0;
-        char* StartOfLine = nullptr;
+        uint32 SourceIndex = 0;
     };
 
 
@@ -54,7 +188,30 @@ public:
         Comma,
         Semicolon,
 
+        Asterisk,
+        Slash,
+        Percent,
+        Ampersand,
+        Pipe,
+        Caret,
+        Bang,
+        Less,
+        Greater,
+
+        ShiftLeft,
+        ShiftRight,
+        LessEquals,
+        GreaterEquals,
+        EqualsEquals,
+        BangEquals,
+
         DocComment,
+
+        KeywordFn,
+        KeywordLocal,
+        KeywordGlobal,
+        KeywordReturn,
+        KeywordHelp,
     };
 
     static const char* GetTypeName(TokenType type)
@@ -88,7 +245,30 @@ public:
             "Comma",
             "Semicolon",
 
+            "Asterisk",
+            "Slash",
+            "Percent",
+            "Ampersand",
+            "Pipe",
+            "Caret",
+            "Bang",
+            "Less",
+            "Greater",
+
+            "ShiftLeft",
+            "ShiftRight",
+            "LessEquals",
+            "GreaterEquals",
+            "EqualsEquals",
+            "BangEquals",
+
             "DocComment",
+
+            "KeywordFn",
+            "KeywordLocal",
+            "KeywordGlobal",
+            "KeywordReturn",
+            "KeywordHelp",
         };
 
         /*if (type >= (sizeof(type_names) / sizeof(type_names[0]))) {
@@ -98,23 +278,191 @@ public:
         return type_names[type];
     }
 
+    /**
+     * @brief The token type for each single character operator, or `Unknown` for any other character.
+     */
+    static constexpr std::array<TokenType, 256> sOperatorTypes = []()
+    {
+        std::array<TokenType, 256> types {};
+
+        types['='] = TokenType::Equals;
+        types['('] = TokenType::LParen;
+        types[')'] = TokenType::RParen;
+        types['['] = TokenType::LBracket;
+        types[']'] = TokenType::RBracket;
+        types['{'] = TokenType::LBrace;
+        types['}'] = TokenType::RBrace;
+        types['+'] = TokenType::Plus;
+        types['-'] = TokenType::Minus;
+        types['$'] = TokenType::Dollar;
+        types['.'] = TokenType::Dot;
+        types[','] = TokenType::Comma;
+        types[';'] = TokenType::Semicolon;
+        types['*'] = TokenType::Asterisk;
+        types['/'] = TokenType::Slash;
+        types['%'] = TokenType::Percent;
+        types['&'] = TokenType::Ampersand;
+        types['|'] = TokenType::Pipe;
+        types['^'] = TokenType::Caret;
+        types['!'] = TokenType::Bang;
+        types['<'] = TokenType::Less;
+        types['>'] = TokenType::Greater;
+
+        return types;
+    }();
+
+    /**
+     * @brief Gets the type of a two character operator such as `<<` or `==`.
+     * @return The operator type, or `Unknown` if the characters are not a two character operator.
+     */
+    static constexpr TokenType GetDoubleOperatorType(char first, char second)
+    {
+        if (second == '=') {
+            switch (first) {
+            case '<':
+                return TokenType::LessEquals;
+            case '>':
+                return TokenType::GreaterEquals;
+            case '=':
+                return TokenType::EqualsEquals;
+            case '!':
+                return TokenType::BangEquals;
+            default:;
+            }
+        }
+        else if (first == second) {
+            if (first == '<') {
+                return TokenType::ShiftLeft;
+            }
+            if (first == '>') {
+                return TokenType::ShiftRight;
+            }
+        }
+
+        return TokenType::Unknown;
+    }
+
+    /**
+     * @brief Returns true if `ch` can be the first character of a two character operator.
+     */
+    static constexpr bool IsDoubleOperatorStart(char ch)
+    {
+        return (ch == '<' || ch == '>' || ch == '=' || ch == '!');
+    }
+
+    struct Keyword
+    {
+        const char* Name;
+        uint32 Length;
+        TokenType Type;
+    };
+
+    static constexpr Keyword sKeywords[] = {
+        { "fn", 2, TokenType::KeywordFn },
+        { "local", 5, TokenType::KeywordLocal },
+        { "global", 6, TokenType::KeywordGlobal },
+        { "return", 6, TokenType::KeywordReturn },
+        { "help", 4, TokenType::KeywordHelp },
+    };
+
+    static constexpr uint32 KeywordTableShift = 3;
+    static constexpr uint32 KeywordTableSize = 1 << KeywordTableShift;
+
+    /**
+     * @brief Multiplier that sends the hash of each keyword to a different slot of `sKeywordTable`. It is found at
+     * compile time, so adding a keyword that would collide picks a new multiplier instead of breaking the table.
+     */
+    static constexpr uint32 sKeywordMultiplier = []()
+    {
+        for (uint32 multiplier = 0x9E3779B1u; ; multiplier += 2) {
+            bool used_slots[KeywordTableSize] {};
+            bool is_perfect = true;
+
+            for (const Keyword& keyword : sKeywords) {
+                const uint32 slot = (FxHashStr(keyword.Name) * multiplier) >> (32 - KeywordTableShift);
+
+                if (used_slots[slot]) {
+                    is_perfect = false;
+                    break;
+                }
+
+                used_slots[slot] = true;
+            }
+
+            if (is_perfect) {
+                return multiplier;
+            }
+        }
+    }();
+
+    /**
+     * @brief Perfect hash table of keywords, each slot holds an index into `sKeywords` or -1 if it is empty.
+     */
+    static constexpr std::array<int8, KeywordTableSize> sKeywordTable = []()
+    {
+        std::array<int8, KeywordTableSize> table {};
+
+        for (int8& slot : table) {
+            slot = -1;
+        }
+
+        for (int8 i = 0; i < static_cast<int8>(std::size(sKeywords)); i++) {
+            const uint32 slot = (FxHashStr(sKeywords[i].Name) * sKeywordMultiplier) >> (32 - KeywordTableShift);
+            table[slot] = i;
+        }
+
+        return table;
+    }();
+
+    /**
+     * @brief Gets the keyword token type for an identifier with the hash `hash`. The name is compared as well, so
+     * an identifier that only shares a hash with a keyword is not mistaken for it.
+     * @return The keyword type, or `Identifier` if the name is not a keyword.
+     */
+    static TokenType FindKeyword(const char* name, uint32 length, FxHash hash)
+    {
+        const int8 index = sKeywordTable[(hash * sKeywordMultiplier) >> (32 - KeywordTableShift)];
+
+        if (index < 0) {
+            return TokenType::Identifier;
+        }
+
+        const Keyword& keyword = sKeywords[index];
+
+        if (keyword.Length != length || std::memcmp(keyword.Name, name, length) != 0) {
+            return TokenType::Identifier;
+        }
+
+        return keyword.Type;
+    }
+
     enum class IsNumericResult {
         NaN,
         Integer,
         Fractional
     };
 
+    /**
+     * @brief A single token. Tokens are stored in a `TokenBuffer`, which creates a `Token` from its arrays when the
+     * text of the token is needed.
+     */
     struct Token
     {
         char* Start = nullptr;
-        char* End = nullptr;
 
         FxHash Hash = 0;
         TokenType Type = TokenType::Unknown;
         uint32 Length = 0;
 
-        uint16 FileColumn = 0;
-        uint32 FileLine = 0;
+        /** Set when `Hash` holds the hash of the token. Identifiers are hashed by the tokenizer as they are read. */
+        bool IsHashed = false;
+
+        /** The value of an `Integer` or `Float` token, converted by the tokenizer. */
+        union
+        {
+            int32 ValueInt = 0;
+            float32 ValueFloat;
+        };
 
         void Print(bool no_newline=false) const
         {
@@ -148,10 +496,11 @@ public:
 
         FxHash GetHash()
         {
-            if (Hash != 0) {
-                return Hash;
+            if (!IsHashed) {
+                Hash = FxHashStr(Start, Length);
+                IsHashed = true;
             }
-            return (Hash = FxHashStr(Start, Length));
+            return Hash;
         }
 
         IsNumericResult IsNumeric() const
@@ -185,25 +534,62 @@ public:
             return result;
         }
 
-        int64 ToInt() const
+        /**
+         * @brief Checks if the token is a decimal number, and if it is, converts it into `ValueInt` or `ValueFloat`.
+         */
+        IsNumericResult ParseNumber()
         {
-            char buffer[32];
-            
-            std::strncpy(buffer, Start, Length);
-            buffer[Length] = 0;
+            const char* end = Start + Length;
 
-            char* end = nullptr;
-            return strtoll(buffer, &end, 10);
-        }
+            // Only plain decimal numbers are accepted, from_chars would otherwise also accept names like `inf`
+            if (Length == 0 || !(Start[0] >= '0' && Start[0] <= '9')) {
+                return IsNumericResult::NaN;
+            }
 
-        float32 ToFloat() const
-        {
-            char buffer[32];
-            std::strncpy(buffer, Start, Length);
+            // Parse into a wider type and wrap to 32 bits, so that literals such as 2147483648 can be negated to
+            // INT32_MIN and 4294967295 gives -1.
+            uint64 value = 0;
+            const std::from_chars_result int_result = std::from_chars(Start, end, value);
+
+            if (int_result.ptr == end) {
+                if (int_result.ec == std::errc::result_out_of_range || value > UINT32_MAX) {
+                    printf("[WARNING] Integer literal '%.*s' is out of range, it has been truncated to 32 bits\n", Length, Start);
+                }
+
+                ValueInt = static_cast<int32>(static_cast<uint32>(value));
+
+                return IsNumericResult::Integer;
+            }
+
+            if (*int_result.ptr != '.') {
+                return IsNumericResult::NaN;
+            }
+
+            // The rest of a fractional number must be digits, exponents are not supported
+            for (const char* ch = int_result.ptr + 1; ch < end; ch++) {
+                if (!(*ch >= '0' && *ch <= '9')) {
+                    return IsNumericResult::NaN;
+                }
+            }
+
+#if FX_TOKENIZER_FLOAT_FROM_CHARS
+            std::from_chars(Start, end, ValueFloat, std::chars_format::fixed);
+#else
+            char buffer[64];
+
+            if (Length >= sizeof(buffer)) {
+                printf("[WARNING] Float literal '%.*s' is too long\n", Length, Start);
+                ValueFloat = 0.0f;
+                return IsNumericResult::Fractional;
+            }
+
+            std::memcpy(buffer, Start, Length);
             buffer[Length] = 0;
 
-            char* end = nullptr;
-            return strtof(buffer, &end);
+            ValueFloat = std::strtof(buffer, nullptr);
+#endif
+
+            return IsNumericResult::Fractional;
         }
 
         bool operator == (const char* str) const
@@ -219,16 +605,250 @@ public:
         void Clear()
         {
             Start = nullptr;
-            End = nullptr;
             Length = 0;
+            IsHashed = false;
         }
     };
 
+    /**
+     * @brief Structure of arrays storage for tokens. The parser mostly looks at the type of each token, so the
+     * types are kept in their own dense array and the rest of the token is only read when it is needed.
+     *
+     * Tokens are located by an offset into the sources that were added to the buffer, where each source starts
+     * at the end of the previous one. Line and column numbers are not stored, they are found from a table of line
+     * starts that is built the first time a location in the source is requested.
+     */
+    class TokenBuffer
+    {
+    public:
+        static constexpr uint32 SourceNotFound = UINT32_MAX;
+
+    public:
+        TokenBuffer() = default;
+
+        TokenBuffer(const TokenBuffer& other) = delete;
+        TokenBuffer& operator = (const TokenBuffer& other) = delete;
+
+        TokenBuffer(TokenBuffer&& other) = default;
+        TokenBuffer& operator = (TokenBuffer&& other) = default;
+
+        /**
+         * @brief Adds a source buffer that tokens can point into.
+         * @return The index of the source, used when adding tokens from it.
+         */
+        uint32 AddSource(char* data, uint32 size)
+        {
+            mSources.push_back(Source { .Data = data, .Size = size, .BaseOffset = mSourceEnd });
+            mSourceEnd += size;
+
+            return static_cast<uint32>(mSources.size() - 1);
+        }
+
+        void Add(const Token& token, uint32 source_index)
+        {
+            const Source& source = mSources[source_index];
+
+            uint8 type = static_cast<uint8>(token.Type);
+            uint32 hash_or_value = 0;
+
+            if (IsNumericType(token.Type)) {
+                // Numbers are never looked up by name, so their value is stored in place of the hash
+                std::memcpy(&hash_or_value, &token.ValueInt, sizeof(hash_or_value));
+            }
+            else if (token.IsHashed) {
+                type |= TypeFlag_Hashed;
+                hash_or_value = token.Hash;
+            }
+
+            mTypes.push_back(type);
+            mOffsets.push_back(source.BaseOffset + static_cast<uint32>(token.Start - source.Data));
+            mLengths.push_back(token.Length);
+            mHashOrValues.push_back(hash_or_value);
+        }
+
+        /**
+         * @brief Moves the tokens and sources from `other` to the end of this buffer.
+         */
+        void Append(TokenBuffer& other)
+        {
+            const uint32 base_offset = AddSources(other);
+            AppendRange(other, base_offset, 0, other.Size());
+
+            other.Clear();
+        }
+
+        /**
+         * @brief Adds the sources of `other` to this buffer so that its tokens can be appended with `AppendRange`.
+         * @return The offset to pass to `AppendRange`.
+         */
+        uint32 AddSources(const TokenBuffer& other)
+        {
+            const uint32 base_offset = mSourceEnd;
+
+            for (const Source& source : other.mSources) {
+                AddSource(source.Data, source.Size);
+            }
+
+            return base_offset;
+        }
+
+        /**
+         * @brief Copies the tokens [begin, end) of `other` to the end of this buffer.
+         */
+        void AppendRange(const TokenBuffer& other, uint32 base_offset, uint32 begin, uint32 end)
+        {
+            mTypes.insert(mTypes.end(), other.mTypes.begin() + begin, other.mTypes.begin() + end);
+            mLengths.insert(mLengths.end(), other.mLengths.begin() + begin, other.mLengths.begin() + end);
+            mHashOrValues.insert(mHashOrValues.end(), other.mHashOrValues.begin() + begin, other.mHashOrValues.begin() + end);
+
+            for (uint32 i = begin; i < end; i++) {
+                mOffsets.push_back(base_offset + other.mOffsets[i]);
+            }
+        }
+
+        inline TokenType GetType(uint32 index) const
+        {
+            return static_cast<TokenType>(mTypes[index] & ~TypeFlag_Hashed);
+        }
+
+        inline uint32 GetOffset(uint32 index) const
+        {
+            return mOffsets[index];
+        }
+
+        /**
+         * @brief Creates a `Token` for the token at `index`.
+         */
+        Token Get(uint32 index) const
+        {
+            const uint32 offset = mOffsets[index];
+            const Source& source = mSources[FindSource(offset)];
+
+            Token token;
+            token.Start = source.Data + (offset - source.BaseOffset);
+            token.Length = mLengths[index];
+            token.Type = GetType(index);
+
+            if (IsNumericType(token.Type)) {
+                std::memcpy(&token.ValueInt, &mHashOrValues[index], sizeof(token.ValueInt));
+            }
+            else {
+                token.Hash = mHashOrValues[index];
+                token.IsHashed = (mTypes[index] & TypeFlag_Hashed);
+            }
+
+            return token;
+        }
+
+        /**
+         * @brief Gets the line and column of the token at `index`, starting at 1. This is only intended for
+         * diagnostics, as the lines of the source are counted the first time this is called.
+         */
+        void GetLocation(uint32 index, uint32* line, uint32* column)
+        {
+            const uint32 offset = mOffsets[index];
+            Source& source = mSources[FindSource(offset)];
+
+            if (source.LineStarts.empty()) {
+                source.LineStarts.push_back(0);
+
+                for (uint32 i = 0; i < source.Size; i++) {
+                    if (source.Data[i] == '\n') {
+                        source.LineStarts.push_back(i + 1);
+                    }
+                }
+            }
+
+            const uint32 offset_in_source = offset - source.BaseOffset;
+
+            // Find the last line that starts at or before the token
+            auto line_it = std::upper_bound(source.LineStarts.begin(), source.LineStarts.end(), offset_in_source) - 1;
+
+            (*line) = static_cast<uint32>(line_it - source.LineStarts.begin()) + 1;
+            (*column) = offset_in_source - (*line_it) + 1;
+        }
+
+        void RemoveLast()
+        {
+            mTypes.pop_back();
+            mOffsets.pop_back();
+            mLengths.pop_back();
+            mHashOrValues.pop_back();
+        }
+
+        inline uint32 Size() const
+        {
+            return static_cast<uint32>(mTypes.size());
+        }
+
+        void Clear()
+        {
+            mTypes.clear();
+            mOffsets.clear();
+            mLengths.clear();
+            mHashOrValues.clear();
+
+            mSources.clear();
+            mSourceEnd = 0;
+        }
+
+    private:
+        static constexpr uint8 TypeFlag_Hashed = 0x80;
+
+        struct Source
+        {
+            char* Data = nullptr;
+            uint32 Size = 0;
+            uint32 BaseOffset = 0;
+
+            /** The offset of the start of each line in the source, built on demand */
+            std::vector<uint32> LineStarts;
+        };
+
+        static bool IsNumericType(TokenType type)
+        {
+            return (type == TokenType::Integer || type == TokenType::Float);
+        }
+
+        uint32 FindSource(uint32 offset) const
+        {
+            // Sources are added in order of their base offsets. Streamed scripts add a source for every chunk, so
+            // search for the last source that starts at or before the offset.
+            auto source_it = std::upper_bound(
+                mSources.begin(), mSources.end(), offset,
+                [](uint32 value, const Source& source) { return value < source.BaseOffset; }
+            );
+
+            if (source_it == mSources.begin()) {
+                return SourceNotFound;
+            }
+
+            --source_it;
+
+            if (offset - source_it->BaseOffset >= source_it->Size) {
+                return SourceNotFound;
+            }
+
+            return static_cast<uint32>(source_it - mSources.begin());
+        }
+
+    private:
+        std::vector<uint8> mTypes;
+        std::vector<uint32> mOffsets;
+        std::vector<uint32> mLengths;
+        /** The hash of each token, or the value of integer and float tokens */
+        std::vector<uint32> mHashOrValues;
+
+        std::vector<Source> mSources;
+        uint32 mSourceEnd = 0;
+    };
+
     FxTokenizer() = delete;
 
     FxTokenizer(char* data, uint32 buffer_size)
-        : mData(data), mDataEnd(data + buffer_size), mStartOfLine(data)
+        : mData(data), mDataEnd(data + buffer_size)
     {
+        mSourceIndex = mTokens.AddSource(data, buffer_size);
     }
 
     TokenType GetTokenType(Token& token)
@@ -237,8 +857,23 @@ public:
             return TokenType::DocComment;
         }
 
-        // Check if the token is a number
-        IsNumericResult is_numeric = token.IsNumeric();
+        if (token.Length == 1) {
+            const TokenType operator_type = sOperatorTypes[static_cast<uint8>(token.Start[0])];
+
+            if (operator_type != TokenType::Unknown) {
+                return operator_type;
+            }
+        }
+        else if (token.Length == 2) {
+            const TokenType operator_type = GetDoubleOperatorType(token.Start[0], token.Start[1]);
+
+            if (operator_type != TokenType::Unknown) {
+                return operator_type;
+            }
+        }
+
+        // Check if the token is a number, converting the value if it is
+        IsNumericResult is_numeric = token.ParseNumber();
         switch (is_numeric) {
         case IsNumericResult::Integer:
             return TokenType::Integer;
@@ -264,37 +899,6 @@ public:
             }
         }
 
-        if (token.Length == 1) {
-            switch (token.Start[0]) {
-            case '=':
-                return TokenType::Equals;
-            case '(':
-                return TokenType::LParen;
-            case ')':
-                return TokenType::RParen;
-            case '[':
-                return TokenType::LBracket;
-            case ']':
-                return TokenType::RBracket;
-            case '{':
-                return TokenType::LBrace;
-            case '}':
-                return TokenType::RBrace;
-            case '+':
-                return TokenType::Plus;
-            case '-':
-                return TokenType::Minus;
-            case '$':
-                return TokenType::Dollar;
-            case '.':
-                return TokenType::Dot;
-            case ',':
-                return TokenType::Comma;
-            case ';':
-                return TokenType::Semicolon;
-            }
-        }
-
         return TokenType::Identifier;
     }
 
@@ -312,20 +916,26 @@ public:
             start_ptr = mData;
         }
 
-        token.End = mData;
+        // Only use the running hash if it started at the token and every character of the token went through it
+        const bool is_hash_complete = (mTokenHashStart == token.Start && mTokenHashedLength == token.Length);
+
         token.Type = GetTokenType(token);
 
-        mTokens.Insert(token);
+        if (is_hash_complete) {
+            token.Hash = mTokenHash;
+            token.IsHashed = true;
+        }
+
+        if (token.Type == TokenType::Identifier) {
+            token.Type = FindKeyword(token.Start, token.Length, token.GetHash());
+        }
+
+        mTokenHashedLength = 0;
+
+        mTokens.Add(token, mSourceIndex);
         token.Clear();
 
         token.Start = mData;
-
-        uint16 column = 1;
-        if (mStartOfLine) {
-            column = static_cast<uint16>((mData - mStartOfLine));
-        }
-        token.FileColumn = column;
-        token.FileLine = mFileLine + 1;
     }
 
     bool CheckOperators(Token& current_token, char ch)
@@ -334,7 +944,7 @@ public:
             return false;
         }
 
-        bool is_operator = (strchr(SingleCharOperators, ch) != NULL);
+        bool is_operator = (GetCharClass(ch) & CharClass_Operator);
 
         if (is_operator) {
             // If there is data waiting, submit to the token list
@@ -343,9 +953,24 @@ public:
             // Submit the operator as its own token
             current_token.Increment();
 
+            mTokenHash = HashChar(FX_HASH_FNV1A_SEED, ch);
+            mTokenHashStart = mData;
+            mTokenHashedLength = 1;
+
             char* end_of_operator = mData;
             ++mData;
 
+            // Take the second character of operators such as `<<` and `==`
+            if (mData < mDataEnd && GetDoubleOperatorType(ch, *mData) != TokenType::Unknown) {
+                current_token.Increment();
+
+                mTokenHash = HashChar(mTokenHash, *mData);
+                mTokenHashedLength = 2;
+
+                end_of_operator = mData;
+                ++mData;
+            }
+
             SubmitTokenIfData(current_token, end_of_operator, mData);
 
             return true;
@@ -427,32 +1052,17 @@ public:
         return true;
     }
 
-    void IncludeFile(char* path)
-    {
-        FILE* fp = FxUtil::FileOpen(path, "rb");
-        if (!fp) {
-            printf("Could not open include file '%s'\n", path);
-            return;
-        }
-
-        uint32 include_size = 0;
-        char* include_data = ReadFileData(fp, &include_size);
-
-        // Save the current state of the tokenizer
-        SaveState();
+    /**
+     * @brief Splices the tokens of an included file into the token buffer. The file is tokenized once and kept in
+     * the `FxIncludeCache`, so including the same file again only copies its tokens.
+     */
+    void IncludeFile(const char* path);
 
-        mData = include_data;
-        mDataEnd = include_data + include_size;
-        mInString = false;
-
-        // Tokenize all of the included file
-        Tokenize();
-
-        // Restore back to previous state
-        RestoreState();
-
-        //FxMemPool::Free(include_data);
-    }
+    /**
+     * @brief Loads the files for every `IncludeMarker` in parallel, then rebuilds the token buffer with the tokens
+     * of each file spliced in at its marker. The order of the tokens does not depend on how the loads were scheduled.
+     */
+    void SpliceIncludes();
 
     void TryReadInternalCall()
     {
@@ -464,60 +1074,60 @@ public:
                 return;
             }
 
-            IncludeFile(include_path);
-        }
-    }
-
-    char* ReadFileData(FILE* fp, uint32* file_size_out)
-    {
-        if (!fp || !file_size_out) {
-            return nullptr;
+            // The included files are loaded together and spliced in once the rest of the file has been tokenized
+            mIncludeMarkers.push_back(IncludeMarker { .TokenIndex = mTokens.Size(), .Path = include_path });
         }
-
-        std::fseek(fp, 0, SEEK_END);
-        size_t file_size = std::ftell(fp);
-        (*file_size_out) = file_size;
-
-        std::rewind(fp);
-
-        char* data = FX_SCRIPT_ALLOC_MEMORY(char, file_size);
-
-        size_t read_size = std::fread(data, 1, file_size, fp);
-        if (read_size != file_size) {
-            printf("[WARNING] Error tokenizing data(reading from file) (read=%zu, size=%zu)", read_size, file_size);
+        // @once, the file is only included the first time that it is included
+        else if (ExpectString("once")) {
+            mIsOnce = true;
         }
-
-        return data;
     }
 
     bool IsNewline(char ch)
     {
-        const bool is_newline = (ch == '\n');
-        if (is_newline) {
-            ++mFileLine;
-            mStartOfLine = mData;
-        }
-        return is_newline;
+        return (ch == '\n');
     }
 
+    /**
+     * @brief Tokenizes the data, then loads and splices in any files that it includes.
+     */
     void Tokenize()
     {
-        if (!mTokens.IsInited()) {
-            mTokens.Create(512);
+        TokenizeData();
+
+        if (!mRecordIncludes && !mIncludeMarkers.empty()) {
+            SpliceIncludes();
         }
+    }
 
+    /**
+     * @brief Tokenizes the data without following its includes, which are recorded as `IncludeMarker`s.
+     */
+    void TokenizeData()
+    {
         Token current_token;
         current_token.Start = mData;
 
         bool in_comment = false;
         bool is_doccomment = false;
 
+        char* comment_start = nullptr;
+
         char ch;
 
         while (mData < mDataEnd && ((ch = *(mData)))) {
+            // Whether this starts a comment (or doc comment) depends on the next characters, which may be in the
+            // next chunk
+            if (ch == '/' && mIsPartial && !in_comment && (mData + 2) >= mDataEnd) {
+                SubmitTokenIfData(current_token);
+                mResumePoint = mData;
+                return;
+            }
+
             if (ch == '/' && ((mData + 1) < mDataEnd) && ((*(mData + 1)) == '/')) {
                 SubmitTokenIfData(current_token);
                 in_comment = true;
+                comment_start = mData;
 
                 ++mData;
                 if (*(++mData) == '?') {
@@ -534,25 +1144,58 @@ public:
             if (ch == '/' && ((mData + 1) < mDataEnd) && ((*(mData + 1)) == '*')) {
                 SubmitTokenIfData(current_token);
                 in_comment = true;
+                comment_start = mData;
 
                 ++mData;
 
-                while ((mData + 1 < mDataEnd) && (ch = *(++mData))) {
-                    if (ch == '*' && ((mData + 1) < mDataEnd) && (*(mData + 1) == '/')) {
+                // Skip to each '*' until the end of the comment is found
+                char* scan = mData + 1;
+
+                while (true) {
+                    scan = ScanToCharClass(scan, mDataEnd, CharClass_BlockCommentEnd);
+
+                    if (scan >= mDataEnd) {
+                        if (mIsPartial) {
+                            mResumePoint = comment_start;
+                            return;
+                        }
+
+                        // Stop on the last character of the data
+                        if (mData + 1 < mDataEnd) {
+                            mData = mDataEnd - 1;
+                        }
+                        break;
+                    }
+
+                    mData = scan;
+
+                    if (*scan == '*' && ((scan + 1) < mDataEnd) && (*(scan + 1) == '/')) {
                         current_token.Start = mData;
                         break;
                     }
+
+                    if (*scan == 0) {
+                        break;
+                    }
+
+                    ++scan;
                 }
+
+                ch = *mData;
             }
 
             // If we are in a comment, skip until we hit a newline. Carriage return is eaten by our
             // below by the IsWhitespace check.
             if (in_comment) {
                 if (!IsNewline(ch)) {
-                    ++mData;
+                    // Skip to the next character that could end the comment
+                    char* comment_end = ScanToCharClass(mData + 1, mDataEnd, CharClass_CommentEnd);
+
                     if (is_doccomment) {
-                        current_token.Increment();
+                        current_token.Length += static_cast<uint32>(comment_end - mData);
                     }
+
+                    mData = comment_end;
                     continue;
                 }
 
@@ -573,19 +1216,32 @@ public:
                 // If we are not currently in a string, submit the token if there is data waiting
                 if (!mInString) {
                     SubmitTokenIfData(current_token);
+
+                    // Strings are not hashed while tokenizing, make sure the closing quote does not continue a
+                    // running hash.
+                    mTokenHashStart = nullptr;
+                    mTokenHashedLength = 0;
                 }
 
                 mInString = !mInString;
             }
 
             if (mInString) {
-                ++mData;
-                current_token.Increment();
+                char* string_end = ScanToCharClass(mData + 1, mDataEnd, CharClass_StringEnd);
+
+                current_token.Length += static_cast<uint32>(string_end - mData);
+                mData = string_end;
                 continue;
             }
 
             // Internal call
             if (ch == '@') {
+                // The rest of the call may be in the next chunk, so wait until the whole line is available
+                if (mIsPartial && std::memchr(mData, '\n', mDataEnd - mData) == nullptr) {
+                    mResumePoint = mData;
+                    return;
+                }
+
                 ++mData;
                 TryReadInternalCall();
 
@@ -599,39 +1255,141 @@ public:
                 SubmitTokenIfData(current_token);
 
                 mData++;
+                SkipWhitespace();
+
                 current_token.Start = mData;
                 continue;
             }
 
+            // The second character of a two character operator may be in the next chunk
+            if (mIsPartial && (mData + 1) >= mDataEnd && IsDoubleOperatorStart(ch)) {
+                SubmitTokenIfData(current_token);
+                mResumePoint = mData;
+                return;
+            }
+
             if (CheckOperators(current_token, ch)) {
                 continue;
             }
 
-            mData++;
-            current_token.Increment();
+            // Consume the rest of the plain characters in the token
+            char* token_end = ScanToCharClass(mData + 1, mDataEnd, CharClass_TokenEnd);
+
+            // Hash the characters while they are still in cache. A token that was started by another path (such as
+            // a string) will not match the hashed length and is hashed on demand instead.
+            if (current_token.Length == 0) {
+                mTokenHash = FX_HASH_FNV1A_SEED;
+                mTokenHashStart = mData;
+                mTokenHashedLength = 0;
+            }
+
+            FxHash hash = mTokenHash;
+
+            for (char* run_ch = mData; run_ch < token_end; run_ch++) {
+                hash = HashChar(hash, *run_ch);
+            }
+
+            mTokenHash = hash;
+            mTokenHashedLength += static_cast<uint32>(token_end - mData);
+
+            current_token.Length += static_cast<uint32>(token_end - mData);
+            mData = token_end;
         }
+
+        // Anything that is still open at the end of a partial chunk may continue into the next chunk, so it is
+        // left to be tokenized again once there is more data.
+        if (mIsPartial) {
+            if (in_comment) {
+                mResumePoint = comment_start;
+            }
+            else if (mInString || !current_token.IsEmpty()) {
+                mResumePoint = current_token.Start;
+            }
+            else {
+                mResumePoint = mDataEnd;
+            }
+
+            return;
+        }
+
         SubmitTokenIfData(current_token);
     }
 
+    /**
+     * @brief Marks the data as a chunk of a larger input. Tokenizing stops before any token, string, comment or
+     * internal call that reaches the end of the data, see `GetResumePoint`.
+     */
+    void SetPartial(bool is_partial)
+    {
+        mIsPartial = is_partial;
+    }
+
+    /**
+     * @brief Gets where the next chunk should continue tokenizing from after tokenizing a partial chunk.
+     */
+    char* GetResumePoint() const
+    {
+        return mResumePoint;
+    }
+
     size_t GetTokenIndexInFile(Token& token) const
     {
         assert(token.Start > mData);
         return (token.Start - mData);
     }
 
-    FxMPPagedArray<Token>& GetTokens()
+    TokenBuffer& GetTokens()
     {
         return mTokens;
     }
 
+    /**
+     * @brief Gets the files that were included while tokenizing. These must be kept for as long as the tokens are
+     * in use, as the tokens point into them.
+     */
+    std::vector<std::shared_ptr<const FxIncludedFile>>& GetIncludedFiles()
+    {
+        return mIncludedFiles;
+    }
+
+    /**
+     * @brief The position of an `@include` in a file that was tokenized by the include cache.
+     */
+    struct IncludeMarker
+    {
+        /** The index of the token that the included tokens are inserted before */
+        uint32 TokenIndex;
+        std::string Path;
+    };
+
+    /**
+     * @brief Leaves `@include` calls as `IncludeMarker`s after tokenizing instead of including the files.
+     */
+    void SetRecordIncludes(bool record_includes)
+    {
+        mRecordIncludes = record_includes;
+    }
+
+    std::vector<IncludeMarker>& GetIncludeMarkers()
+    {
+        return mIncludeMarkers;
+    }
+
+    /**
+     * @brief Returns true if the file contained `@once`.
+     */
+    bool IsOnce() const
+    {
+        return mIsOnce;
+    }
+
     void SaveState()
     {
         mSavedState.Data = mData;
         mSavedState.DataEnd = mDataEnd;
         mSavedState.InString = mInString;
 
-        mSavedState.FileLine = mFileLine;
-        mSavedState.StartOfLine = mStartOfLine;
+        mSavedState.SourceIndex = mSourceIndex;
     }
 
     void RestoreState()
@@ -640,15 +1398,61 @@ public:
         mDataEnd = mSavedState.DataEnd;
         mInString = mSavedState.InString;
 
-        mFileLine = mSavedState.FileLine;
-        mStartOfLine = mSavedState.StartOfLine;
-
+        mSourceIndex = mSavedState.SourceIndex;
     }
 
 private:
+    /**
+     * @brief Adds a character to a FNV-1a hash, matching `FxHashStr`.
+     */
+    static inline FxHash HashChar(FxHash hash, char ch)
+    {
+        return (hash ^ static_cast<unsigned char>(ch)) * FX_HASH_FNV1A_PRIME;
+    }
+
     bool IsWhitespace(char ch)
     {
-        return (ch == ' ' || ch == '\t' || IsNewline(ch) || ch == '\r');
+        return (GetCharClass(ch) & CharClass_Whitespace);
+    }
+
+    /**
+     * @brief Skips a run of whitespace.
+     */
+    void SkipWhitespace()
+    {
+#if FX_TOKENIZER_SSE2
+        const __m128i space = _mm_set1_epi8(' ');
+        const __m128i tab = _mm_set1_epi8('\t');
+        const __m128i carriage_return = _mm_set1_epi8('\r');
+        const __m128i newline = _mm_set1_epi8('\n');
+
+        while (mDataEnd - mData >= 16) {
+            const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mData));
+
+            const __m128i is_whitespace = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(bytes, space), _mm_cmpeq_epi8(bytes, tab)),
+                _mm_or_si128(_mm_cmpeq_epi8(bytes, carriage_return), _mm_cmpeq_epi8(bytes, newline))
+            );
+
+            const uint32 whitespace_mask = static_cast<uint32>(_mm_movemask_epi8(is_whitespace));
+
+            // The number of whitespace characters before the first non whitespace character
+            const int run_length = std::countr_one(whitespace_mask);
+
+            if (run_length < 16) {
+                mData += run_length;
+                return;
+            }
+
+            mData += 16;
+        }
+#endif
+
+        char ch;
+
+        while (mData < mDataEnd && (GetCharClass(ch = *mData) & CharClass_Whitespace)) {
+            ++mData;
+        }
     }
 
 private:
@@ -659,8 +1463,412 @@ private:
 
     bool mInString = false;
 
-    uint32 mFileLine = 0;
-    char* mStartOfLine = nullptr;
+    /** The index in the token buffer of the source that is being tokenized */
+    uint32 mSourceIndex = 0;
+
+    /** Running hash of the plain characters in the current token, where it started and how many characters it covers */
+    FxHash mTokenHash = FX_HASH_FNV1A_SEED;
+    char* mTokenHashStart = nullptr;
+    uint32 mTokenHashedLength = 0;
+
+    TokenBuffer mTokens;
+
+    std::vector<std::shared_ptr<const FxIncludedFile>> mIncludedFiles;
+
+    /** The base offset in `mTokens` of the sources of each file that has been spliced in */
+    std::unordered_map<const FxIncludedFile*, uint32> mIncludeBaseOffsets;
+
+    bool mRecordIncludes = false;
+    std::vector<IncludeMarker> mIncludeMarkers;
+
+    bool mIsOnce = false;
+
+    bool mIsPartial = false;
+    char* mResumePoint = nullptr;
+
+    /** How many includes deep the file that is being included is, to stop include cycles */
+    uint32 mIncludeDepth = 0;
+};
+
+/**
+ * @brief A file that has been included and tokenized by the `FxIncludeCache`.
+ */
+struct FxIncludedFile
+{
+    FxMappedFile File;
+
+    /** The tokens of the file itself, the tokens of its own includes are spliced in at each marker */
+    FxTokenizer::TokenBuffer Tokens;
+    std::vector<FxTokenizer::IncludeMarker> Includes;
+
+    FxHash ContentHash = 0;
+    bool IsOnce = false;
+};
+
+/**
+ * @brief Process wide cache of included files. Each file is tokenized once and shared by every script that
+ * includes it.
+ *
+ * A file is retokenized if its modification time changes and its contents no longer match. Entries that are
+ * replaced stay alive for as long as scripts that included them still hold a reference.
+ */
+class FxIncludeCache
+{
+public:
+    static FxIncludeCache& GetGlobal()
+    {
+        static FxIncludeCache cache;
+        return cache;
+    }
+
+    /**
+     * @brief Gets the tokenized file at `path`, loading it if it is not in the cache or if it has changed.
+     * @return The file, or null if it could not be opened.
+     */
+    std::shared_ptr<const FxIncludedFile> Load(const char* path)
+    {
+        std::error_code error;
+
+        // Use the same key for different paths to the same file
+        std::filesystem::path file_path = std::filesystem::weakly_canonical(path, error);
+
+        if (error) {
+            file_path = path;
+        }
+
+        const std::filesystem::file_time_type modified_time = std::filesystem::last_write_time(file_path, error);
+
+        if (error) {
+            return nullptr;
+        }
+
+        std::string key = file_path.string();
+
+        std::shared_ptr<const FxIncludedFile> cached_file = nullptr;
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+
+            auto entry_it = mEntries.find(key);
+
+            if (entry_it != mEntries.end()) {
+                if (entry_it->second.ModifiedTime == modified_time) {
+                    return entry_it->second.File;
+                }
+
+                cached_file = entry_it->second.File;
+            }
+        }
+
+        // The file is read and tokenized without holding the lock so that files can be loaded on multiple threads
+        std::shared_ptr<FxIncludedFile> included_file = std::make_shared<FxIncludedFile>();
+
+        if (!included_file->File.Open(key.c_str())) {
+            return nullptr;
+        }
+
+        char* data = included_file->File.GetData();
+        const uint32 size = static_cast<uint32>(included_file->File.GetSize());
+
+        included_file->ContentHash = FxHashStr(data, size);
+
+        std::shared_ptr<const FxIncludedFile> loaded_file = included_file;
+
+        // The file was touched but its contents are the same, keep the tokens that were already made
+        if (cached_file != nullptr && cached_file->ContentHash == included_file->ContentHash && cached_file->File.GetSize() == size) {
+            loaded_file = cached_file;
+        }
+        else {
+            FxTokenizer tokenizer(data, size);
+            tokenizer.SetRecordIncludes(true);
+            tokenizer.Tokenize();
+
+            included_file->Tokens = std::move(tokenizer.GetTokens());
+            included_file->Includes = std::move(tokenizer.GetIncludeMarkers());
+            included_file->IsOnce = tokenizer.IsOnce();
+        }
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        mEntries[std::move(key)] = Entry { .File = loaded_file, .ModifiedTime = modified_time };
+
+        return loaded_file;
+    }
+
+    /**
+     * @brief Loads the files at `paths` and every file that they include, tokenizing them on worker threads. Files
+     * are loaded one level of includes at a time, as the includes of a file are only known once it is tokenized.
+     * @param max_threads The most threads to load files on, or 0 to use one per hardware thread.
+     */
+    void LoadAll(const std::vector<std::string>& paths, uint32 max_threads = 0)
+    {
+        if (max_threads == 0) {
+            max_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        std::unordered_set<std::string> seen_paths;
+        std::vector<std::string> level_paths;
+
+        for (const std::string& path : paths) {
+            if (seen_paths.insert(path).second) {
+                level_paths.push_back(path);
+            }
+        }
+
+        std::vector<std::shared_ptr<const FxIncludedFile>> level_files;
+
+        while (!level_paths.empty()) {
+            level_files.clear();
+            level_files.resize(level_paths.size());
+
+            const uint32 thread_count = std::min<uint32>(max_threads, level_paths.size());
+
+            std::atomic<uint32> next_index = 0;
 
-    FxMPPagedArray<Token> mTokens;
+            auto load_files = [&]()
+            {
+                uint32 index;
+
+                while ((index = next_index.fetch_add(1)) < level_paths.size()) {
+                    level_files[index] = Load(level_paths[index].c_str());
+                }
+            };
+
+            std::vector<std::thread> threads;
+
+            // The calling thread loads files as well
+            for (uint32 i = 1; i < thread_count; i++) {
+                threads.emplace_back(load_files);
+            }
+
+            load_files();
+
+            for (std::thread& thread : threads) {
+                thread.join();
+            }
+
+            // Gather the includes of this level in the order that they appear
+            std::vector<std::string> next_paths;
+
+            for (const std::shared_ptr<const FxIncludedFile>& file : level_files) {
+                if (file == nullptr) {
+                    continue;
+                }
+
+                for (const FxTokenizer::IncludeMarker& marker : file->Includes) {
+                    if (seen_paths.insert(marker.Path).second) {
+                        next_paths.push_back(marker.Path);
+                    }
+                }
+            }
+
+            level_paths = std::move(next_paths);
+        }
+    }
+
+    void Clear()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mEntries.clear();
+    }
+
+private:
+    struct Entry
+    {
+        std::shared_ptr<const FxIncludedFile> File;
+        std::filesystem::file_time_type ModifiedTime;
+    };
+
+    std::mutex mMutex;
+    std::unordered_map<std::string, Entry> mEntries;
 };
+
+/**
+ * @brief Tokenizes a script in fixed size chunks as it is read, from a file, a pipe or any other source, instead of
+ * reading the whole script first.
+ *
+ * Tokens point into the chunks, so every chunk is kept for as long as the stream. Anything that reaches the end of
+ * a chunk (a token, string, comment or internal call) is carried over and tokenized again along with the next chunk.
+ */
+class FxTokenStream
+{
+public:
+    static constexpr uint32 DefaultChunkSize = 64 * 1024;
+
+    /**
+     * @brief Reads up to `size` bytes of the input into `buffer`.
+     * @return The number of bytes read, or 0 at the end of the input.
+     */
+    using ReadFunc = size_t (*)(void* user_data, char* buffer, size_t size);
+
+public:
+    FxTokenStream(ReadFunc read_func, void* user_data, uint32 chunk_size = DefaultChunkSize)
+        : mReadFunc(read_func), mUserData(user_data), mChunkSize(chunk_size)
+    {
+    }
+
+    explicit FxTokenStream(FILE* fp, uint32 chunk_size = DefaultChunkSize)
+        : FxTokenStream(ReadFromFile, fp, chunk_size)
+    {
+    }
+
+    FxTokenStream(const FxTokenStream& other) = delete;
+    FxTokenStream& operator = (const FxTokenStream& other) = delete;
+
+    /**
+     * @brief Reads and tokenizes the next chunk of the input, adding the tokens to the end of `tokens`.
+     * @return false if the end of the input had already been reached.
+     */
+    bool ReadChunk(FxTokenizer::TokenBuffer& tokens)
+    {
+        if (mIsAtEnd) {
+            return false;
+        }
+
+        // The chunk starts with the data carried over from the previous chunk. The extra byte null terminates the
+        // chunk, as parts of the tokenizer look one character past a token.
+        std::unique_ptr<char[]> chunk = std::make_unique<char[]>(mCarrySize + mChunkSize + 1);
+
+        if (mCarrySize > 0) {
+            std::memcpy(chunk.get(), mCarryStart, mCarrySize);
+        }
+
+        const size_t read_size = mReadFunc(mUserData, chunk.get() + mCarrySize, mChunkSize);
+
+        if (read_size == 0) {
+            mIsAtEnd = true;
+        }
+
+        const uint32 data_size = mCarrySize + static_cast<uint32>(read_size);
+        chunk[data_size] = 0;
+
+        FxTokenizer tokenizer(chunk.get(), data_size);
+        tokenizer.SetPartial(!mIsAtEnd);
+
+        // Pass along the files included by earlier chunks so that files marked with @once are only included once
+        tokenizer.GetIncludedFiles() = std::move(mIncludedFiles);
+        tokenizer.Tokenize();
+
+        tokens.Append(tokenizer.GetTokens());
+
+        mIncludedFiles = std::move(tokenizer.GetIncludedFiles());
+
+        mCarryStart = tokenizer.GetResumePoint();
+        mCarrySize = (mIsAtEnd) ? 0 : static_cast<uint32>((chunk.get() + data_size) - mCarryStart);
+
+        mChunks.push_back(std::move(chunk));
+
+        return true;
+    }
+
+    bool IsAtEnd() const
+    {
+        return mIsAtEnd;
+    }
+
+private:
+    static size_t ReadFromFile(void* user_data, char* buffer, size_t size)
+    {
+        return std::fread(buffer, 1, size, static_cast<FILE*>(user_data));
+    }
+
+private:
+    ReadFunc mReadFunc = nullptr;
+    void* mUserData = nullptr;
+
+    uint32 mChunkSize = DefaultChunkSize;
+
+    std::vector<std::unique_ptr<char[]>> mChunks;
+    std::vector<std::shared_ptr<const FxIncludedFile>> mIncludedFiles;
+
+    /** The unfinished data at the end of the last chunk */
+    char* mCarryStart = nullptr;
+    uint32 mCarrySize = 0;
+
+    bool mIsAtEnd = false;
+};
+
+inline void FxTokenizer::SpliceIncludes()
+{
+    std::vector<std::string> paths;
+    paths.reserve(mIncludeMarkers.size());
+
+    for (const IncludeMarker& marker : mIncludeMarkers) {
+        paths.push_back(marker.Path);
+    }
+
+    // Load every file up front so that splicing only hits the cache
+    FxIncludeCache::GetGlobal().LoadAll(paths);
+
+    TokenBuffer file_tokens = std::move(mTokens);
+    std::vector<IncludeMarker> markers = std::move(mIncludeMarkers);
+
+    mTokens = TokenBuffer();
+    mIncludeMarkers.clear();
+    mIncludeBaseOffsets.clear();
+
+    const uint32 base_offset = mTokens.AddSources(file_tokens);
+
+    uint32 token_index = 0;
+
+    for (const IncludeMarker& marker : markers) {
+        mTokens.AppendRange(file_tokens, base_offset, token_index, marker.TokenIndex);
+        IncludeFile(marker.Path.c_str());
+
+        token_index = marker.TokenIndex;
+    }
+
+    mTokens.AppendRange(file_tokens, base_offset, token_index, file_tokens.Size());
+}
+
+inline void FxTokenizer::IncludeFile(const char* path)
+{
+    constexpr uint32 max_include_depth = 64;
+
+    if (mIncludeDepth >= max_include_depth) {
+        printf("Include depth limit reached including '%s', there may be an include cycle\n", path);
+        return;
+    }
+
+    std::shared_ptr<const FxIncludedFile> included_file = FxIncludeCache::GetGlobal().Load(path);
+
+    if (included_file == nullptr) {
+        printf("Could not open include file '%s'\n", path);
+        return;
+    }
+
+    const bool is_included = (std::find(mIncludedFiles.begin(), mIncludedFiles.end(), included_file) != mIncludedFiles.end());
+
+    if (!is_included) {
+        mIncludedFiles.push_back(included_file);
+    }
+    // Skip files marked with @once that have already been included
+    else if (included_file->IsOnce) {
+        return;
+    }
+
+    const TokenBuffer& included_tokens = included_file->Tokens;
+
+    // A file that is included again points into the sources that were added the first time
+    auto base_offset_it = mIncludeBaseOffsets.find(included_file.get());
+
+    if (base_offset_it == mIncludeBaseOffsets.end()) {
+        base_offset_it = mIncludeBaseOffsets.emplace(included_file.get(), mTokens.AddSources(included_tokens)).first;
+    }
+
+    const uint32 base_offset = base_offset_it->second;
+
+    uint32 token_index = 0;
+
+    ++mIncludeDepth;
+
+    for (const IncludeMarker& marker : included_file->Includes) {
+        mTokens.AppendRange(included_tokens, base_offset, token_index, marker.TokenIndex);
+        IncludeFile(marker.Path.c_str());
+
+        token_index = marker.TokenIndex;
+    }
+
+    --mIncludeDepth;
+
+    mTokens.AppendRange(included_tokens, base_offset, token_index, included_tokens.Size());
+}